@@ -10,6 +10,12 @@ Item {
     Keys.onPressed: {
         if(event.key === Qt.Key_Space) {
             waves.createRandomGauss()
+        } else if(event.key === Qt.Key_S) {
+            waves.saveCheckpoint("waves.checkpoint")
+        } else if(event.key === Qt.Key_L) {
+            waves.loadCheckpoint("waves.checkpoint")
+        } else if(event.key === Qt.Key_T) {
+            telemetryOverlay.visible = !telemetryOverlay.visible
         } else {
             console.log("something else")
         }
@@ -108,4 +114,35 @@ Item {
             }
         }
     }
+
+    Rectangle {
+        id: telemetryOverlay
+        anchors.left: parent.left
+        anchors.top: parent.top
+        anchors.margins: 10
+        width: telemetryText.width + 20
+        height: telemetryText.height + 20
+        color: waves.telemetry.behind ? "#c0802020" : "#c0202020"
+        visible: false
+
+        Text {
+            id: telemetryText
+            x: 10
+            y: 10
+            color: "white"
+            font.family: "monospace"
+            property var telemetry: waves.telemetry
+            text: "steps/s      " + telemetry.stepsPerSecond.toFixed(1) + "\n"
+                + "Mcells/s     " + (telemetry.cellUpdatesPerSecond/1e6).toFixed(1) + "\n"
+                + "step         " + telemetry.stepTime.toFixed(2) + " ms\n"
+                + "normals      " + telemetry.normalsTime.toFixed(2) + " ms\n"
+                + "upload       " + telemetry.uploadTime.toFixed(2) + " ms\n"
+                + "render       " + telemetry.renderTime.toFixed(2) + " ms\n"
+                + "sync         " + telemetry.syncTime.toFixed(2) + " ms\n"
+                + "frame p50    " + telemetry.frameTimeP50.toFixed(1) + " ms\n"
+                + "frame p99    " + telemetry.frameTimeP99.toFixed(1) + " ms\n"
+                + "memory       " + telemetry.residentMemory.toFixed(0) + " MB (solver "
+                + telemetry.solverMemory.toFixed(0) + " MB)"
+        }
+    }
 }
@@ -0,0 +1,412 @@
+#include "benchmark.h"
+#include "simulator.h"
+#include "ensemblesolver.h"
+#include <QElapsedTimer>
+#include <QDebug>
+#include <cmath>
+
+Benchmark::Benchmark(int nx, int ny, int steps) :
+    m_nx(nx),
+    m_ny(ny),
+    m_steps(steps)
+{
+
+}
+
+bool Benchmark::run(QString name)
+{
+    if(name == "storage") {
+        runStorage();
+        return true;
+    } else if(name == "precision") {
+        runPrecision();
+        return true;
+    } else if(name == "convergence") {
+        runConvergence();
+        return true;
+    } else if(name == "integrator") {
+        runIntegrator();
+        return true;
+    } else if(name == "ensemble") {
+        runEnsemble();
+        return true;
+    } else if(name == "layout") {
+        runLayout();
+        return true;
+    }
+
+    qDebug() << "Warning, unknown benchmark " << name << ".";
+    return false;
+}
+
+bool Benchmark::parseFieldStorage(QString name, FieldStorage &storage)
+{
+    if(name == "float32") storage = FieldStorage::Float32;
+    else if(name == "float16") storage = FieldStorage::Float16;
+    else if(name == "int16") storage = FieldStorage::Int16;
+    else if(name == "float64") storage = FieldStorage::Float64;
+    else {
+        qDebug() << "Warning, unknown field storage " << name << ", expected float32, float16, int16 or float64.";
+        return false;
+    }
+    return true;
+}
+
+QString Benchmark::fieldStorageName(FieldStorage storage)
+{
+    switch(storage) {
+    case FieldStorage::Float16: return "float16";
+    case FieldStorage::Int16: return "int16";
+    case FieldStorage::Float64: return "float64";
+    default: return "float32";
+    }
+}
+
+bool Benchmark::parseFieldLayout(QString name, FieldLayout &layout)
+{
+    if(name == "rowmajor") layout = FieldLayout::RowMajor;
+    else if(name == "tiled") layout = FieldLayout::Tiled;
+    else {
+        qDebug() << "Warning, unknown field layout " << name << ", expected rowmajor or tiled.";
+        return false;
+    }
+    return true;
+}
+
+bool Benchmark::parseComputePrecision(QString name, ComputePrecision &precision)
+{
+    if(name == "float") precision = ComputePrecision::Float;
+    else if(name == "double") precision = ComputePrecision::Double;
+    else {
+        qDebug() << "Warning, unknown compute precision " << name << ", expected float or double.";
+        return false;
+    }
+    return true;
+}
+
+bool Benchmark::parseStencilOrder(QString name, StencilOrder &order)
+{
+    if(name == "2") order = StencilOrder::Second;
+    else if(name == "4") order = StencilOrder::Fourth;
+    else if(name == "6") order = StencilOrder::Sixth;
+    else {
+        qDebug() << "Warning, unknown stencil order " << name << ", expected 2, 4 or 6.";
+        return false;
+    }
+    return true;
+}
+
+bool Benchmark::parseTimeIntegrator(QString name, TimeIntegrator &integrator)
+{
+    if(name == "leapfrog") integrator = TimeIntegrator::Leapfrog;
+    else if(name == "adi") integrator = TimeIntegrator::ADI;
+    else {
+        qDebug() << "Warning, unknown time integrator " << name << ", expected leapfrog or adi.";
+        return false;
+    }
+    return true;
+}
+
+void Benchmark::runSolver(QString name, FieldStorage storage, ComputePrecision precision,
+                          std::vector<float> &values, const std::vector<float> *reference)
+{
+    Simulator simulator;
+    WaveSolver &solver = simulator.solver();
+    solver.setGridSize(m_nx, m_ny);
+    solver.reset();
+    solver.setFieldStorage(storage);
+    solver.setComputePrecision(precision);
+    double dt = simulator.safeTimestep();
+
+    QElapsedTimer timer;
+    timer.start();
+    for(int step=0; step<m_steps; step++) {
+        simulator.step(dt);
+    }
+    double elapsed = timer.nsecsElapsed()*1e-9;
+
+    int numCells = m_nx*m_ny;
+    values.resize(numCells);
+    solver.copySolution(&values[0]);
+    double maxError = 0;
+    double sumSquaredError = 0;
+    if(reference) {
+        for(int k=0; k<numCells; k++) {
+            double error = fabs(values[k] - (*reference)[k]);
+            maxError = std::max(maxError, error);
+            sumSquaredError += error*error;
+        }
+    }
+
+    qDebug() << name << ": " << 1e3*elapsed/m_steps << " ms/step, "
+             << 1e-6*numCells*m_steps/elapsed << " Mcells/s, "
+             << solver.memoryUsage()/double(1<<20) << " MB, max error " << maxError
+             << ", rms error " << sqrt(sumSquaredError/numCells);
+}
+
+void Benchmark::runStorage()
+{
+    // Runs the same scenario with every storage policy and compares the final solution with
+    // the float32 run, which is the reference.
+    std::vector<float> reference;
+    std::vector<float> values;
+
+    qDebug() << "Storage benchmark, " << m_nx << "x" << m_ny << " grid, " << m_steps << " steps";
+    runSolver("float32", FieldStorage::Float32, ComputePrecision::Float, reference, 0);
+    runSolver("float16", FieldStorage::Float16, ComputePrecision::Float, values, &reference);
+    runSolver("int16", FieldStorage::Int16, ComputePrecision::Float, values, &reference);
+}
+
+void Benchmark::runPrecision()
+{
+    // Float, mixed (float32 fields, double arithmetic) and double precision compared with the
+    // double run. Use many steps, the difference is the accumulated rounding error.
+    std::vector<float> reference;
+    std::vector<float> values;
+
+    qDebug() << "Precision benchmark, " << m_nx << "x" << m_ny << " grid, " << m_steps << " steps";
+    runSolver("double", FieldStorage::Float64, ComputePrecision::Double, reference, 0);
+    runSolver("mixed", FieldStorage::Float32, ComputePrecision::Double, values, &reference);
+    runSolver("float", FieldStorage::Float32, ComputePrecision::Float, values, &reference);
+}
+
+void Benchmark::runConvergence()
+{
+    // Standing wave u = A cos(kx) cos(ky) cos(wt) with two wavelengths across the periodic
+    // domain, run for 1.25 periods on a range of grid sizes and compared with the exact
+    // solution. The run ends where the wave moves fastest, so the phase error shows up in full.
+    // The time step is a fiftieth of the stable one so that the second order leapfrog error in
+    // time does not hide the spatial error, and the solver runs in double precision so that
+    // rounding does not. The grid size argument is ignored.
+    qDebug() << "Convergence benchmark, 1.25 periods of a standing wave";
+    StencilOrder orders[] = {StencilOrder::Second, StencilOrder::Fourth, StencilOrder::Sixth};
+    for(StencilOrder order : orders) {
+        for(int n : {16, 24, 32, 48, 64, 96, 128}) {
+            Simulator simulator;
+            WaveSolver &solver = simulator.solver();
+            solver.setGridSize(n, n);
+            solver.reset();
+            solver.setStencilOrder(order);
+            solver.setFieldStorage(FieldStorage::Float64);
+            solver.setComputePrecision(ComputePrecision::Double);
+
+            // The wrap makes the last point a neighbour of the first, so the period is n*dx
+            double amplitude = 0.1;
+            double wavelengths = 2;
+            double k = 2*M_PI*wavelengths/(n*solver.dx());
+            double omega = sqrt(2.0)*k;
+            double duration = 1.25*2*M_PI/omega;
+            int steps = ceil(duration/(0.02*simulator.safeTimestep()));
+            double dt = duration/steps;
+
+            std::vector<float> ground(n*n, -5);
+            std::vector<float> values(n*n);
+            std::vector<float> previousValues(n*n);
+            auto exact = [&](int i, int j, double t) {
+                return amplitude*cos(k*i*solver.dx())*cos(k*j*solver.dy())*cos(omega*t);
+            };
+            for(int i=0; i<n; i++) {
+                for(int j=0; j<n; j++) {
+                    values[i*n + j] = exact(i, j, 0);
+                    previousValues[i*n + j] = exact(i, j, -dt);
+                }
+            }
+            solver.setGround(&ground[0]);
+            solver.setSolution(&values[0], &previousValues[0]);
+
+            QElapsedTimer timer;
+            timer.start();
+            for(int step=0; step<steps; step++) {
+                simulator.step(dt);
+            }
+            double elapsed = timer.nsecsElapsed()*1e-9;
+
+            solver.copySolution(&values[0]);
+            double maxError = 0;
+            for(int i=0; i<n; i++) {
+                for(int j=0; j<n; j++) {
+                    maxError = std::max(maxError, fabs(values[i*n + j] - exact(i, j, steps*dt)));
+                }
+            }
+            qDebug() << "order " << int(order) << ", " << n << "x" << n << ", " << n/wavelengths << " points per wavelength, "
+                     << steps << " steps, " << 1e3*elapsed << " ms, relative max error " << maxError/amplitude;
+        }
+    }
+}
+
+void Benchmark::runIntegrator()
+{
+    // A standing wave one wavelength across the periodic domain, the slow large scale motion the
+    // ADI integrator is meant for, run for 1.25 periods with the leapfrog step at the safe time
+    // step and with ADI at multiples of it. Reports the cost of the run, the error against the
+    // exact solution and the phase speed error predicted by the dispersion relation. The wave
+    // runs along the diagonal, where the phase error is about twice the one along x.
+    qDebug() << "Integrator benchmark, " << m_nx << "x" << m_ny << " grid, 1.25 periods of a standing wave";
+    struct Run {
+        TimeIntegrator integrator;
+        double scale;
+    };
+    Run runs[] = {{TimeIntegrator::Leapfrog, 1}, {TimeIntegrator::ADI, 1}, {TimeIntegrator::ADI, 5},
+                  {TimeIntegrator::ADI, 10}, {TimeIntegrator::ADI, 20}, {TimeIntegrator::ADI, 50}};
+    double leapfrogElapsed = 0;
+    for(const Run &run : runs) {
+        Simulator simulator;
+        WaveSolver &solver = simulator.solver();
+        solver.setGridSize(m_nx, m_ny);
+        solver.reset();
+        solver.setTimeIntegrator(run.integrator);
+        simulator.setTimestepScale(run.scale);
+
+        double amplitude = 0.1;
+        double kx = 2*M_PI/(m_nx*solver.dx());
+        double ky = 2*M_PI/(m_ny*solver.dy());
+        double omega = sqrt(kx*kx + ky*ky);
+        double duration = 1.25*2*M_PI/omega;
+        int steps = ceil(duration/simulator.timestep());
+        double dt = duration/steps;
+
+        std::vector<float> ground(m_nx*m_ny, -5);
+        std::vector<float> values(m_nx*m_ny);
+        std::vector<float> previousValues(m_nx*m_ny);
+        auto exact = [&](int i, int j, double t) {
+            return amplitude*cos(kx*i*solver.dx())*cos(ky*j*solver.dy())*cos(omega*t);
+        };
+        for(int i=0; i<m_nx; i++) {
+            for(int j=0; j<m_ny; j++) {
+                values[i*m_ny + j] = exact(i, j, 0);
+                previousValues[i*m_ny + j] = exact(i, j, -dt);
+            }
+        }
+        solver.setGround(&ground[0]);
+        solver.setSolution(&values[0], &previousValues[0]);
+
+        QElapsedTimer timer;
+        timer.start();
+        for(int step=0; step<steps; step++) {
+            simulator.step(dt);
+        }
+        double elapsed = timer.nsecsElapsed()*1e-9;
+        if(run.integrator == TimeIntegrator::Leapfrog) leapfrogElapsed = elapsed;
+
+        solver.copySolution(&values[0]);
+        double maxError = 0;
+        for(int i=0; i<m_nx; i++) {
+            for(int j=0; j<m_ny; j++) {
+                maxError = std::max(maxError, fabs(values[i*m_ny + j] - exact(i, j, steps*dt)));
+            }
+        }
+        QString name = run.integrator == TimeIntegrator::ADI ? "adi" : "leapfrog";
+        qDebug() << name << " x" << run.scale << ": " << steps << " steps, " << 1e3*elapsed/steps << " ms/step, "
+                 << leapfrogElapsed/elapsed << "x the leapfrog speed, relative max error " << maxError/amplitude
+                 << ", predicted phase speed error " << solver.phaseSpeedError(dt, m_nx) << " along x";
+    }
+}
+
+void Benchmark::runEnsemble()
+{
+    // Ensembles of K members of the default scenario, each started from a drop at its own
+    // position, against the same members run one by one with WaveSolver. Reports the time per
+    // member step and the largest difference between the last member and its WaveSolver run.
+    qDebug() << "Ensemble benchmark, " << m_nx << "x" << m_ny << " grid, " << m_steps << " steps";
+    Simulator simulator;
+    WaveSolver &solver = simulator.solver();
+    solver.setGridSize(m_nx, m_ny);
+    solver.reset();
+    double dt = simulator.safeTimestep();
+    int numCells = m_nx*m_ny;
+    std::vector<float> initialValues(numCells);
+    solver.copySolution(&initialValues[0]);
+
+    auto dropX = [&](int member) { return solver.xMin() + (solver.xMax() - solver.xMin())*(member % 7 + 1)/8.0f; };
+    auto dropY = [&](int member) { return solver.yMin() + (solver.yMax() - solver.yMin())*(member % 5 + 1)/6.0f; };
+
+    int memberCounts[] = {1, 4, 8, 16, 32};
+    double separateElapsed = 0;
+    std::vector<float> reference(numCells);
+    for(int numMembers : memberCounts) {
+        // One WaveSolver run of the last member, which also gives the cost of a separate member step
+        int lastMember = numMembers - 1;
+        solver.setSolution(&initialValues[0], &initialValues[0]);
+        solver.addDrop(dropX(lastMember), dropY(lastMember));
+        QElapsedTimer timer;
+        timer.start();
+        for(int step=0; step<m_steps; step++) {
+            solver.step(dt);
+        }
+        separateElapsed = timer.nsecsElapsed()*1e-9/m_steps;
+        solver.copySolution(&reference[0]);
+        solver.setSolution(&initialValues[0], &initialValues[0]);
+
+        EnsembleSolver ensemble;
+        ensemble.setScenario(solver, numMembers);
+        for(int member=0; member<numMembers; member++) {
+            ensemble.addDrop(member, dropX(member), dropY(member));
+        }
+        timer.start();
+        for(int step=0; step<m_steps; step++) {
+            ensemble.step(dt);
+        }
+        double elapsed = timer.nsecsElapsed()*1e-9/m_steps;
+
+        std::vector<float> values(numCells);
+        ensemble.copyMember(lastMember, &values[0]);
+        double maxDifference = 0;
+        for(int k=0; k<numCells; k++) {
+            maxDifference = std::max(maxDifference, double(fabs(values[k] - reference[k])));
+        }
+        qDebug() << "ensemble K=" << numMembers << ": " << 1e3*elapsed << " ms/step, " << 1e3*elapsed/numMembers
+                 << " ms/member step, " << separateElapsed*numMembers/elapsed << "x the speed of separate runs, "
+                 << ensemble.memoryUsage()/double(1<<20) << " MB, max difference " << maxDifference;
+    }
+}
+
+void Benchmark::runLayout()
+{
+    // The default scenario with row-major and tiled fields, each with and without huge pages,
+    // on grids from 512x512 to 8192x8192. The number of steps shrinks with the grid so every run
+    // updates as many cells as --steps steps on the --grid-size grid. The tiled runs must match
+    // the row-major run of the same size exactly. The largest grids need about 4 GB, mostly for
+    // the render meshes.
+    qDebug() << "Layout benchmark, " << m_steps << " steps at " << m_nx << "x" << m_ny << " and as many cell updates at every size";
+    struct Run {
+        QString name;
+        FieldLayout layout;
+        bool hugePages;
+    };
+    Run runs[] = {{"row-major", FieldLayout::RowMajor, false}, {"tiled", FieldLayout::Tiled, false},
+                  {"row-major, huge pages", FieldLayout::RowMajor, true}, {"tiled, huge pages", FieldLayout::Tiled, true}};
+    bool hugePages = CPField::hugePages();
+    for(int n : {512, 1024, 2048, 4096, 8192}) {
+        int steps = std::max(10, int(double(m_steps)*m_nx*m_ny/(double(n)*n)));
+        size_t numCells = size_t(n)*n;
+        std::vector<float> reference(numCells);
+        std::vector<float> values(numCells);
+        for(const Run &run : runs) {
+            // The fields are allocated by setGridSize and again by setFieldLayout
+            CPField::setHugePages(run.hugePages);
+            Simulator simulator;
+            WaveSolver &solver = simulator.solver();
+            solver.setGridSize(n, n);
+            solver.reset();
+            solver.setFieldLayout(run.layout);
+            double dt = simulator.safeTimestep();
+
+            QElapsedTimer timer;
+            timer.start();
+            for(int step=0; step<steps; step++) {
+                simulator.step(dt);
+            }
+            double elapsed = timer.nsecsElapsed()*1e-9;
+
+            std::vector<float> &result = run.layout == FieldLayout::RowMajor && !run.hugePages ? reference : values;
+            solver.copySolution(&result[0]);
+            double maxDifference = 0;
+            for(size_t k=0; k<numCells; k++) {
+                maxDifference = std::max(maxDifference, double(fabs(result[k] - reference[k])));
+            }
+            qDebug() << n << "x" << n << " " << run.name << ": " << steps << " steps, " << 1e3*elapsed/steps << " ms/step, "
+                     << 1e-6*numCells*steps/elapsed << " Mcells/s, max difference " << maxDifference;
+        }
+    }
+    CPField::setHugePages(hugePages);
+}
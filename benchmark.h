@@ -0,0 +1,35 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+#include <QString>
+#include <vector>
+#include "wavesolver.h"
+
+// Headless solver benchmarks, run with --benchmark <name>. Results are printed with qDebug.
+class Benchmark
+{
+private:
+    int m_nx;
+    int m_ny;
+    int m_steps;
+
+    void runStorage();
+    void runPrecision();
+    void runConvergence();
+    void runIntegrator();
+    void runEnsemble();
+    void runLayout();
+    void runSolver(QString name, FieldStorage storage, ComputePrecision precision,
+                   std::vector<float> &values, const std::vector<float> *reference);
+
+public:
+    Benchmark(int nx, int ny, int steps);
+    bool run(QString name);
+    static bool parseFieldStorage(QString name, FieldStorage &storage);
+    static QString fieldStorageName(FieldStorage storage);
+    static bool parseFieldLayout(QString name, FieldLayout &layout);
+    static bool parseComputePrecision(QString name, ComputePrecision &precision);
+    static bool parseStencilOrder(QString name, StencilOrder &order);
+    static bool parseTimeIntegrator(QString name, TimeIntegrator &integrator);
+};
+
+#endif // BENCHMARK_H
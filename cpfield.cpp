@@ -0,0 +1,431 @@
+#include "cpfield.h"
+#include <algorithm>
+#include <atomic>
+#include <new>
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define CPFIELD_F16C
+#define CPFIELD_F16C_TARGET __attribute__((target("avx,f16c")))
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+#if defined(CPFIELD_F16C)
+// Compiled for F16C regardless of the build flags and selected at runtime, so the same
+// binary still runs on x86 processors without the conversion instructions.
+bool hasF16C() {
+#if defined(__F16C__)
+    return true;
+#else
+    static bool supported = __builtin_cpu_supports("f16c") && __builtin_cpu_supports("avx");
+    return supported;
+#endif
+}
+
+CPFIELD_F16C_TARGET int loadHalfF16C(const quint16 *source, float *values, int count) {
+    int k = 0;
+    for(; k+8<=count; k+=8) {
+        __m128i half = _mm_loadu_si128(reinterpret_cast<const __m128i*>(source + k));
+        _mm256_storeu_ps(values + k, _mm256_cvtph_ps(half));
+    }
+    return k;
+}
+
+CPFIELD_F16C_TARGET int storeHalfF16C(const float *values, quint16 *destination, int count) {
+    int k = 0;
+    for(; k+8<=count; k+=8) {
+        __m128i half = _mm256_cvtps_ph(_mm256_loadu_ps(values + k), _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(destination + k), half);
+    }
+    return k;
+}
+#endif
+
+// Rows are converted with the policy's own (vectorized) routines for float, and value by value
+// for double. Every storage type converts to double exactly.
+template<class Storage>
+void loadValues(const typename Storage::type *source, float *values, int count) {
+    Storage::load(source, values, count);
+}
+
+template<class Storage>
+void loadValues(const typename Storage::type *source, double *values, int count) {
+    for(int k=0; k<count; k++) {
+        values[k] = Storage::toFloat(source[k]);
+    }
+}
+
+template<class Storage>
+void storeValues(const float *values, typename Storage::type *destination, int count) {
+    Storage::store(values, destination, count);
+}
+
+template<class Storage>
+void storeValues(const double *values, typename Storage::type *destination, int count) {
+    for(int k=0; k<count; k++) {
+        destination[k] = Storage::fromFloat(values[k]);
+    }
+}
+
+// A segment of a tiled row is converted one tile at a time
+template<class Storage, class Real>
+void loadSegment(const CPField &field, int i, int jBegin, int count, Real *values) {
+    const typename Storage::type *data = field.data<Storage>();
+    if(field.layout() == FieldLayout::RowMajor) {
+        loadValues<Storage>(data + field.offset(i, jBegin), values, count);
+        return;
+    }
+    int jEnd = jBegin + count;
+    for(int j=jBegin; j<jEnd; ) {
+        int piece = std::min(jEnd - j, CPField::tileSize - (j & (CPField::tileSize-1)));
+        loadValues<Storage>(data + field.offset(i, j), values + (j - jBegin), piece);
+        j += piece;
+    }
+}
+
+template<class Storage, class Real>
+void storeSegment(CPField &field, int i, int jBegin, int count, const Real *values) {
+    typename Storage::type *data = field.data<Storage>();
+    if(field.layout() == FieldLayout::RowMajor) {
+        storeValues<Storage>(values, data + field.offset(i, jBegin), count);
+        return;
+    }
+    int jEnd = jBegin + count;
+    for(int j=jBegin; j<jEnd; ) {
+        int piece = std::min(jEnd - j, CPField::tileSize - (j & (CPField::tileSize-1)));
+        storeValues<Storage>(values + (j - jBegin), data + field.offset(i, j), piece);
+        j += piece;
+    }
+}
+
+template<class Real>
+void loadFieldRow(const CPField &field, int i, int jBegin, int count, Real *values) {
+    switch(field.storage()) {
+    case FieldStorage::Float32: loadSegment<Float32Storage>(field, i, jBegin, count, values); break;
+    case FieldStorage::Float16: loadSegment<Float16Storage>(field, i, jBegin, count, values); break;
+    case FieldStorage::Int16: loadSegment<Int16Storage>(field, i, jBegin, count, values); break;
+    case FieldStorage::Float64: loadSegment<Float64Storage>(field, i, jBegin, count, values); break;
+    }
+}
+
+template<class Real>
+void storeFieldRow(CPField &field, int i, int jBegin, int count, const Real *values) {
+    switch(field.storage()) {
+    case FieldStorage::Float32: storeSegment<Float32Storage>(field, i, jBegin, count, values); break;
+    case FieldStorage::Float16: storeSegment<Float16Storage>(field, i, jBegin, count, values); break;
+    case FieldStorage::Int16: storeSegment<Int16Storage>(field, i, jBegin, count, values); break;
+    case FieldStorage::Float64: storeSegment<Float64Storage>(field, i, jBegin, count, values); break;
+    }
+}
+
+std::atomic<bool> useHugePages(false);
+const size_t hugePageSize = 2 << 20;
+const size_t cacheLineSize = 64;
+}
+
+template<class T>
+T *CPFieldAllocator<T>::allocate(size_t count)
+{
+    size_t bytes = std::max(count*sizeof(T), size_t(1));
+    bool huge = useHugePages && bytes >= hugePageSize;
+    size_t alignment = huge ? hugePageSize : cacheLineSize;
+    bytes = (bytes + alignment - 1)/alignment*alignment;
+    void *pointer = 0;
+#ifdef Q_OS_UNIX
+    if(posix_memalign(&pointer, alignment, bytes) != 0) throw std::bad_alloc();
+#ifdef Q_OS_LINUX
+    if(huge) madvise(pointer, bytes, MADV_HUGEPAGE);
+#endif
+#else
+    // Without posix_memalign the fields are only as aligned as malloc makes them
+    pointer = malloc(bytes);
+    if(!pointer) throw std::bad_alloc();
+#endif
+    return static_cast<T*>(pointer);
+}
+
+template class CPFieldAllocator<unsigned char>;
+
+void Float32Storage::load(const type *source, float *values, int count)
+{
+    memcpy(values, source, count*sizeof(float));
+}
+
+void Float32Storage::store(const float *values, type *destination, int count)
+{
+    memcpy(destination, values, count*sizeof(float));
+}
+
+void Float64Storage::load(const type *source, float *values, int count)
+{
+    for(int k=0; k<count; k++) {
+        values[k] = source[k];
+    }
+}
+
+void Float64Storage::store(const float *values, type *destination, int count)
+{
+    for(int k=0; k<count; k++) {
+        destination[k] = values[k];
+    }
+}
+
+float Float16Storage::toFloat(type value)
+{
+    quint32 sign = quint32(value & 0x8000) << 16;
+    quint32 exponent = (value >> 10) & 0x1f;
+    quint32 mantissa = value & 0x3ff;
+    quint32 bits;
+    if(exponent == 0) {
+        if(mantissa == 0) {
+            bits = sign;
+        } else {
+            // Subnormal half, normalize it
+            exponent = 113;
+            while(!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    } else if(exponent == 31) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    float result;
+    memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+Float16Storage::type Float16Storage::fromFloat(float value)
+{
+    quint32 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    quint32 sign = (bits >> 16) & 0x8000;
+    quint32 magnitude = bits & 0x7fffffff;
+
+    if(magnitude >= 0x47800000) {
+        // Too large for a half, or already inf/nan
+        return sign | (magnitude > 0x7f800000 ? 0x7e00 : 0x7c00);
+    }
+    if(magnitude < 0x38800000) {
+        // Subnormal half, round to nearest even
+        if(magnitude < 0x33000000) return sign;
+        quint32 mantissa = (magnitude & 0x7fffff) | 0x800000;
+        int shift = 126 - (magnitude >> 23);
+        quint32 half = mantissa >> shift;
+        quint32 remainder = mantissa & ((1u << shift) - 1);
+        quint32 halfway = 1u << (shift - 1);
+        if(remainder > halfway || (remainder == halfway && (half & 1))) half++;
+        return sign | half;
+    }
+    // Normal half, rebias the exponent and round to nearest even. A carry out of the
+    // mantissa correctly moves on to the next exponent, or to infinity.
+    quint32 half = (magnitude - 0x38000000) >> 13;
+    quint32 remainder = magnitude & 0x1fff;
+    if(remainder > 0x1000 || (remainder == 0x1000 && (half & 1))) half++;
+    return sign | half;
+}
+
+void Float16Storage::load(const type *source, float *values, int count)
+{
+    int k = 0;
+#if defined(CPFIELD_F16C)
+    if(hasF16C()) k = loadHalfF16C(source, values, count);
+#elif defined(__aarch64__)
+    for(; k+4<=count; k+=4) {
+        vst1q_f32(values + k, vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(source + k))));
+    }
+#endif
+    for(; k<count; k++) {
+        values[k] = toFloat(source[k]);
+    }
+}
+
+void Float16Storage::store(const float *values, type *destination, int count)
+{
+    int k = 0;
+#if defined(CPFIELD_F16C)
+    if(hasF16C()) k = storeHalfF16C(values, destination, count);
+#elif defined(__aarch64__)
+    for(; k+4<=count; k+=4) {
+        vst1_u16(destination + k, vreinterpret_u16_f16(vcvt_f16_f32(vld1q_f32(values + k))));
+    }
+#endif
+    for(; k<count; k++) {
+        destination[k] = fromFloat(values[k]);
+    }
+}
+
+void Int16Storage::load(const type *source, float *values, int count)
+{
+    for(int k=0; k<count; k++) {
+        values[k] = toFloat(source[k]);
+    }
+}
+
+void Int16Storage::store(const float *values, type *destination, int count)
+{
+    for(int k=0; k<count; k++) {
+        destination[k] = fromFloat(values[k]);
+    }
+}
+
+CPField::CPField(FieldStorage storage) :
+    m_storage(storage),
+    m_layout(FieldLayout::RowMajor),
+    m_nx(0),
+    m_ny(0),
+    m_tilesJ(0)
+{
+
+}
+
+int CPField::bytesPerValue(FieldStorage storage)
+{
+    switch(storage) {
+    case FieldStorage::Float16: return sizeof(Float16Storage::type);
+    case FieldStorage::Int16: return sizeof(Int16Storage::type);
+    case FieldStorage::Float64: return sizeof(Float64Storage::type);
+    default: return sizeof(Float32Storage::type);
+    }
+}
+
+bool CPField::hugePages()
+{
+    return useHugePages;
+}
+
+void CPField::setHugePages(bool enabled)
+{
+    // Applies to the fields allocated from now on
+    useHugePages = enabled;
+}
+
+void CPField::resize(int nx, int ny)
+{
+    m_nx = nx;
+    m_ny = ny;
+    m_tilesJ = (ny + tileSize - 1) >> tileShift;
+    size_t numValues = size_t(nx)*ny;
+    if(m_layout == FieldLayout::Tiled) {
+        size_t tilesI = (nx + tileSize - 1) >> tileShift;
+        numValues = tilesI*m_tilesJ*tileStride;
+    }
+    m_data.assign(numValues*bytesPerValue(m_storage), 0);
+}
+
+void CPField::setLayout(FieldLayout layout)
+{
+    if(layout == m_layout) return;
+
+    CPField converted(m_storage);
+    converted.m_layout = layout;
+    converted.resize(m_nx, m_ny);
+    std::vector<double> row(m_ny);
+    for(int i=0; i<m_nx; i++) {
+        loadRow(i, &row[0]);
+        converted.storeRow(i, &row[0]);
+    }
+    swap(converted);
+}
+
+void CPField::setStorage(FieldStorage storage)
+{
+    if(storage == m_storage) return;
+
+    // Convert through double one row at a time, which is exact for every storage type
+    CPField converted(storage);
+    converted.m_layout = m_layout;
+    converted.resize(m_nx, m_ny);
+    std::vector<double> row(m_ny);
+    for(int i=0; i<m_nx; i++) {
+        loadRow(i, &row[0]);
+        converted.storeRow(i, &row[0]);
+    }
+    swap(converted);
+}
+
+void CPField::loadRow(int i, float *values) const
+{
+    loadFieldRow(*this, i, 0, m_ny, values);
+}
+
+void CPField::loadRow(int i, double *values) const
+{
+    loadFieldRow(*this, i, 0, m_ny, values);
+}
+
+void CPField::storeRow(int i, const float *values)
+{
+    storeFieldRow(*this, i, 0, m_ny, values);
+}
+
+void CPField::storeRow(int i, const double *values)
+{
+    storeFieldRow(*this, i, 0, m_ny, values);
+}
+
+void CPField::loadRowSegment(int i, int jBegin, int count, float *values) const
+{
+    loadFieldRow(*this, i, jBegin, count, values);
+}
+
+void CPField::loadRowSegment(int i, int jBegin, int count, double *values) const
+{
+    loadFieldRow(*this, i, jBegin, count, values);
+}
+
+void CPField::storeRowSegment(int i, int jBegin, int count, const float *values)
+{
+    storeFieldRow(*this, i, jBegin, count, values);
+}
+
+void CPField::storeRowSegment(int i, int jBegin, int count, const double *values)
+{
+    storeFieldRow(*this, i, jBegin, count, values);
+}
+
+float CPField::value(int i, int j) const
+{
+    switch(m_storage) {
+    case FieldStorage::Float16: return Float16Storage::toFloat(data<Float16Storage>()[offset(i,j)]);
+    case FieldStorage::Int16: return Int16Storage::toFloat(data<Int16Storage>()[offset(i,j)]);
+    case FieldStorage::Float64: return data<Float64Storage>()[offset(i,j)];
+    default: return data<Float32Storage>()[offset(i,j)];
+    }
+}
+
+void CPField::setValue(int i, int j, float value)
+{
+    switch(m_storage) {
+    case FieldStorage::Float16: data<Float16Storage>()[offset(i,j)] = Float16Storage::fromFloat(value); break;
+    case FieldStorage::Int16: data<Int16Storage>()[offset(i,j)] = Int16Storage::fromFloat(value); break;
+    case FieldStorage::Float64: data<Float64Storage>()[offset(i,j)] = value; break;
+    default: data<Float32Storage>()[offset(i,j)] = value; break;
+    }
+}
+
+void CPField::fill(float value)
+{
+    std::vector<float> row(m_ny, value);
+    for(int i=0; i<m_nx; i++) {
+        storeRow(i, &row[0]);
+    }
+}
+
+void CPField::swap(CPField &field)
+{
+    std::swap(m_storage, field.m_storage);
+    std::swap(m_nx, field.m_nx);
+    std::swap(m_ny, field.m_ny);
+    std::swap(m_layout, field.m_layout);
+    std::swap(m_tilesJ, field.m_tilesJ);
+    m_data.swap(field.m_data);
+}
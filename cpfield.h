@@ -0,0 +1,152 @@
+#ifndef CPFIELD_H
+#define CPFIELD_H
+#include <QtGlobal>
+#include <vector>
+#include <cstring>
+#include <cstdlib>
+
+enum class FieldStorage {Float32 = 0, Float16 = 1, Int16 = 2, Float64 = 3};
+// Order of the values in memory. Tiled stores square tiles of CPField::tileSize values one
+// after the other, with the tiles and the values inside a tile in row-major order.
+enum class FieldLayout {RowMajor = 0, Tiled = 1};
+
+// Storage policies. Each one defines how a value is stored and how rows of values are
+// converted to and from float, which is what the solver kernels compute in unless the
+// solver runs in double precision.
+class Float32Storage
+{
+public:
+    typedef float type;
+    static inline float toFloat(type value) { return value; }
+    static inline type fromFloat(float value) { return value; }
+    static void load(const type *source, float *values, int count);
+    static void store(const float *values, type *destination, int count);
+};
+
+// Double precision for long runs where the float32 rounding error accumulates
+class Float64Storage
+{
+public:
+    typedef double type;
+    static inline double toFloat(type value) { return value; }
+    static inline type fromFloat(double value) { return value; }
+    static void load(const type *source, float *values, int count);
+    static void store(const float *values, type *destination, int count);
+};
+
+// IEEE 754 half precision, converted with F16C on x86 and NEON on ARMv8 when available
+class Float16Storage
+{
+public:
+    typedef quint16 type;
+    static float toFloat(type value);
+    static type fromFloat(float value);
+    static void load(const type *source, float *values, int count);
+    static void store(const float *values, type *destination, int count);
+};
+
+// Fixed point with 1/2048 resolution, covering heights in [-16, 16)
+class Int16Storage
+{
+public:
+    typedef qint16 type;
+    static constexpr float scale = 2048.0f;
+    static inline float toFloat(type value) { return value*(1.0f/scale); }
+    static inline type fromFloat(float value) {
+        float scaled = value*scale;
+        scaled = scaled < -32768.0f ? -32768.0f : (scaled > 32767.0f ? 32767.0f : scaled);
+        return type(scaled < 0 ? scaled - 0.5f : scaled + 0.5f);
+    }
+    static void load(const type *source, float *values, int count);
+    static void store(const float *values, type *destination, int count);
+};
+
+// Cache line aligned storage for the fields. With CPField::setHugePages, allocations of at
+// least a huge page are aligned to one and advised to the kernel as transparent huge pages
+// before they are first touched.
+template<class T>
+class CPFieldAllocator
+{
+public:
+    typedef T value_type;
+    CPFieldAllocator() { }
+    template<class U>
+    CPFieldAllocator(const CPFieldAllocator<U> &) { }
+    T *allocate(size_t count);
+    void deallocate(T *pointer, size_t) { free(pointer); }
+    template<class U>
+    bool operator==(const CPFieldAllocator<U> &) const { return true; }
+    template<class U>
+    bool operator!=(const CPFieldAllocator<U> &) const { return false; }
+};
+
+// Packed scalar field used by the solver. Unlike CPGrid, which interleaves positions and
+// normals for rendering, the values are contiguous so the stencil kernels only stream the
+// data they need. Rows are along j, and the row-major layout stores them one after the
+// other. The tiled layout pads the grid to whole tiles, so that a strip of tileSize columns
+// is contiguous in memory and a kernel that walks it row by row touches a few pages instead
+// of one per row. The kernels only see the layout through the row accessors.
+class CPField
+{
+private:
+    FieldStorage m_storage;
+    FieldLayout m_layout;
+    int m_nx;
+    int m_ny;
+    int m_tilesJ;
+    std::vector<unsigned char, CPFieldAllocator<unsigned char>> m_data;
+
+public:
+    static const int tileShift = 6;
+    static const int tileSize = 1 << tileShift;
+    // Values between the starts of consecutive tiles. The padding keeps the tiles of a strip
+    // from all starting at the same offset in a page, where they would compete for the same
+    // few cache sets.
+    static const int tileStride = tileSize*tileSize + 16;
+
+    CPField(FieldStorage storage = FieldStorage::Float32);
+    void resize(int nx, int ny);
+    int nx() const { return m_nx; }
+    int ny() const { return m_ny; }
+    FieldStorage storage() const { return m_storage; }
+    void setStorage(FieldStorage storage);
+    FieldLayout layout() const { return m_layout; }
+    void setLayout(FieldLayout layout);
+    static int bytesPerValue(FieldStorage storage);
+    static bool hugePages();
+    static void setHugePages(bool enabled);
+    size_t memoryUsage() const { return m_data.size(); }
+
+    // Row-major number of a cell, for arrays that run alongside the field. It is not the
+    // position of the value in a tiled field.
+    inline int index(int i, int j) const { return i*m_ny + j; }
+    inline int idxI(int i) const { return (i + m_nx) % m_nx; }
+    inline int idxJ(int j) const { return (j + m_ny) % m_ny; }
+    // Position of the value of a cell in data()
+    inline size_t offset(int i, int j) const {
+        if(m_layout == FieldLayout::RowMajor) return size_t(i)*m_ny + j;
+        size_t tile = size_t(i >> tileShift)*m_tilesJ + (j >> tileShift);
+        return tile*tileStride + ((i & (tileSize-1)) << tileShift) + (j & (tileSize-1));
+    }
+
+    template<class Storage>
+    typename Storage::type *data() { return reinterpret_cast<typename Storage::type*>(&m_data[0]); }
+    template<class Storage>
+    const typename Storage::type *data() const { return reinterpret_cast<const typename Storage::type*>(&m_data[0]); }
+
+    void loadRow(int i, float *values) const;
+    void loadRow(int i, double *values) const;
+    void storeRow(int i, const float *values);
+    void storeRow(int i, const double *values);
+    // Segments are count values from column jBegin and do not wrap around
+    void loadRowSegment(int i, int jBegin, int count, float *values) const;
+    void loadRowSegment(int i, int jBegin, int count, double *values) const;
+    void storeRowSegment(int i, int jBegin, int count, const float *values);
+    void storeRowSegment(int i, int jBegin, int count, const double *values);
+    float value(int i, int j) const;
+    void setValue(int i, int j, float value);
+    void fill(float value);
+    void swap(CPField &field);
+};
+
+#endif // CPFIELD_H
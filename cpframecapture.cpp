@@ -0,0 +1,198 @@
+#include "cpframecapture.h"
+#include "cptimer.h"
+#include <QOpenGLContext>
+#include <QImage>
+#include <QFile>
+#include <QDir>
+#include <cstring>
+
+CPFrameCapture::CPFrameCapture(QString directory, CaptureFormat format, int ringSize) :
+    m_directory(directory),
+    m_format(format),
+    m_ringSize(std::max(ringSize, 1)),
+    m_framesCaptured(0),
+    m_framesWritten(0),
+    m_maxQueuedFrames(16),
+    m_usePixelBuffers(false),
+    m_funcs(0),
+    m_stopWriter(false)
+{
+    QDir().mkpath(m_directory);
+    m_writerThread = std::thread(&CPFrameCapture::writeFrames, this);
+}
+
+CPFrameCapture::~CPFrameCapture()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stopWriter = true;
+    }
+    m_queueChanged.notify_all();
+    m_writerThread.join();
+
+    if(m_funcs) {
+        if(m_usePixelBuffers && QOpenGLContext::currentContext()) {
+            m_funcs->glDeleteBuffers(m_pboIds.size(), &m_pboIds[0]);
+        }
+        delete m_funcs;
+    }
+}
+
+void CPFrameCapture::ensureInitialized()
+{
+    if(!m_funcs) {
+        QOpenGLContext *context = QOpenGLContext::currentContext();
+        m_funcs = new QOpenGLExtraFunctions(context);
+        m_usePixelBuffers = context->format().majorVersion() >= 3 || context->hasExtension("GL_ARB_pixel_buffer_object");
+        if(m_usePixelBuffers) {
+            m_pboIds.resize(m_ringSize);
+            m_pboFrameNumber.assign(m_ringSize, -1);
+            m_funcs->glGenBuffers(m_ringSize, &m_pboIds[0]);
+        } else {
+            qDebug() << "Pixel buffer objects are not supported, frames will be read back synchronously.";
+        }
+    }
+}
+
+void CPFrameCapture::capture(QSize size)
+{
+    ensureInitialized();
+    CPTimer::readPixels().start();
+
+    if(!m_usePixelBuffers) {
+        CPCapturedFrame frame;
+        frame.number = m_framesCaptured++;
+        frame.size = size;
+        frame.pixels.resize(4*size.width()*size.height());
+        m_funcs->glReadPixels(0, 0, size.width(), size.height(), GL_RGBA, GL_UNSIGNED_BYTE, &frame.pixels[0]);
+        CPTimer::readPixels().stop();
+        enqueue(frame);
+        return;
+    }
+
+    if(size != m_size) {
+        // Pending frames have the old size, map them before the buffers are reallocated
+        finish();
+        m_size = size;
+        for(GLuint pboId : m_pboIds) {
+            m_funcs->glBindBuffer(GL_PIXEL_PACK_BUFFER, pboId);
+            m_funcs->glBufferData(GL_PIXEL_PACK_BUFFER, 4*size.width()*size.height(), 0, GL_STREAM_READ);
+        }
+        m_funcs->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    }
+
+    // The slot we are about to reuse holds the oldest frame. It was issued ringSize-1 frames
+    // ago, so the transfer has normally completed and mapping it does not stall.
+    int slot = m_framesCaptured % m_ringSize;
+    if(m_pboFrameNumber[slot] >= 0) {
+        readPixelBuffer(slot);
+    }
+
+    m_funcs->glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pboIds[slot]);
+    m_funcs->glReadPixels(0, 0, size.width(), size.height(), GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    m_funcs->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    m_pboFrameNumber[slot] = m_framesCaptured++;
+    CPTimer::readPixels().stop();
+}
+
+void CPFrameCapture::readPixelBuffer(int slot)
+{
+    CPCapturedFrame frame;
+    frame.number = m_pboFrameNumber[slot];
+    frame.size = m_size;
+    frame.pixels.resize(4*m_size.width()*m_size.height());
+
+    m_funcs->glBindBuffer(GL_PIXEL_PACK_BUFFER, m_pboIds[slot]);
+    void *data = m_funcs->glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frame.pixels.size(), GL_MAP_READ_BIT);
+    if(data) {
+        memcpy(&frame.pixels[0], data, frame.pixels.size());
+        m_funcs->glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    } else {
+        qDebug() << "Warning, could not map pixel buffer for frame " << frame.number;
+    }
+    m_funcs->glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    m_pboFrameNumber[slot] = -1;
+
+    if(data) enqueue(frame);
+}
+
+void CPFrameCapture::finish()
+{
+    if(m_funcs && m_usePixelBuffers) {
+        // Map the outstanding buffers oldest first
+        for(int k=0; k<m_ringSize; k++) {
+            int slot = (m_framesCaptured + k) % m_ringSize;
+            if(m_pboFrameNumber[slot] >= 0) {
+                readPixelBuffer(slot);
+            }
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_queueChanged.wait(lock, [&]() { return m_queue.empty(); });
+}
+
+void CPFrameCapture::enqueue(CPCapturedFrame &frame)
+{
+    // Bounded, so a slow disk throttles the producer instead of exhausting memory
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_queueChanged.wait(lock, [&]() { return m_queue.size() < m_maxQueuedFrames; });
+    m_queue.push_back(std::move(frame));
+    lock.unlock();
+    m_queueChanged.notify_all();
+}
+
+void CPFrameCapture::writeFrames()
+{
+    while(true) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_queueChanged.wait(lock, [&]() { return m_stopWriter || !m_queue.empty(); });
+        if(m_queue.empty()) {
+            break;
+        }
+
+        CPCapturedFrame frame = std::move(m_queue.front());
+        lock.unlock();
+
+        writeFrame(frame);
+
+        lock.lock();
+        m_queue.pop_front();
+        m_framesWritten++;
+        lock.unlock();
+        m_queueChanged.notify_all();
+    }
+}
+
+void CPFrameCapture::writeFrame(const CPCapturedFrame &frame)
+{
+    int width = frame.size.width();
+    int height = frame.size.height();
+    QString fileName = QString("%1/frame_%2").arg(m_directory).arg(frame.number, 6, 10, QChar('0'));
+
+    if(m_format == CaptureFormat::PNG) {
+        QImage image(&frame.pixels[0], width, height, 4*width, QImage::Format_RGBA8888);
+        image.mirrored().save(fileName + ".png");
+    } else {
+        // Raw RGBA8 with the top row first, width x height given by the capture size
+        QFile file(fileName + ".rgba");
+        if(!file.open(QFile::WriteOnly | QFile::Truncate)) {
+            qDebug() << "Warning, could not write " << fileName << ": " << file.errorString();
+            return;
+        }
+        for(int row=height-1; row>=0; row--) {
+            file.write(reinterpret_cast<const char*>(&frame.pixels[4*width*row]), 4*width);
+        }
+    }
+}
+
+int CPFrameCapture::framesCaptured() const
+{
+    return m_framesCaptured;
+}
+
+int CPFrameCapture::framesWritten()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_framesWritten;
+}
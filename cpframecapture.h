@@ -0,0 +1,66 @@
+#ifndef CPFRAMECAPTURE_H
+#define CPFRAMECAPTURE_H
+#include <QOpenGLExtraFunctions>
+#include <QString>
+#include <QSize>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+enum class CaptureFormat {Raw = 0, PNG = 1};
+
+class CPCapturedFrame
+{
+public:
+    int number;
+    QSize size;
+    std::vector<unsigned char> pixels; // RGBA8, bottom row first as returned by glReadPixels
+};
+
+// Reads back the currently bound framebuffer through a ring of pixel buffer objects so that
+// glReadPixels returns immediately and the pixels of frame n are only mapped when frame
+// n + ringSize - 1 is captured. The frames are written to disk on a separate thread.
+class CPFrameCapture
+{
+private:
+    QString m_directory;
+    CaptureFormat m_format;
+    QSize m_size;
+    int m_ringSize;
+    int m_framesCaptured;
+    int m_framesWritten;
+    unsigned int m_maxQueuedFrames;
+    bool m_usePixelBuffers;
+
+    // OpenGL stuff
+    QOpenGLExtraFunctions *m_funcs;
+    std::vector<GLuint> m_pboIds;
+    std::vector<int> m_pboFrameNumber;
+
+    // Writer thread
+    std::thread m_writerThread;
+    std::mutex m_mutex;
+    std::condition_variable m_queueChanged;
+    std::deque<CPCapturedFrame> m_queue;
+    bool m_stopWriter;
+
+    void ensureInitialized();
+    void readPixelBuffer(int slot);
+    void enqueue(CPCapturedFrame &frame);
+    void writeFrames();
+    void writeFrame(const CPCapturedFrame &frame);
+
+public:
+    CPFrameCapture(QString directory, CaptureFormat format = CaptureFormat::PNG, int ringSize = 3);
+    ~CPFrameCapture();
+
+    void capture(QSize size);
+    void finish();
+
+    int framesCaptured() const;
+    int framesWritten();
+};
+
+#endif // CPFRAMECAPTURE_H
@@ -1,16 +1,21 @@
 #include "cpgrid.h"
 #include "perlinnoise.h"
+#include "cpthreadpool.h"
 #include "cptimer.h"
 #include <cmath>
-#if defined(__ARM_NEON)
-#include <arm_neon.h>
-#endif
+#include <limits>
+#include <algorithm>
 
 CPGrid::CPGrid() :
-    m_gridSize(0),
+    m_nx(0),
+    m_ny(0),
     m_funcs(0),
     m_program(0),
-    m_indicesDirty(true)
+    m_indicesDirty(true),
+    m_cullingEnabled(true),
+    m_tileShift(4),
+    m_tilesI(0),
+    m_tilesJ(0)
 {
     m_gridType = GridType::Water;
     setShaders();
@@ -100,98 +105,208 @@ void CPGrid::for_each(std::function<void (CPPoint &p)> action)
 
 void CPGrid::for_each(std::function<void (CPPoint &p, int i, int j)> action)
 {
-    for(int i=0; i<gridSize(); i++) {
-        for(int j=0; j<gridSize(); j++) {
+    for(int i=0; i<m_nx; i++) {
+        for(int j=0; j<m_ny; j++) {
             action(m_vertices[index(i,j)], i, j);
         }
     }
 }
 
-void CPGrid::for_each(std::function<void (CPPoint &p, int i, int j, int gridSize)> action)
+void CPGrid::for_each(std::function<void (CPPoint &p, int i, int j, int nx, int ny)> action)
 {
-    for(int i=0; i<gridSize(); i++) {
-        for(int j=0; j<gridSize(); j++) {
-            action(m_vertices[index(i,j)], i, j, gridSize());
+    for(int i=0; i<m_nx; i++) {
+        for(int j=0; j<m_ny; j++) {
+            action(m_vertices[index(i,j)], i, j, m_nx, m_ny);
         }
     }
 }
 
-void CPGrid::for_each(std::function<void (CPPoint &p, int i, int j, int gridSize, int index)> action)
+void CPGrid::resize(int nx, int ny, float xMin, float xMax, float yMin, float yMax)
 {
-    for(int i=0; i<gridSize(); i++) {
-        for(int j=0; j<gridSize(); j++) {
-            action(m_vertices[index(i,j)], i, j, gridSize(), index(i,j));
-        }
-    }
-}
-
-void CPGrid::resize(int gridSize, float rMin, float rMax)
-{
-    m_gridSize = gridSize;
-    float length = rMax-rMin;
-    float dr = length / (gridSize - 1);
-    int numTriangles = 2*(gridSize-1)*(gridSize-1);
+    m_nx = nx;
+    m_ny = ny;
+    float dx = (xMax - xMin) / (nx - 1);
+    float dy = (yMax - yMin) / (ny - 1);
+    int numTriangles = 2*(nx-1)*(ny-1);
     int numIndices = 3*numTriangles;
 
     m_triangles.reserve(numTriangles);
     m_indices.reserve(numIndices);
-    m_vertices.resize(gridSize*gridSize);
-    m_z.resize(gridSize*gridSize);
+    m_vertices.resize(nx*ny);
 
     for_each([&](CPPoint &p, int i, int j) {
-        p.position.setX(rMin + dr*i);
-        p.position.setY(rMin + dr*j);
+        p.position.setX(xMin + dx*i);
+        p.position.setY(yMin + dy*j);
         p.position.setZ(0);
     });
 
+    createTiles();
+}
+
+void CPGrid::createTiles()
+{
+    // Vertex i belongs to tile i >> m_tileShift, while the quads of a tile span one vertex
+    // further. The last vertex row may therefore end up in a tile without any quads.
+    m_tilesI = ((m_nx - 1) >> m_tileShift) + 1;
+    m_tilesJ = ((m_ny - 1) >> m_tileShift) + 1;
+    int numTiles = m_tilesI*m_tilesJ;
+    int tileSize = 1 << m_tileShift;
+
     m_indices.clear();
     m_triangles.clear();
-    for_each([&](CPPoint &p, int i, int j) {
-        // Skip the end points
-        if(i<gridSize - 1 && j<gridSize - 1) {
-            // Triangle 1
-            int index1 = index(i,j);
-            int index2 = index(i,j+1);
-            int index3 = index(i+1,j);
-            m_indices.push_back(index1);
-            m_indices.push_back(index2);
-            m_indices.push_back(index3);
-            CPTriangle triangle1(index1, index2, index3);
-            m_triangles.push_back(triangle1);
-
-            // Triangle 2
-            index1 = index(i+1,j);
-            index2 = index(i,j+1);
-            index3 = index(i+1,j+1);
-            m_indices.push_back(index1);
-            m_indices.push_back(index2);
-            m_indices.push_back(index3);
-            CPTriangle triangle2(index1, index2, index3);
-            m_triangles.push_back(triangle2);
+    m_tileIndexOffset.resize(numTiles + 1);
+    for(int tileI=0; tileI<m_tilesI; tileI++) {
+        for(int tileJ=0; tileJ<m_tilesJ; tileJ++) {
+            m_tileIndexOffset[tileI*m_tilesJ + tileJ] = m_indices.size();
+            int iMax = std::min((tileI + 1)*tileSize, m_nx - 1);
+            int jMax = std::min((tileJ + 1)*tileSize, m_ny - 1);
+            for(int i=tileI*tileSize; i<iMax; i++) {
+                for(int j=tileJ*tileSize; j<jMax; j++) {
+                    // Triangle 1
+                    int index1 = index(i,j);
+                    int index2 = index(i,j+1);
+                    int index3 = index(i+1,j);
+                    m_indices.push_back(index1);
+                    m_indices.push_back(index2);
+                    m_indices.push_back(index3);
+                    CPTriangle triangle1(index1, index2, index3);
+                    m_triangles.push_back(triangle1);
+
+                    // Triangle 2
+                    index1 = index(i+1,j);
+                    index2 = index(i,j+1);
+                    index3 = index(i+1,j+1);
+                    m_indices.push_back(index1);
+                    m_indices.push_back(index2);
+                    m_indices.push_back(index3);
+                    CPTriangle triangle2(index1, index2, index3);
+                    m_triangles.push_back(triangle2);
+                }
+            }
         }
+    }
+    m_tileIndexOffset[numTiles] = m_indices.size();
+
+    m_tileWet.resize(numTiles);
+    m_tileZMin.resize(numTiles);
+    m_tileZMax.resize(numTiles);
+    m_tileVisible.assign(numTiles, true);
+    m_visibleIndices = m_indices;
+    updateTilesFromGrid();
+
+    m_indicesDirty = true;
+}
+
+void CPGrid::resetTiles()
+{
+    std::fill(m_tileWet.begin(), m_tileWet.end(), false);
+    std::fill(m_tileZMin.begin(), m_tileZMin.end(), std::numeric_limits<float>::max());
+    std::fill(m_tileZMax.begin(), m_tileZMax.end(), -std::numeric_limits<float>::max());
+}
+
+void CPGrid::updateTilesFromGrid()
+{
+    // Used for grids without wet/dry information, i.e. the ground and water that has not been stepped yet
+    resetTiles();
+    for_each([&](CPPoint &p, int i, int j) {
+        updateTile(i, j, p.position.z(), true);
     });
+}
+
+void CPGrid::cullTiles(QMatrix4x4 &modelViewProjectionMatrix)
+{
+    // Frustum planes in world space (Gribb & Hartmann), each plane satisfies dot(plane, (x,y,z,1)) >= 0 inside
+    QVector4D planes[6];
+    QVector4D row3 = modelViewProjectionMatrix.row(3);
+    for(int k=0; k<3; k++) {
+        QVector4D row = modelViewProjectionMatrix.row(k);
+        planes[2*k] = row3 + row;
+        planes[2*k+1] = row3 - row;
+    }
+
+    int tileSize = 1 << m_tileShift;
+    bool visibilityChanged = false;
+    for(int tileI=0; tileI<m_tilesI; tileI++) {
+        for(int tileJ=0; tileJ<m_tilesJ; tileJ++) {
+            int tile = tileI*m_tilesJ + tileJ;
+            if(m_tileIndexOffset[tile] == m_tileIndexOffset[tile+1]) continue;
+
+            // The quads of a tile touch the first vertex row and column of the neighbouring tiles
+            bool wet = false;
+            float zMin = std::numeric_limits<float>::max();
+            float zMax = -std::numeric_limits<float>::max();
+            for(int di=0; di<2; di++) {
+                for(int dj=0; dj<2; dj++) {
+                    if(tileI+di >= m_tilesI || tileJ+dj >= m_tilesJ) continue;
+                    int neighbour = tile + di*m_tilesJ + dj;
+                    wet |= m_tileWet[neighbour];
+                    zMin = std::min(zMin, m_tileZMin[neighbour]);
+                    zMax = std::max(zMax, m_tileZMax[neighbour]);
+                }
+            }
+
+            bool visible = wet;
+            if(visible) {
+                QVector3D boxMin = m_vertices[index(tileI*tileSize, tileJ*tileSize)].position;
+                QVector3D boxMax = m_vertices[index(std::min((tileI + 1)*tileSize, m_nx - 1), std::min((tileJ + 1)*tileSize, m_ny - 1))].position;
+                boxMin.setZ(zMin);
+                boxMax.setZ(zMax);
+                for(QVector4D &plane : planes) {
+                    // Test the corner of the box furthest along the plane normal
+                    float x = plane.x() >= 0 ? boxMax.x() : boxMin.x();
+                    float y = plane.y() >= 0 ? boxMax.y() : boxMin.y();
+                    float z = plane.z() >= 0 ? boxMax.z() : boxMin.z();
+                    if(plane.x()*x + plane.y()*y + plane.z()*z + plane.w() < 0) {
+                        visible = false;
+                        break;
+                    }
+                }
+            }
+
+            if(m_tileVisible[tile] != visible) {
+                m_tileVisible[tile] = visible;
+                visibilityChanged = true;
+            }
+        }
+    }
+
+    if(!visibilityChanged) return;
 
+    m_visibleIndices.clear();
+    for(unsigned int tile=0; tile<m_tileVisible.size(); tile++) {
+        if(!m_tileVisible[tile]) continue;
+        m_visibleIndices.insert(m_visibleIndices.end(), m_indices.begin() + m_tileIndexOffset[tile], m_indices.begin() + m_tileIndexOffset[tile+1]);
+    }
     m_indicesDirty = true;
 }
 
-#if defined(__ARM_NEON)
-void CPGrid::calculateNormals() {
-    CPTimer::normalVectors().start();
-    for(CPTriangle &triangle : m_triangles) {
-        triangle.calculateNormal(m_vertices);
+bool CPGrid::cullingEnabled() const
+{
+    return m_cullingEnabled;
+}
+
+void CPGrid::setCullingEnabled(bool cullingEnabled)
+{
+    m_cullingEnabled = cullingEnabled;
+    if(!m_cullingEnabled) {
+        std::fill(m_tileVisible.begin(), m_tileVisible.end(), true);
+        m_visibleIndices = m_indices;
+        m_indicesDirty = true;
     }
-    CPTimer::normalVectors().stop();
 }
 
-#else
 void CPGrid::calculateNormals() {
     CPTimer::normalVectors().start();
-    for(CPTriangle &triangle : m_triangles) {
-        triangle.calculateNormal(m_vertices);
+    // Triangles are stored in the same tile order as the indices, so culled water tiles are skipped.
+    // The ground is static and only gets its normals computed once.
+    for(unsigned int tile=0; tile<m_tileVisible.size(); tile++) {
+        if(m_gridType == GridType::Water && !m_tileVisible[tile]) continue;
+        for(int triangle=m_tileIndexOffset[tile]/3; triangle<m_tileIndexOffset[tile+1]/3; triangle++) {
+            m_triangles[triangle].calculateNormal(m_vertices);
+        }
     }
     CPTimer::normalVectors().stop();
 }
-#endif
 
 void CPGrid::uploadVBO() {
     ensureInitialized();
@@ -203,14 +318,14 @@ void CPGrid::uploadVBO() {
     m_funcs->glBufferData(GL_ARRAY_BUFFER, m_vertices.size() * sizeof(CPPoint), &m_vertices[0], GL_STATIC_DRAW);
 
     if(m_indicesDirty) {
-        qDebug() << "Uploading " << m_indices.size() << " indices with total size " << m_indices.size() *sizeof(index_t) << " bytes.";
-        qDebug() << "This corresponds to " << m_vertices.size() << " vertices with total size " << m_vertices.size() *sizeof(CPPoint) << " bytes.";
-        // Transfer index data to VBO 1
+        // Transfer index data of the visible tiles to VBO 1
         m_funcs->glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_vboIds[1]);
-        m_funcs->glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_indices.size() * sizeof(index_t), &m_indices[0], GL_STATIC_DRAW);
-        CPTimer::uploadVBO().stop();
+        if(!m_visibleIndices.empty()) {
+            m_funcs->glBufferData(GL_ELEMENT_ARRAY_BUFFER, m_visibleIndices.size() * sizeof(index_t), &m_visibleIndices[0], GL_DYNAMIC_DRAW);
+        }
         m_indicesDirty = false;
     }
+    CPTimer::uploadVBO().stop();
 }
 
 void CPGrid::setShaders()
@@ -278,7 +393,9 @@ void CPGrid::setShaders()
 void CPGrid::renderAsTriangles(QMatrix4x4 &modelViewProjectionMatrix, QMatrix4x4 &modelViewMatrix) {
     if(m_vertices.size() == 0) return;
     ensureInitialized();
+    if(m_cullingEnabled) cullTiles(modelViewProjectionMatrix);
     uploadVBO();
+    if(m_visibleIndices.empty()) return;
 
     CPTimer::rendering().start();
     m_program->bind();
@@ -322,7 +439,7 @@ void CPGrid::renderAsTriangles(QMatrix4x4 &modelViewProjectionMatrix, QMatrix4x4
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
     // Draw cube geometry using indices from VBO 1
     CPTimer::drawElements().start();
-    m_funcs->glDrawElements(GL_TRIANGLES, m_indices.size(), GL_UNSIGNED_INT, 0);
+    m_funcs->glDrawElements(GL_TRIANGLES, m_visibleIndices.size(), GL_UNSIGNED_INT, 0);
     CPTimer::drawElements().stop();
     glDisable(GL_BLEND);
 
@@ -330,72 +447,103 @@ void CPGrid::renderAsTriangles(QMatrix4x4 &modelViewProjectionMatrix, QMatrix4x4
     CPTimer::rendering().stop();
 }
 
-void CPGrid::createPerlin(unsigned int seed, float amplitude, float lengthScale, float deltaZ)
+void CPGrid::createPerlin(unsigned int seed, float amplitude, float lengthScale, float deltaZ, int octaves, float persistence, float lacunarity)
 {
     PerlinNoise perlin(seed);
 
-    for_each([&](CPPoint &p, int i, int j, int gridSize) {
-        float x = i/float(gridSize);
-        float y = j/float(gridSize);
+    // The noise is sampled with the same spacing along both axes, lengthScale spans the
+    // longest side. Rows are independent, so the result does not depend on the number of threads.
+    int nx = m_nx;
+    int ny = m_ny;
+    float spacing = lengthScale/std::max(nx, ny);
+    CPThreadPool::instance().parallelFor(0, nx, [&](int iBegin, int iEnd) {
+        std::vector<float> row(ny);
+        for(int i=iBegin; i<iEnd; i++) {
+            perlin.fbmRow(i*spacing, 0, spacing, ny, octaves, persistence, lacunarity, &row[0]);
+            for(int j=0; j<ny; j++) {
+                float z = amplitude*row[j] + deltaZ;
+                if(i==0 || i == nx-1 || j==0 || j==ny-1) {
+                    z = 0.2;
+                }
+                m_vertices[index(i,j)].position.setZ(z);
+            }
+        }
+    });
 
-        float z = amplitude*(perlin.noise(x*lengthScale,y*lengthScale,0)) + deltaZ;
-        if(i==0 || i == gridSize-1 || j==0 || j==gridSize-1) {
-            z = 0.2;
+    updateTilesFromGrid();
+    calculateNormals();
+}
+
+void CPGrid::createFromHeightmap(const CPHeightmap &heightmap, ResampleMethod method, float scale, float offset)
+{
+    // Missing data and the edges of the periodic domain become land, like in the generators
+    int nx = m_nx;
+    int ny = m_ny;
+    heightmap.resample(nx, ny, method, [&](int j, const float *values) {
+        for(int i=0; i<nx; i++) {
+            float z = offset + scale*values[i];
+            if(std::isnan(z) || i==0 || i == nx-1 || j==0 || j==ny-1) {
+                z = 0.2;
+            }
+            m_vertices[index(i,j)].position.setZ(z);
         }
-        p.position.setZ(z);
     });
 
+    updateTilesFromGrid();
     calculateNormals();
 }
 
 void CPGrid::createDoubleSlit()
 {
     int slitSize = 3;
-    for_each([&](CPPoint &p, int i, int j, int gridSize) {
-        bool wall = i==0 || i==gridSize-1 || j==0 || j==gridSize-1;
-        int slit1 = gridSize/2 + 6;
-        int slit2 = gridSize/2 - 6;
+    for_each([&](CPPoint &p, int i, int j, int nx, int ny) {
+        bool wall = i==0 || i==nx-1 || j==0 || j==ny-1;
+        int slit1 = nx/2 + 6;
+        int slit2 = nx/2 - 6;
 
-        wall |= (j==gridSize/2);// && (abs(i-slit1)>=slitSize & abs(i-slit2)>=slitSize);
-        // wall |= (j==gridSize/2) && (abs(i-slit1)>=slitSize & abs(i-slit2)>=slitSize);
+        wall |= (j==ny/2);// && (abs(i-slit1)>=slitSize & abs(i-slit2)>=slitSize);
+        // wall |= (j==ny/2) && (abs(i-slit1)>=slitSize & abs(i-slit2)>=slitSize);
 
         float z = wall ? 0.2 : -5;
         p.position.setZ(z);
     });
 
+    updateTilesFromGrid();
     calculateNormals();
 }
 
 void CPGrid::createSinus()
 {
-    for_each([&](CPPoint &p, int i, int j, int gridSize) {
-        float y = j/float(gridSize)*2*3.1415;
+    for_each([&](CPPoint &p, int i, int j, int nx, int ny) {
+        float y = j/float(ny)*2*3.1415;
         float omega = 1.0;
         float x0 = 0.1*sin(y*omega);
-        float x = (i-gridSize/2) / float(gridSize);
-        bool wall = i==0 || i==gridSize-1 || j==0 || j==gridSize-1;
+        float x = (i-nx/2) / float(nx);
+        bool wall = i==0 || i==nx-1 || j==0 || j==ny-1;
         wall |= fabs(x-x0) > 0.05;
 
         float z = wall ? 0.2 : -0.5;
         p.position.setZ(z);
     });
 
+    updateTilesFromGrid();
     calculateNormals();
 }
 
 void CPGrid::createLand()
 {
-    for_each([&](CPPoint &p, int i, int j, int gridSize) {
-        float x = 2*(i-gridSize/2.0)/float(gridSize);
-        float y = 2*(j-gridSize/2.0)/float(gridSize);
+    for_each([&](CPPoint &p, int i, int j, int nx, int ny) {
+        float x = 2*(i-nx/2.0)/float(nx);
+        float y = 2*(j-ny/2.0)/float(ny);
 
-        bool wall = i==0 || i==gridSize-1 || j==0 || j==gridSize-1;
+        bool wall = i==0 || i==nx-1 || j==0 || j==ny-1;
         float height = y-0.5;
 
         float z = wall ? 0.2 : height;
         p.position.setZ(z);
     });
 
+    updateTilesFromGrid();
     calculateNormals();
 }
 
@@ -404,17 +552,3 @@ void CPGrid::swapWithGrid(CPGrid &grid)
     m_vertices.swap(grid.vertices());
 }
 
-void CPGrid::updateGridFromZ()
-{
-    for_each([&](CPPoint &p, int i, int j, int gridSize, int index) {
-        p.position.setZ(m_z[index]);
-    });
-}
-
-void CPGrid::updateZFromGrid()
-{
-    for_each([&](CPPoint &p, int i, int j, int gridSize, int index) {
-        m_z[index] = p.position.z();
-    });
-}
-
@@ -4,9 +4,11 @@
 #include <QOpenGLFunctions>
 #include <QVector3D>
 #include <QMatrix4x4>
+#include <QVector4D>
 #include <vector>
 #include <functional>
 #include <iostream>
+#include "cpheightmap.h"
 
 class CPPoint
 {
@@ -62,16 +64,29 @@ private:
     std::vector<CPPoint>      m_vertices;
     std::vector<index_t>     m_indices;
     std::vector<CPTriangle>   m_triangles;
-    std::vector<float>        m_z;
     QString                   m_waterVertexShader;
     QString                   m_waterFragmentShader;
     QString                   m_groundVertexShader;
     QString                   m_groundFragmentShader;
 
-    int m_gridSize;
+    int m_nx;
+    int m_ny;
     GridType m_gridType;
     bool m_indicesDirty;
 
+    // Visibility culling. The mesh is split into square tiles of 2^m_tileShift cells and
+    // m_indices is ordered tile by tile so that each tile owns a contiguous index range.
+    bool m_cullingEnabled;
+    int m_tileShift;
+    int m_tilesI;
+    int m_tilesJ;
+    std::vector<int>          m_tileIndexOffset;
+    std::vector<char>         m_tileWet;
+    std::vector<float>        m_tileZMin;
+    std::vector<float>        m_tileZMax;
+    std::vector<char>         m_tileVisible;
+    std::vector<index_t>      m_visibleIndices;
+
     // OpenGL stuff
     GLuint m_vboIds[2];
     QOpenGLFunctions *m_funcs;
@@ -82,33 +97,48 @@ private:
     void ensureInitialized();
     void uploadVBO();
     void setShaders();
+    void createTiles();
+    void cullTiles(QMatrix4x4 &modelViewProjectionMatrix);
 
 public:
     CPGrid();
     ~CPGrid();
     void for_each(std::function<void(CPPoint &p)> action);
     void for_each(std::function<void(CPPoint &p, int i, int j)> action);
-    void for_each(std::function<void(CPPoint &p, int i, int j, int gridSize)> action);
-    void for_each(std::function<void(CPPoint &p, int i, int j, int gridSize, int index)> action);
+    void for_each(std::function<void(CPPoint &p, int i, int j, int nx, int ny)> action);
 
     inline int index(int i, int j) {
-        return i*gridSize() + j;
+        return i*m_ny + j;
     }
-    inline int idx(int i) { return (i+gridSize()) % gridSize(); }
+    inline int idxI(int i) { return (i+m_nx) % m_nx; }
+    inline int idxJ(int j) { return (j+m_ny) % m_ny; }
 
-    int gridSize() { return m_gridSize; }
-    void resize(int gridSize, float rMin, float rMax);
+    int nx() { return m_nx; }
+    int ny() { return m_ny; }
+    void resize(int nx, int ny, float xMin, float xMax, float yMin, float yMax);
 
     float &operator()(int i, int j, bool) {
-        return m_vertices[index(idx(i), idx(j))].position[2];
+        return m_vertices[index(idxI(i), idxJ(j))].position[2];
     }
     float &operator()(int i, int j) {
         return m_vertices[index(i, j)].position[2];
     }
 
-    float &operator[](int i) {
-        return m_z[i];
+    inline int tileIndex(int i, int j) {
+        return (i >> m_tileShift)*m_tilesJ + (j >> m_tileShift);
+    }
+
+    // Called by the solver for every vertex after resetTiles() to mark which tiles contain water
+    inline void updateTile(int i, int j, float z, bool wet) {
+        int tile = tileIndex(i,j);
+        m_tileWet[tile] |= wet;
+        m_tileZMin[tile] = std::min(m_tileZMin[tile], z);
+        m_tileZMax[tile] = std::max(m_tileZMax[tile], z);
     }
+    void resetTiles();
+    void updateTilesFromGrid();
+    bool cullingEnabled() const;
+    void setCullingEnabled(bool cullingEnabled);
 
     void zeros();
     void renderAsTriangles(QMatrix4x4 &modelViewProjectionMatrix, QMatrix4x4 &modelViewMatrix);
@@ -118,14 +148,12 @@ public:
     GridType getGridType() const;
     void setGridType(const GridType &GridType);
 
-    void createPerlin(unsigned int seed, float amplitude, float lengthScale, float deltaZ);
+    void createPerlin(unsigned int seed, float amplitude, float lengthScale, float deltaZ, int octaves = 1, float persistence = 0.5, float lacunarity = 2.0);
     void createDoubleSlit();
     void createSinus();
     void swapWithGrid(CPGrid &grid);
-    void updateGridFromZ();
-
-    void updateZFromGrid();
     void createLand();
+    void createFromHeightmap(const CPHeightmap &heightmap, ResampleMethod method, float scale, float offset);
 };
 
 #endif // CPGRID_H
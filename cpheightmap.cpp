@@ -0,0 +1,213 @@
+#include "cpheightmap.h"
+#include "cpthreadpool.h"
+#include <QDebug>
+#include <cmath>
+#include <cstring>
+
+CPHeightmap::CPHeightmap() :
+    m_file(0),
+    m_data(0),
+    m_pixels(0),
+    m_format(HeightmapFormat::RawFloat32),
+    m_width(0),
+    m_height(0),
+    m_maxValue(1)
+{
+
+}
+
+CPHeightmap::~CPHeightmap()
+{
+    close();
+}
+
+void CPHeightmap::close()
+{
+    if(m_file) {
+        if(m_data) m_file->unmap(m_data);
+        delete m_file;
+    }
+    m_file = 0;
+    m_data = 0;
+    m_pixels = 0;
+}
+
+bool CPHeightmap::open(QString filename, int width, int height)
+{
+    close();
+    m_file = new QFile(filename);
+    if(!m_file->open(QFile::ReadOnly)) {
+        qDebug() << "Warning, could not open heightmap " << filename << ": " << m_file->errorString();
+        close();
+        return false;
+    }
+    qint64 fileSize = m_file->size();
+    m_data = fileSize > 0 ? m_file->map(0, fileSize) : 0;
+    if(!m_data) {
+        qDebug() << "Warning, could not map heightmap " << filename;
+        close();
+        return false;
+    }
+
+    if(fileSize >= 2 && m_data[0] == 'P' && m_data[1] == '5') {
+        if(!openPGM(fileSize)) {
+            qDebug() << "Warning, " << filename << " is not a valid binary PGM file.";
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    // Raw float32. The file has no header, so its size has to match the raster exactly, any
+    // other size means the rows would be read with the wrong stride.
+    qint64 numValues = fileSize / qint64(sizeof(float));
+    bool isInferred = width <= 0 || height <= 0;
+    if(isInferred) {
+        width = height = round(sqrt(double(numValues)));
+    }
+    if(width < 2 || height < 2 || qint64(width)*height*qint64(sizeof(float)) != fileSize) {
+        if(isInferred) {
+            qDebug() << "Warning, " << filename << " is not a square float32 heightmap, give its size with --heightmap-size.";
+        } else {
+            qDebug() << "Warning, the size of " << filename << " does not match a " << width << "x" << height << " float32 heightmap.";
+        }
+        close();
+        return false;
+    }
+    m_format = HeightmapFormat::RawFloat32;
+    m_width = width;
+    m_height = height;
+    m_maxValue = 1;
+    m_pixels = m_data;
+    return true;
+}
+
+bool CPHeightmap::openPGM(qint64 fileSize)
+{
+    // Header: P5, width, height and maxval separated by whitespace and comments, then a single
+    // whitespace character before the pixels
+    qint64 position = 2;
+    int header[3];
+    for(int k=0; k<3; k++) {
+        while(position < fileSize && (isspace(m_data[position]) || m_data[position] == '#')) {
+            if(m_data[position] == '#') {
+                while(position < fileSize && m_data[position] != '\n') position++;
+            } else {
+                position++;
+            }
+        }
+        qint64 value = 0;
+        bool hasDigits = false;
+        while(position < fileSize && isdigit(m_data[position]) && value < (1 << 30)) {
+            value = 10*value + (m_data[position++] - '0');
+            hasDigits = true;
+        }
+        if(!hasDigits) return false;
+        header[k] = value;
+    }
+    position++;
+
+    m_width = header[0];
+    m_height = header[1];
+    m_maxValue = header[2];
+    m_format = m_maxValue > 255 ? HeightmapFormat::PGM16 : HeightmapFormat::PGM8;
+    int bytesPerPixel = m_format == HeightmapFormat::PGM16 ? 2 : 1;
+    if(m_width < 2 || m_height < 2 || m_maxValue < 1 || m_maxValue > 65535
+            || position + qint64(m_width)*m_height*bytesPerPixel > fileSize) {
+        return false;
+    }
+    m_pixels = m_data + position;
+    return true;
+}
+
+void CPHeightmap::readRow(int row, int columnBegin, int columnEnd, float *values) const
+{
+    qint64 offset = qint64(row)*m_width + columnBegin;
+    int count = columnEnd - columnBegin;
+    switch(m_format) {
+    case HeightmapFormat::RawFloat32:
+        memcpy(values, m_pixels + offset*sizeof(float), count*sizeof(float));
+        break;
+    case HeightmapFormat::PGM8: {
+        const uchar *pixels = m_pixels + offset;
+        for(int k=0; k<count; k++) {
+            values[k] = pixels[k] / m_maxValue;
+        }
+        break;
+    }
+    case HeightmapFormat::PGM16: {
+        // 16-bit PGM is big-endian
+        const uchar *pixels = m_pixels + 2*offset;
+        for(int k=0; k<count; k++) {
+            values[k] = ((pixels[2*k] << 8) | pixels[2*k+1]) / m_maxValue;
+        }
+        break;
+    }
+    }
+}
+
+void CPHeightmap::resample(int nx, int ny, ResampleMethod method, const std::function<void(int j, const float *values)> &rowCallback) const
+{
+    if(!m_pixels) return;
+
+    // Grid point k sits at source coordinate k*scale, the corners of the grid and the raster
+    // coincide
+    double scaleX = double(m_width - 1)/(nx - 1);
+    double scaleY = double(m_height - 1)/(ny - 1);
+
+    // Output rows are image rows, so each block of the parallel loop streams through a band of
+    // the raster in file order
+    CPThreadPool::instance().parallelFor(0, ny, [&](int jBegin, int jEnd) {
+        std::vector<float> values(nx);
+        std::vector<float> row0(m_width);
+        std::vector<float> row1(m_width);
+        std::vector<double> sum(nx);
+        std::vector<int> count(nx);
+        std::vector<int> columnBegin(nx);
+        std::vector<int> columnEnd(nx);
+        for(int i=0; i<nx; i++) {
+            double x = i*scaleX;
+            columnBegin[i] = std::max(0, int(ceil(x - 0.5*scaleX)));
+            columnEnd[i] = std::min(m_width, std::max(columnBegin[i] + 1, int(ceil(x + 0.5*scaleX))));
+        }
+
+        for(int j=jBegin; j<jEnd; j++) {
+            double y = j*scaleY;
+            if(method == ResampleMethod::Bilinear || scaleX <= 1 || scaleY <= 1) {
+                int y0 = std::min(int(y), m_height - 2);
+                float fy = y - y0;
+                readRow(y0, 0, m_width, &row0[0]);
+                readRow(y0 + 1, 0, m_width, &row1[0]);
+                for(int i=0; i<nx; i++) {
+                    double x = i*scaleX;
+                    int x0 = std::min(int(x), m_width - 2);
+                    float fx = x - x0;
+                    float top = row0[x0] + fx*(row0[x0+1] - row0[x0]);
+                    float bottom = row1[x0] + fx*(row1[x0+1] - row1[x0]);
+                    values[i] = top + fy*(bottom - top);
+                }
+            } else {
+                // Average over the source pixels closest to the grid point
+                int rowBegin = std::max(0, int(ceil(y - 0.5*scaleY)));
+                int rowEnd = std::min(m_height, std::max(rowBegin + 1, int(ceil(y + 0.5*scaleY))));
+                std::fill(sum.begin(), sum.end(), 0);
+                std::fill(count.begin(), count.end(), 0);
+                for(int row=rowBegin; row<rowEnd; row++) {
+                    readRow(row, 0, m_width, &row0[0]);
+                    for(int i=0; i<nx; i++) {
+                        for(int column=columnBegin[i]; column<columnEnd[i]; column++) {
+                            float value = row0[column];
+                            if(std::isnan(value)) continue;
+                            sum[i] += value;
+                            count[i]++;
+                        }
+                    }
+                }
+                for(int i=0; i<nx; i++) {
+                    values[i] = count[i] ? sum[i]/count[i] : NAN;
+                }
+            }
+            rowCallback(j, &values[0]);
+        }
+    });
+}
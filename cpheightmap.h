@@ -0,0 +1,43 @@
+#ifndef CPHEIGHTMAP_H
+#define CPHEIGHTMAP_H
+#include <QString>
+#include <QFile>
+#include <vector>
+#include <functional>
+
+enum class HeightmapFormat {RawFloat32 = 0, PGM8 = 1, PGM16 = 2};
+enum class ResampleMethod {Bilinear = 0, Area = 1};
+
+// Read-only view of a heightmap file through a memory mapping, so only the pages a resampling
+// pass touches are read from disk. Supports raw native-endian float32 (the size must be given,
+// or the raster is assumed square) and binary 8/16-bit PGM (P5), which is scaled to [0, 1].
+// Image columns map to i (x) and image rows to j (y).
+class CPHeightmap
+{
+private:
+    QFile *m_file;
+    uchar *m_data;
+    const uchar *m_pixels;
+    HeightmapFormat m_format;
+    int m_width;
+    int m_height;
+    float m_maxValue;
+
+    bool openPGM(qint64 fileSize);
+    void readRow(int row, int columnBegin, int columnEnd, float *values) const;
+
+public:
+    CPHeightmap();
+    ~CPHeightmap();
+    bool open(QString filename, int width = 0, int height = 0);
+    void close();
+    int width() const { return m_width; }
+    int height() const { return m_height; }
+
+    // Resamples the raster to nx x ny grid points. rowCallback(j, values) receives the nx
+    // values with grid index j (one image row) and is called from several threads.
+    // NaN samples (no data) are left out of area averages.
+    void resample(int nx, int ny, ResampleMethod method, const std::function<void(int j, const float *values)> &rowCallback) const;
+};
+
+#endif // CPHEIGHTMAP_H
@@ -0,0 +1,151 @@
+#include "cpperfcounters.h"
+#include "cpthreadpool.h"
+#include <QDebug>
+#include <QElapsedTimer>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cerrno>
+#ifdef Q_OS_LINUX
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+const int numEvents = 4;
+
+// The leader of the group is the cycle counter, one read gives all four
+class ThreadCounters
+{
+public:
+    int fds[numEvents];
+};
+
+std::mutex registryMutex;
+std::vector<std::unique_ptr<ThreadCounters>> registry;
+std::atomic<bool> enabled(false);
+thread_local bool attached = false;
+
+bool openThreadCounters()
+{
+#ifdef Q_OS_LINUX
+    const quint64 configs[numEvents] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+                                        PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+    std::unique_ptr<ThreadCounters> counters(new ThreadCounters());
+    for(int event=0; event<numEvents; event++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = configs[event];
+        attr.read_format = PERF_FORMAT_GROUP;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        int leader = event == 0 ? -1 : counters->fds[0];
+        counters->fds[event] = syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+        if(counters->fds[event] < 0) {
+            qDebug() << "Warning, could not open hardware counter " << event << ": " << strerror(errno);
+            for(int k=0; k<event; k++) {
+                close(counters->fds[k]);
+            }
+            return false;
+        }
+    }
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry.push_back(std::move(counters));
+    return true;
+#else
+    qDebug() << "Warning, hardware counters are only available on Linux.";
+    return false;
+#endif
+}
+}
+
+CPPerfCounts &CPPerfCounts::operator+=(const CPPerfCounts &other)
+{
+    cycles += other.cycles;
+    instructions += other.instructions;
+    cacheMisses += other.cacheMisses;
+    branchMisses += other.branchMisses;
+    return *this;
+}
+
+CPPerfCounts CPPerfCounts::operator-(const CPPerfCounts &other) const
+{
+    CPPerfCounts difference;
+    difference.cycles = cycles - other.cycles;
+    difference.instructions = instructions - other.instructions;
+    difference.cacheMisses = cacheMisses - other.cacheMisses;
+    difference.branchMisses = branchMisses - other.branchMisses;
+    return difference;
+}
+
+bool CPPerfCounters::enable()
+{
+    if(enabled) return true;
+    if(!openThreadCounters()) return false;
+    attached = true;
+    enabled = true;
+    return true;
+}
+
+bool CPPerfCounters::isEnabled()
+{
+    return enabled;
+}
+
+void CPPerfCounters::attachThread()
+{
+    // A thread that fails to open its counters is not retried
+    if(!enabled || attached) return;
+    attached = true;
+    openThreadCounters();
+}
+
+CPPerfCounts CPPerfCounters::read()
+{
+    CPPerfCounts counts;
+#ifdef Q_OS_LINUX
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for(const std::unique_ptr<ThreadCounters> &counters : registry) {
+        quint64 values[1 + numEvents];
+        if(::read(counters->fds[0], values, sizeof(values)) != sizeof(values)) continue;
+        counts.cycles += values[1];
+        counts.instructions += values[2];
+        counts.cacheMisses += values[3];
+        counts.branchMisses += values[4];
+    }
+#endif
+    return counts;
+}
+
+double CPPerfCounters::streamBandwidth()
+{
+    // STREAM triad on all pool threads, best of five, measured once. The arrays are far larger
+    // than the last level cache, and the bytes are counted as STREAM does, without the write
+    // allocate traffic.
+    static double bandwidth = 0;
+    if(bandwidth > 0) return bandwidth;
+
+    const int n = 1 << 22;
+    std::vector<double> a(n), b(n, 1.0), c(n, 2.0);
+    CPThreadPool &pool = CPThreadPool::instance();
+    auto triad = [&](int begin, int end) {
+        for(int k=begin; k<end; k++) {
+            a[k] = b[k] + 3.0*c[k];
+        }
+    };
+    pool.parallelFor(0, n, triad);
+    for(int repetition=0; repetition<5; repetition++) {
+        QElapsedTimer timer;
+        timer.start();
+        pool.parallelFor(0, n, triad);
+        double elapsed = timer.nsecsElapsed()*1e-9;
+        bandwidth = std::max(bandwidth, 3*sizeof(double)*double(n)/elapsed);
+    }
+    return bandwidth;
+}
@@ -0,0 +1,34 @@
+#ifndef CPPERFCOUNTERS_H
+#define CPPERFCOUNTERS_H
+#include <QtGlobal>
+
+// Hardware event counts of a stretch of code
+class CPPerfCounts
+{
+public:
+    qint64 cycles;
+    qint64 instructions;
+    qint64 cacheMisses;
+    qint64 branchMisses;
+
+    CPPerfCounts() : cycles(0), instructions(0), cacheMisses(0), branchMisses(0) { }
+    CPPerfCounts &operator+=(const CPPerfCounts &other);
+    CPPerfCounts operator-(const CPPerfCounts &other) const;
+};
+
+// Per thread hardware counters for cycles, instructions, last level cache misses and branch
+// misses, read through perf_event_open on Linux. Each thread that counts opens its own group,
+// the calling thread in enable() and the pool workers the next time they wake up, and read()
+// sums all groups. Elsewhere, or when the kernel refuses the counters, enable() fails and
+// read() gives zeros.
+class CPPerfCounters
+{
+public:
+    static bool enable();
+    static bool isEnabled();
+    static void attachThread();
+    static CPPerfCounts read();
+    static double streamBandwidth();
+};
+
+#endif // CPPERFCOUNTERS_H
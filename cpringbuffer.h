@@ -0,0 +1,67 @@
+#ifndef CPRINGBUFFER_H
+#define CPRINGBUFFER_H
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstddef>
+
+// Fixed capacity single producer, single consumer queue of values. The storage is allocated up
+// front and push and pop only synchronize through two counters, so the producer never
+// allocates, locks or waits. Pushes are all or nothing, a consumer that pops multiples of the
+// record size always gets whole records.
+template<class T>
+class CPRingBuffer
+{
+private:
+    std::vector<T> m_buffer;
+    std::atomic<size_t> m_written;
+    std::atomic<size_t> m_read;
+
+public:
+    CPRingBuffer(size_t capacity = 0) :
+        m_buffer(capacity),
+        m_written(0),
+        m_read(0)
+    {
+
+    }
+
+    // Not safe while the producer or the consumer is running
+    void resize(size_t capacity) {
+        m_buffer.assign(capacity, T());
+        m_written = 0;
+        m_read = 0;
+    }
+
+    size_t capacity() const { return m_buffer.size(); }
+    size_t size() const { return m_written.load(std::memory_order_acquire) - m_read.load(std::memory_order_acquire); }
+
+    bool push(const T *values, size_t count) {
+        size_t written = m_written.load(std::memory_order_relaxed);
+        size_t read = m_read.load(std::memory_order_acquire);
+        size_t capacity = m_buffer.size();
+        if(capacity - (written - read) < count) return false;
+        size_t start = written % capacity;
+        size_t first = std::min(count, capacity - start);
+        std::copy(values, values + first, m_buffer.begin() + start);
+        std::copy(values + first, values + count, m_buffer.begin());
+        m_written.store(written + count, std::memory_order_release);
+        return true;
+    }
+
+    size_t pop(T *values, size_t maxCount) {
+        size_t read = m_read.load(std::memory_order_relaxed);
+        size_t written = m_written.load(std::memory_order_acquire);
+        size_t count = std::min(maxCount, written - read);
+        size_t capacity = m_buffer.size();
+        if(count == 0) return 0;
+        size_t start = read % capacity;
+        size_t first = std::min(count, capacity - start);
+        std::copy(m_buffer.begin() + start, m_buffer.begin() + start + first, values);
+        std::copy(m_buffer.begin(), m_buffer.begin() + (count - first), values + first);
+        m_read.store(read + count, std::memory_order_release);
+        return count;
+    }
+};
+
+#endif // CPRINGBUFFER_H
@@ -0,0 +1,174 @@
+#include "cpthreadpool.h"
+#include "cpperfcounters.h"
+#include "cptrace.h"
+#include <algorithm>
+
+namespace {
+thread_local bool insideParallelFor = false;
+}
+
+CPThreadPool::CPThreadPool(int numThreads) :
+    m_stop(false),
+    m_generation(0),
+    m_activeWorkers(0),
+    m_body(0),
+    m_end(0),
+    m_blockSize(1),
+    m_next(0)
+{
+    if(numThreads <= 0) numThreads = std::max(1u, std::thread::hardware_concurrency());
+
+    // The calling thread takes part in every loop, so it counts as one of the threads
+    for(int i=1; i<numThreads; i++) {
+        m_threads.push_back(std::thread(&CPThreadPool::workerLoop, this));
+    }
+    for(int i=0; i<numThreads; i++) {
+        m_taskQueues.push_back(std::unique_ptr<TaskQueue>(new TaskQueue()));
+    }
+}
+
+CPThreadPool::~CPThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_workAvailable.notify_all();
+    for(std::thread &thread : m_threads) {
+        thread.join();
+    }
+}
+
+CPThreadPool &CPThreadPool::instance()
+{
+    static CPThreadPool pool;
+    return pool;
+}
+
+int CPThreadPool::numThreads() const
+{
+    return m_threads.size() + 1;
+}
+
+bool CPThreadPool::runsInParallel() const
+{
+    // False inside a parallelFor body or a task, where loops run serially
+    return !insideParallelFor && !m_threads.empty();
+}
+
+void CPThreadPool::runBlocks(const std::function<void(int, int)> &body, int end, int blockSize)
+{
+    CPTraceScope trace("parallel for");
+    insideParallelFor = true;
+    int begin;
+    while((begin = m_next.fetch_add(blockSize)) < end) {
+        body(begin, std::min(begin + blockSize, end));
+    }
+    insideParallelFor = false;
+}
+
+void CPThreadPool::workerLoop()
+{
+    CPTrace::setThreadName("pool worker");
+    unsigned int generation = 0;
+    while(true) {
+        const std::function<void(int, int)> *body;
+        int end;
+        int blockSize;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_workAvailable.wait(lock, [&] { return m_stop || m_generation != generation; });
+            if(m_stop) return;
+            generation = m_generation;
+            // A worker that wakes up after the loop has finished has nothing to do
+            if(!m_body) continue;
+            body = m_body;
+            end = m_end;
+            blockSize = m_blockSize;
+            m_activeWorkers++;
+        }
+
+        // Counters are opened on the worker itself, whenever they were enabled
+        CPPerfCounters::attachThread();
+        runBlocks(*body, end, blockSize);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_activeWorkers--;
+        }
+        m_workDone.notify_all();
+    }
+}
+
+void CPThreadPool::parallelFor(int begin, int end, const std::function<void(int, int)> &body, int blockSize)
+{
+    if(end <= begin) return;
+    if(insideParallelFor || m_threads.empty()) {
+        body(begin, end);
+        return;
+    }
+
+    // Default to a few blocks per thread so uneven blocks still balance
+    if(blockSize <= 0) blockSize = std::max(1, (end - begin) / (4*numThreads()));
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_body = &body;
+    m_end = end;
+    m_blockSize = blockSize;
+    m_next = begin;
+    m_generation++;
+    lock.unlock();
+    m_workAvailable.notify_all();
+
+    runBlocks(body, end, blockSize);
+
+    lock.lock();
+    m_workDone.wait(lock, [&] { return m_activeWorkers == 0; });
+    m_body = 0;
+}
+
+bool CPThreadPool::takeTask(int queue, int &task)
+{
+    int numQueues = m_taskQueues.size();
+    for(int k=0; k<numQueues; k++) {
+        TaskQueue &taskQueue = *m_taskQueues[(queue + k) % numQueues];
+        std::lock_guard<std::mutex> lock(taskQueue.mutex);
+        if(taskQueue.tasks.empty()) continue;
+        if(k == 0) {
+            task = taskQueue.tasks.front();
+            taskQueue.tasks.pop_front();
+        } else {
+            task = taskQueue.tasks.back();
+            taskQueue.tasks.pop_back();
+        }
+        return true;
+    }
+    return false;
+}
+
+void CPThreadPool::runTasks(const std::vector<std::function<void()>> &tasks)
+{
+    if(!runsInParallel()) {
+        for(const std::function<void()> &task : tasks) {
+            task();
+        }
+        return;
+    }
+
+    // Task k starts in queue k % numThreads, so tasks submitted in order of decreasing cost
+    // give every thread a similar share. A thread works through its own queue from the front
+    // and then steals the cheapest remaining tasks from the back of the others.
+    int numQueues = m_taskQueues.size();
+    for(size_t k=0; k<tasks.size(); k++) {
+        m_taskQueues[k % numQueues]->tasks.push_back(k);
+    }
+    parallelFor(0, numQueues, [&](int queueBegin, int queueEnd) {
+        for(int queue=queueBegin; queue<queueEnd; queue++) {
+            int task;
+            while(takeTask(queue, task)) {
+                CPTraceScope trace("task");
+                tasks[task]();
+            }
+        }
+    }, 1);
+}
@@ -0,0 +1,55 @@
+#ifndef CPTHREADPOOL_H
+#define CPTHREADPOOL_H
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <memory>
+
+// Persistent worker threads for data parallel loops. parallelFor splits [begin, end) into
+// blocks that the workers and the calling thread claim until all are done. runTasks runs
+// independent tasks of uneven size with work stealing. Calls from inside a parallelFor body or
+// a task run serially on the calling thread.
+class CPThreadPool
+{
+private:
+    // Task indices owned by one thread, taken from the front by the owner and stolen from the back
+    class TaskQueue
+    {
+    public:
+        std::mutex mutex;
+        std::deque<int> tasks;
+    };
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_workAvailable;
+    std::condition_variable m_workDone;
+    bool m_stop;
+    unsigned int m_generation;
+    int m_activeWorkers;
+
+    const std::function<void(int, int)> *m_body;
+    int m_end;
+    int m_blockSize;
+    std::atomic<int> m_next;
+    std::vector<std::unique_ptr<TaskQueue>> m_taskQueues;
+
+    void workerLoop();
+    void runBlocks(const std::function<void(int, int)> &body, int end, int blockSize);
+    bool takeTask(int queue, int &task);
+
+public:
+    CPThreadPool(int numThreads = 0);
+    ~CPThreadPool();
+    static CPThreadPool &instance();
+    int numThreads() const;
+    bool runsInParallel() const;
+    void parallelFor(int begin, int end, const std::function<void(int, int)> &body, int blockSize = 0);
+    void runTasks(const std::vector<std::function<void()>> &tasks);
+};
+
+#endif // CPTHREADPOOL_H
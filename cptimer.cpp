@@ -1,7 +1,34 @@
 #include "cptimer.h"
 #include <qdebug.h>
 
-CPTimer::CPTimer()
+CPTimer::CPTimer() :
+    m_computeTimestep("step"),
+    m_normalVectors("normals"),
+    m_rendering("rendering"),
+    m_uploadVBO("upload"),
+    m_drawElements("draw"),
+    m_sync("sync"),
+    m_copyData("swap fields"),
+    m_temp("solver kernels"),
+    m_readPixels("read pixels")
 {
     m_timer.start();
 }
+
+void CPTimer::reportCounters(QString name, CPTimingObject &timer)
+{
+    // Every last level cache miss is counted as one 64 byte line from memory
+    if(!CPPerfCounters::isEnabled()) return;
+    const CPPerfCounts &counts = timer.counts();
+    double bytes = 64.0*counts.cacheMisses;
+    double bandwidth = timer.elapsedTime() > 0 ? bytes/timer.elapsedTime() : 0;
+    double streamBandwidth = CPPerfCounters::streamBandwidth();
+    qDebug() << name << ": IPC " << (counts.cycles ? double(counts.instructions)/counts.cycles : 0)
+             << ", " << counts.cacheMisses << " LLC misses, " << counts.branchMisses << " branch misses, "
+             << 1e-9*bandwidth << " GB/s from memory (" << 100*bandwidth/streamBandwidth << "% of the "
+             << 1e-9*streamBandwidth << " GB/s STREAM triad)";
+    if(timer.cellUpdates() > 0) {
+        qDebug() << name << ": " << bytes/timer.cellUpdates() << " bytes and "
+                 << double(counts.instructions)/timer.cellUpdates() << " instructions per cell update";
+    }
+}
@@ -2,23 +2,45 @@
 #define CPTIMER_H
 #include <QElapsedTimer>
 #include <QDebug>
+#include "cpperfcounters.h"
+#include "cptrace.h"
 class CPTimingObject {
 private:
     QElapsedTimer m_timer;
     double m_timeElapsed;
+    // Name and start of the running interval in the timeline, while CPTrace is recording
+    const char *m_name;
+    qint64 m_traceBegin;
+    // Hardware counts while the timer ran, when CPPerfCounters are enabled, and the number of
+    // grid cells the timed code updated
+    CPPerfCounts m_counts;
+    CPPerfCounts m_startCounts;
+    qint64 m_cellUpdates;
 public:
-    CPTimingObject() : m_timeElapsed(0) { }
+    CPTimingObject(const char *name) : m_timeElapsed(0), m_name(name), m_traceBegin(0), m_cellUpdates(0) { }
 
     void start() {
         m_timer.restart();
+        m_traceBegin = CPTrace::isRecording() ? CPTrace::now() : 0;
+        if(CPPerfCounters::isEnabled()) m_startCounts = CPPerfCounters::read();
     }
 
     void stop() {
-        m_timeElapsed += m_timer.elapsed() / double(1000);
+        m_timeElapsed += m_timer.nsecsElapsed() * 1e-9;
         m_timer.restart();
+        if(CPPerfCounters::isEnabled()) m_counts += CPPerfCounters::read() - m_startCounts;
+        if(CPTrace::isRecording()) {
+            qint64 now = CPTrace::now();
+            if(m_traceBegin) CPTrace::record(m_name, m_traceBegin, now);
+            m_traceBegin = now;
+        }
     }
 
+    void addCellUpdates(qint64 cellUpdates) { m_cellUpdates += cellUpdates; }
+
     double elapsedTime() { return m_timeElapsed; }
+    const CPPerfCounts &counts() const { return m_counts; }
+    qint64 cellUpdates() const { return m_cellUpdates; }
 };
 
 class CPTimer
@@ -28,8 +50,9 @@ public:
 
     static CPTimer& getInstance()
     {
-        static CPTimer instance; // Guaranteed to be destroyed.
-                                 // Instantiated on first use.
+        // One set of timers per thread, so that simulators stepped concurrently do not race.
+        // The GUI steps and renders on the same thread.
+        static thread_local CPTimer instance;
         return instance;
     }
 
@@ -42,6 +65,7 @@ public:
     CPTimingObject m_sync;
     CPTimingObject m_copyData;
     CPTimingObject m_temp;
+    CPTimingObject m_readPixels;
 
     static CPTimingObject &computeTimestep() { return CPTimer::getInstance().m_computeTimestep; }
     static CPTimingObject &normalVectors() { return CPTimer::getInstance().m_normalVectors; }
@@ -51,7 +75,9 @@ public:
     static CPTimingObject &sync() { return CPTimer::getInstance().m_sync; }
     static CPTimingObject &copyData() { return CPTimer::getInstance().m_copyData; }
     static CPTimingObject &temp() { return CPTimer::getInstance().m_temp; }
+    static CPTimingObject &readPixels() { return CPTimer::getInstance().m_readPixels; }
     static double totalTime() { return CPTimer::getInstance().m_timer.elapsed() / double(1000); }
+    static void reportCounters(QString name, CPTimingObject &timer);
 };
 
 #endif // CPTIMER_H
@@ -0,0 +1,178 @@
+#include "cptrace.h"
+#include "cpringbuffer.h"
+#include <QDebug>
+#include <QFile>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+const size_t eventsPerThread = 1 << 14;
+
+class ThreadEvents
+{
+public:
+    CPRingBuffer<CPTraceEvent> events;
+    const char *name;
+    int id;
+
+    ThreadEvents(const char *name, int id) : events(eventsPerThread), name(name), id(id) { }
+};
+
+// Buffers are registered by the first event of a thread and kept for the rest of the program,
+// so a thread that ends leaves nothing dangling behind
+std::mutex registryMutex;
+std::vector<std::unique_ptr<ThreadEvents>> registry;
+thread_local ThreadEvents *threadEvents = 0;
+thread_local const char *threadName = 0;
+
+QFile *file = 0;
+qint64 epoch = 0;
+bool firstEvent = true;
+std::atomic<qint64> droppedEvents(0);
+std::atomic<bool> stopWriter(false);
+std::thread writerThread;
+
+ThreadEvents *registerThread()
+{
+    std::lock_guard<std::mutex> lock(registryMutex);
+    registry.push_back(std::unique_ptr<ThreadEvents>(new ThreadEvents(threadName, registry.size() + 1)));
+    return registry.back().get();
+}
+
+void writeEvent(const char *json)
+{
+    if(!firstEvent) file->write(",\n");
+    file->write(json);
+    firstEvent = false;
+}
+
+bool drainEvents()
+{
+    std::vector<CPTraceEvent> events(256);
+    char json[256];
+    bool wroteEvents = false;
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for(const std::unique_ptr<ThreadEvents> &thread : registry) {
+        size_t count;
+        while((count = thread->events.pop(&events[0], events.size())) > 0) {
+            for(size_t k=0; k<count; k++) {
+                const CPTraceEvent &event = events[k];
+                snprintf(json, sizeof(json), "{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+                         event.name, (event.begin - epoch)*1e-3, (event.end - event.begin)*1e-3, thread->id);
+                writeEvent(json);
+            }
+            wroteEvents = true;
+        }
+    }
+    return wroteEvents;
+}
+
+void writeEvents()
+{
+    // Polls the buffers like the gauge writer, record() never signals
+    while(true) {
+        bool stop = stopWriter;
+        if(drainEvents()) continue;
+        if(stop) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+}
+}
+
+std::atomic<bool> CPTrace::s_recording(false);
+
+bool CPTrace::start(QString filename)
+{
+    stop();
+
+    file = new QFile(filename);
+    if(!file->open(QFile::WriteOnly | QFile::Truncate)) {
+        qDebug() << "Warning, could not open trace " << filename << ": " << file->errorString();
+        delete file;
+        file = 0;
+        return false;
+    }
+    file->write("[\n");
+    firstEvent = true;
+
+    // Events pushed while the previous trace was stopping are discarded
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        CPTraceEvent event;
+        for(const std::unique_ptr<ThreadEvents> &thread : registry) {
+            while(thread->events.pop(&event, 1) > 0) { }
+        }
+    }
+    epoch = now();
+    droppedEvents = 0;
+    stopWriter = false;
+    writerThread = std::thread(writeEvents);
+    s_recording = true;
+    return true;
+}
+
+void CPTrace::stop()
+{
+    if(!file) return;
+
+    s_recording = false;
+    stopWriter = true;
+    writerThread.join();
+
+    // Thread names as metadata events, for the threads that recorded anything
+    {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        char json[256];
+        for(const std::unique_ptr<ThreadEvents> &thread : registry) {
+            if(thread->name) {
+                snprintf(json, sizeof(json), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+                         thread->id, thread->name);
+            } else {
+                snprintf(json, sizeof(json), "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}",
+                         thread->id, thread->id);
+            }
+            writeEvent(json);
+        }
+    }
+    file->write("\n]\n");
+    file->close();
+    if(droppedEvents > 0) {
+        qDebug() << "Warning, " << qint64(droppedEvents) << " trace events were dropped because "
+                 << file->fileName() << " could not be written fast enough.";
+    }
+    delete file;
+    file = 0;
+}
+
+qint64 CPTrace::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CPTrace::record(const char *name, qint64 begin, qint64 end)
+{
+    if(!isRecording()) return;
+    if(!threadEvents) threadEvents = registerThread();
+    CPTraceEvent event;
+    event.name = name;
+    event.begin = begin;
+    event.end = end;
+    if(!threadEvents->events.push(&event, 1)) {
+        droppedEvents++;
+    }
+}
+
+void CPTrace::setThreadName(const char *name)
+{
+    // Takes effect when the thread registers, which is at its first event
+    threadName = name;
+}
+
+qint64 CPTrace::eventsDropped()
+{
+    return droppedEvents;
+}
@@ -0,0 +1,48 @@
+#ifndef CPTRACE_H
+#define CPTRACE_H
+#include <QString>
+#include <atomic>
+
+// A named region on one thread, in nanoseconds since the trace started. The name must be a
+// string literal or otherwise outlive the trace.
+class CPTraceEvent
+{
+public:
+    const char *name;
+    qint64 begin;
+    qint64 end;
+};
+
+// Timeline of the instrumented regions of every thread, written as Chrome trace JSON that
+// chrome://tracing and Perfetto open. Each thread records into its own preallocated ring
+// buffer, so record() neither allocates nor locks after the first event of a thread, and a
+// writer thread drains the buffers to the file while the trace runs. Events that find their
+// buffer full are dropped and counted.
+class CPTrace
+{
+private:
+    static std::atomic<bool> s_recording;
+public:
+    static bool start(QString filename);
+    static void stop();
+    static bool isRecording() { return s_recording.load(std::memory_order_relaxed); }
+    static qint64 now();
+    static void record(const char *name, qint64 begin, qint64 end);
+    static void setThreadName(const char *name);
+    static qint64 eventsDropped();
+};
+
+// Records the enclosing scope as one event
+class CPTraceScope
+{
+private:
+    const char *m_name;
+    qint64 m_begin;
+public:
+    CPTraceScope(const char *name) : m_name(name), m_begin(CPTrace::isRecording() ? CPTrace::now() : 0) { }
+    ~CPTraceScope() {
+        if(m_begin && CPTrace::isRecording()) CPTrace::record(m_name, m_begin, CPTrace::now());
+    }
+};
+
+#endif // CPTRACE_H
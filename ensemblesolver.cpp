@@ -0,0 +1,257 @@
+#include "ensemblesolver.h"
+#include "cpthreadpool.h"
+#include <cmath>
+#include <cstdlib>
+
+namespace {
+// Static fields of one cell, shared by every member
+struct MemberCell
+{
+    float g, gxm, gxp, gym, gyp;
+    float cxm, cxp, cym, cyp;
+    bool wall;
+};
+
+// The second order leapfrog kernel of WaveSolver for the K members of one cell. Lane m is
+// member m, the pointers are the K values of the cell and its four neighbours. next never
+// overlaps the values that are read, __restrict saves the compiler from versioning the loop.
+inline void stepMembers(int numMembers, const MemberCell &cell, float factor, float factor2,
+                        float dtdtOverdxdx, float dtdtOverdydy, const float *__restrict uc,
+                        const float *__restrict uxm, const float *__restrict uxp,
+                        const float *__restrict uym, const float *__restrict uyp,
+                        const float *__restrict previous, float *__restrict next)
+{
+    float g = cell.g, gxm = cell.gxm, gxp = cell.gxp, gym = cell.gym, gyp = cell.gyp;
+    // Computed outside the loop, GCC does not speculate a subtraction in a select and would
+    // keep the branch
+    float dryValue = g - 0.01f;
+#ifndef CONSTANTWAVESPEED
+    float cxm = cell.cxm, cxp = cell.cxp, cym = cell.cym, cyp = cell.cyp;
+    if(cell.wall) {
+        // Walls are zero in every member
+        float value = g > 0 ? dryValue : 0;
+        for(int m=0; m<numMembers; m++) {
+            next[m] = value;
+        }
+        return;
+    }
+#endif
+#pragma clang loop vectorize(enable) interleave(enable)
+    for(int m=0; m<numMembers; m++) {
+        float u0 = uc[m];
+        float xm = uxm[m], xp = uxp[m], ym = uym[m], yp = uyp[m];
+        // A neighbour behind ground that is higher than the water level is mirrored through the cell
+        float nxp = gxp > u0 ? xm : xp;
+        float nxm = gxm > u0 ? xp : xm;
+        float nyp = gyp > u0 ? ym : yp;
+        float nym = gym > u0 ? yp : ym;
+        float ddt_rest = factor2*previous[m] + 2*u0;
+#ifdef CONSTANTWAVESPEED
+        float ddx = nxp + nxm - 2*u0;
+        float ddy = nyp + nym - 2*u0;
+#else
+        float ddx = cxp*(nxp - u0) - cxm*(u0 - nxm);
+        float ddy = cyp*(nyp - u0) - cym*(u0 - nym);
+#endif
+        float value = factor*(dtdtOverdxdx*ddx + dtdtOverdydy*ddy + ddt_rest);
+        // Clamp cells that fall dry to just below the ground
+        next[m] = g > value ? dryValue : value;
+    }
+}
+
+inline void clampMembers(int numMembers, float g, const float *__restrict next, float *__restrict u)
+{
+    float dryValue = g - 0.001f;
+#pragma clang loop vectorize(enable) interleave(enable)
+    for(int m=0; m<numMembers; m++) {
+        float value = u[m];
+        u[m] = g > next[m] ? dryValue : value;
+    }
+}
+}
+
+EnsembleSolver::EnsembleSolver() :
+    m_numMembers(0),
+    m_nx(0),
+    m_ny(0),
+    m_dx(0),
+    m_dy(0),
+    m_xMin(0),
+    m_yMin(0),
+    m_dampingFactor(0),
+    m_time(0)
+{
+
+}
+
+void EnsembleSolver::setScenario(const WaveSolver &solver, int numMembers)
+{
+    // Every member starts at rest from the current solution of the solver
+    m_numMembers = numMembers;
+    m_nx = solver.nx();
+    m_ny = solver.ny();
+    m_dx = solver.dx();
+    m_dy = solver.dy();
+    m_xMin = solver.xMin();
+    m_yMin = solver.yMin();
+    m_dampingFactor = solver.dampingFactor();
+    m_time = solver.time();
+
+    size_t numCells = size_t(m_nx)*m_ny;
+    m_ground.resize(numCells);
+    m_walls.resize(numCells);
+    m_waveSpeed.resize(numCells);
+    std::vector<float> values(numCells);
+    for(int i=0; i<m_nx; i++) {
+        solver.groundField().loadRow(i, &m_ground[i*m_ny]);
+        solver.wallsField().loadRow(i, &m_walls[i*m_ny]);
+        solver.waveSpeedField().loadRow(i, &m_waveSpeed[i*m_ny]);
+        solver.solutionField().loadRow(i, &values[i*m_ny]);
+    }
+
+    m_solution.resize(numCells*numMembers);
+    m_solutionNext.assign(numCells*numMembers, 0);
+    m_solutionPrevious.resize(numCells*numMembers);
+    for(int member=0; member<numMembers; member++) {
+        setMember(member, &values[0], &values[0]);
+    }
+}
+
+int EnsembleSolver::numMembers() const
+{
+    return m_numMembers;
+}
+
+int EnsembleSolver::nx() const
+{
+    return m_nx;
+}
+
+int EnsembleSolver::ny() const
+{
+    return m_ny;
+}
+
+double EnsembleSolver::time() const
+{
+    return m_time;
+}
+
+void EnsembleSolver::setMember(int member, const float *values, const float *previousValues)
+{
+    size_t numCells = size_t(m_nx)*m_ny;
+    for(size_t cell=0; cell<numCells; cell++) {
+        m_solution[cell*m_numMembers + member] = values[cell];
+        m_solutionPrevious[cell*m_numMembers + member] = previousValues[cell];
+    }
+}
+
+void EnsembleSolver::copyMember(int member, float *values) const
+{
+    size_t numCells = size_t(m_nx)*m_ny;
+    for(size_t cell=0; cell<numCells; cell++) {
+        values[cell] = m_solution[cell*m_numMembers + member];
+    }
+}
+
+void EnsembleSolver::addDrop(int member, float x, float y, float amplitude, float standardDeviation)
+{
+    // Same truncated Gaussian as WaveSolver::addDrop, added to u and u_prev so it starts at rest
+    int radiusI = ceil(4*standardDeviation/m_dx);
+    int radiusJ = ceil(4*standardDeviation/m_dy);
+    int i0 = round((x - m_xMin)/m_dx);
+    int j0 = round((y - m_yMin)/m_dy);
+    for(int di=-radiusI; di<=radiusI; di++) {
+        int i = ((i0 + di) % m_nx + m_nx) % m_nx;
+        for(int dj=-radiusJ; dj<=radiusJ; dj++) {
+            int j = ((j0 + dj) % m_ny + m_ny) % m_ny;
+            float rr = di*di*m_dx*m_dx + dj*dj*m_dy*m_dy;
+            float value = amplitude*exp(-rr/(2*standardDeviation*standardDeviation));
+            size_t index = (size_t(i)*m_ny + j)*m_numMembers + member;
+            m_solution[index] += value;
+            m_solutionPrevious[index] += value;
+        }
+    }
+}
+
+void EnsembleSolver::createRandomGauss(int member)
+{
+    float x0 = m_xMin + (m_nx-1)*m_dx*rand()/(double)RAND_MAX;
+    float y0 = m_yMin + (m_ny-1)*m_dy*rand()/(double)RAND_MAX;
+    addDrop(member, x0, y0);
+}
+
+size_t EnsembleSolver::memoryUsage() const
+{
+    return (m_ground.size() + m_walls.size() + m_waveSpeed.size() + m_solution.size()
+            + m_solutionNext.size() + m_solutionPrevious.size())*sizeof(float);
+}
+
+void EnsembleSolver::step(double dt)
+{
+    float factor = 1.0/(1+0.5*m_dampingFactor*dt);
+    float factor2 = -(1.0-0.5*m_dampingFactor*dt);
+    float dtdtOverdxdx = dt*dt/(double(m_dx)*m_dx);
+    float dtdtOverdydy = dt*dt/(double(m_dy)*m_dy);
+
+    CPThreadPool::instance().parallelFor(0, m_nx, [&](int iBegin, int iEnd) {
+        for(int i=iBegin; i<iEnd; i++) {
+            stepRow(i, factor, factor2, dtdtOverdxdx, dtdtOverdydy);
+        }
+    });
+    // u is no longer read once every row is done
+    CPThreadPool::instance().parallelFor(0, m_nx, [&](int iBegin, int iEnd) {
+        for(int i=iBegin; i<iEnd; i++) {
+            clampPreviousRow(i);
+        }
+    });
+
+    m_solutionPrevious.swap(m_solution);
+    m_solution.swap(m_solutionNext);
+    m_time += dt;
+}
+
+void EnsembleSolver::stepRow(int i, float factor, float factor2, float dtdtOverdxdx, float dtdtOverdydy)
+{
+    int K = m_numMembers;
+    int ny = m_ny;
+    size_t row = size_t(i)*ny;
+    size_t rowM = size_t((i - 1 + m_nx) % m_nx)*ny;
+    size_t rowP = size_t((i + 1) % m_nx)*ny;
+    const float *solution = &m_solution[0];
+    for(int j=0; j<ny; j++) {
+        size_t jm = row + (j == 0 ? ny-1 : j-1);
+        size_t jp = row + (j == ny-1 ? 0 : j+1);
+        size_t cell = row + j;
+        MemberCell cellData;
+        // The static fields are loaded once for all members
+        cellData.g = m_ground[cell];
+        cellData.gxm = m_ground[rowM + j];
+        cellData.gxp = m_ground[rowP + j];
+        cellData.gym = m_ground[jm];
+        cellData.gyp = m_ground[jp];
+#ifndef CONSTANTWAVESPEED
+        float c = m_waveSpeed[cell];
+        cellData.cxm = 0.5f*(c + m_waveSpeed[rowM + j]);
+        cellData.cxp = 0.5f*(c + m_waveSpeed[rowP + j]);
+        cellData.cym = 0.5f*(c + m_waveSpeed[jm]);
+        cellData.cyp = 0.5f*(c + m_waveSpeed[jp]);
+        cellData.wall = m_walls[cell] != 0;
+#endif
+        stepMembers(K, cellData, factor, factor2, dtdtOverdxdx, dtdtOverdydy, solution + cell*K,
+                    solution + (rowM + j)*K, solution + (rowP + j)*K, solution + jm*K, solution + jp*K,
+                    &m_solutionPrevious[cell*K], &m_solutionNext[cell*K]);
+    }
+}
+
+void EnsembleSolver::clampPreviousRow(int i)
+{
+    // Cells that fell dry in this step also get their u_prev just below the ground. u_prev is
+    // the current u after the swap.
+    int K = m_numMembers;
+    size_t row = size_t(i)*m_ny;
+    for(int j=0; j<m_ny; j++) {
+        size_t cell = row + j;
+        clampMembers(K, m_ground[cell], &m_solutionNext[cell*K], &m_solution[cell*K]);
+    }
+}
@@ -0,0 +1,54 @@
+#ifndef ENSEMBLESOLVER_H
+#define ENSEMBLESOLVER_H
+#include "wavesolver.h"
+#include <vector>
+
+// Steps many independent simulations of the same scenario in lock step. The members share the
+// ground, walls and wave speed of the WaveSolver they are created from and differ only in their
+// solution. Values are interleaved per cell, member m of cell (i,j) is at (i*ny + j)*K + m, so one
+// sweep of the stencil advances every member, the static fields are loaded once per cell and
+// the members fill the vector lanes even on small grids. K a multiple of 8 fills them evenly.
+// The step is the second order leapfrog step of WaveSolver in float, without the sponge layer
+// and the sources.
+class EnsembleSolver
+{
+private:
+    int    m_numMembers;
+    int    m_nx;
+    int    m_ny;
+    float  m_dx;
+    float  m_dy;
+    float  m_xMin;
+    float  m_yMin;
+    float  m_dampingFactor;
+    double m_time;
+
+    // Shared by all members, one value per cell
+    std::vector<float> m_ground;
+    std::vector<float> m_walls;
+    std::vector<float> m_waveSpeed;
+
+    // K values per cell
+    std::vector<float> m_solution;
+    std::vector<float> m_solutionNext;
+    std::vector<float> m_solutionPrevious;
+
+    void stepRow(int i, float factor, float factor2, float dtdtOverdxdx, float dtdtOverdydy);
+    void clampPreviousRow(int i);
+
+public:
+    EnsembleSolver();
+    void setScenario(const WaveSolver &solver, int numMembers);
+    int numMembers() const;
+    int nx() const;
+    int ny() const;
+    double time() const;
+    void step(double dt);
+    void setMember(int member, const float *values, const float *previousValues);
+    void copyMember(int member, float *values) const;
+    void addDrop(int member, float x, float y, float amplitude = 0.5, float standardDeviation = 0.2);
+    void createRandomGauss(int member);
+    size_t memoryUsage() const;
+};
+
+#endif // ENSEMBLESOLVER_H
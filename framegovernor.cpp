@@ -0,0 +1,80 @@
+#include "framegovernor.h"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+const double smoothing = 0.1;
+const double targetFraction = 0.8;
+const int patience = 30;
+const int settleFrames = 60;
+const int gridSizeMultiple = 8;
+}
+
+FrameGovernor::FrameGovernor() :
+    m_frameBudget(0),
+    m_averageWorkTime(0),
+    m_minimumGridSize(64),
+    m_maximumGridSize(0),
+    m_framesOutsideBudget(0),
+    m_framesToSettle(0)
+{
+
+}
+
+double FrameGovernor::frameBudget() const
+{
+    return m_frameBudget;
+}
+
+void FrameGovernor::setFrameBudget(double frameBudget)
+{
+    // Zero turns the governor off
+    m_frameBudget = std::max(frameBudget, 0.0);
+}
+
+void FrameGovernor::setGridSizeLimits(int minimum, int maximum)
+{
+    m_minimumGridSize = std::max(minimum, 2);
+    m_maximumGridSize = maximum;
+}
+
+double FrameGovernor::averageWorkTime() const
+{
+    return m_averageWorkTime;
+}
+
+bool FrameGovernor::addFrame(double workTime, int nx, int ny, int &newNx, int &newNy)
+{
+    if(m_frameBudget <= 0) return false;
+    if(m_maximumGridSize <= 0) m_maximumGridSize = std::max(nx, ny);
+    if(m_framesToSettle > 0) {
+        // The first frames after a resize pay for the new buffers
+        m_framesToSettle--;
+        m_averageWorkTime = workTime;
+        return false;
+    }
+    m_averageWorkTime = m_averageWorkTime > 0 ? m_averageWorkTime + smoothing*(workTime - m_averageWorkTime) : workTime;
+
+    bool over = m_averageWorkTime > m_frameBudget;
+    bool under = m_averageWorkTime < 0.5*m_frameBudget && std::max(nx, ny) < m_maximumGridSize;
+    if(!over && !under) {
+        m_framesOutsideBudget = 0;
+        return false;
+    }
+    if(++m_framesOutsideBudget < patience) return false;
+    m_framesOutsideBudget = 0;
+
+    // Both sides are scaled by the same factor, which keeps the aspect ratio, and by at most
+    // a factor two per change
+    double scale = std::sqrt(targetFraction*m_frameBudget/m_averageWorkTime);
+    scale = std::max(0.5, std::min(scale, 2.0));
+    scale = std::min(scale, double(m_maximumGridSize)/std::max(nx, ny));
+    scale = std::max(scale, double(m_minimumGridSize)/std::min(nx, ny));
+    newNx = std::max(gridSizeMultiple, int(round(nx*scale/gridSizeMultiple))*gridSizeMultiple);
+    newNy = std::max(gridSizeMultiple, int(round(ny*scale/gridSizeMultiple))*gridSizeMultiple);
+    newNx = std::min(newNx, std::max(nx, m_maximumGridSize));
+    newNy = std::min(newNy, std::max(ny, m_maximumGridSize));
+    if(newNx == nx && newNy == ny) return false;
+    m_framesToSettle = settleFrames;
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef FRAMEGOVERNOR_H
+#define FRAMEGOVERNOR_H
+
+// Chooses the simulation grid size that keeps the per frame work of stepping and rendering
+// inside a frame budget. The work is smoothed over the frames, and only when it has stayed
+// above the budget, or below half of it, for a while is a new size proposed. Since the work
+// grows with the number of cells, the new size aims the work at 80% of the budget. After a
+// change the governor waits for the new size to settle. The largest size defaults to the one
+// of the first frame, so the grid is only ever degraded and restored, never enlarged past it.
+class FrameGovernor
+{
+private:
+    double m_frameBudget;
+    double m_averageWorkTime;
+    int    m_minimumGridSize;
+    int    m_maximumGridSize;
+    int    m_framesOutsideBudget;
+    int    m_framesToSettle;
+
+public:
+    FrameGovernor();
+    double frameBudget() const;
+    void setFrameBudget(double frameBudget);
+    void setGridSizeLimits(int minimum, int maximum = 0);
+    double averageWorkTime() const;
+    bool addFrame(double workTime, int nx, int ny, int &newNx, int &newNy);
+};
+
+#endif // FRAMEGOVERNOR_H
@@ -0,0 +1,327 @@
+#include "gaugerecorder.h"
+#include <QDebug>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <chrono>
+#include <limits>
+
+namespace {
+const char gaugeMagic[8] = {'W','A','V','E','G','A','G','E'};
+const quint32 gaugeVersion = 1;
+
+// The header is followed by the gauges, each a float32 x and y, a quint32 name length and the
+// UTF-8 name, and then by the samples, each a qint64 step, a float64 time and one float32 per
+// gauge.
+struct GaugeFileHeader {
+    char    magic[8];
+    quint32 version;
+    quint32 headerSize;
+    quint32 numGauges;
+    quint32 reserved;
+};
+}
+
+GaugeRecorder::GaugeRecorder() :
+    m_file(0),
+    m_format(GaugeFormat::CSV),
+    m_recordSize(0),
+    m_samplesDropped(0),
+    m_stopWriter(false),
+    m_rewindStep(std::numeric_limits<int>::max())
+{
+
+}
+
+GaugeRecorder::~GaugeRecorder()
+{
+    close();
+}
+
+bool GaugeRecorder::addGauge(const WaveSolver &solver, QString name, float x, float y)
+{
+    if(m_file) {
+        qDebug() << "Warning, gauge " << name << " added after the gauge output was opened.";
+        return false;
+    }
+    if(x < solver.xMin() || x > solver.xMax() || y < solver.yMin() || y > solver.yMax()) {
+        qDebug() << "Warning, gauge " << name << " at (" << x << ", " << y << ") is outside the domain.";
+        return false;
+    }
+
+    float fi = (x - solver.xMin())/solver.dx();
+    float fj = (y - solver.yMin())/solver.dy();
+    int i = std::min(int(floor(fi)), solver.nx()-1);
+    int j = std::min(int(floor(fj)), solver.ny()-1);
+    float ti = fi - i;
+    float tj = fj - j;
+
+    Gauge gauge;
+    gauge.name = name;
+    gauge.x = x;
+    gauge.y = y;
+    gauge.indexI[0] = i;
+    gauge.indexI[1] = (i + 1) % solver.nx();
+    gauge.indexJ[0] = j;
+    gauge.indexJ[1] = (j + 1) % solver.ny();
+    gauge.weights[0] = (1 - ti)*(1 - tj);
+    gauge.weights[1] = (1 - ti)*tj;
+    gauge.weights[2] = ti*(1 - tj);
+    gauge.weights[3] = ti*tj;
+    m_gauges.push_back(gauge);
+    return true;
+}
+
+bool GaugeRecorder::loadGauges(const WaveSolver &solver, QString filename)
+{
+    // One gauge per line as "name x y", lines starting with # are comments
+    QFile file(filename);
+    if(!file.open(QFile::ReadOnly)) {
+        qDebug() << "Warning, could not open gauge list " << filename << ": " << file.errorString();
+        return false;
+    }
+    QStringList lines = QString::fromUtf8(file.readAll()).split("\n");
+    for(const QString &line : lines) {
+        QString trimmed = line.simplified();
+        if(trimmed.isEmpty() || trimmed.startsWith("#")) continue;
+        QStringList fields = trimmed.split(" ");
+        bool validX = false;
+        bool validY = false;
+        float x = fields.size() == 3 ? fields[1].toFloat(&validX) : 0;
+        float y = fields.size() == 3 ? fields[2].toFloat(&validY) : 0;
+        if(!validX || !validY) {
+            qDebug() << "Warning, invalid gauge " << line << " in " << filename << ", expected name x y.";
+            return false;
+        }
+        if(!addGauge(solver, fields[0], x, y)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int GaugeRecorder::numGauges() const
+{
+    return m_gauges.size();
+}
+
+const std::vector<Gauge> &GaugeRecorder::gauges() const
+{
+    return m_gauges;
+}
+
+bool GaugeRecorder::open(QString filename, GaugeFormat format, int capacity)
+{
+    close();
+
+    m_file = new QFile(filename);
+    if(!m_file->open(QFile::WriteOnly | QFile::Truncate)) {
+        qDebug() << "Warning, could not open gauge output " << filename << ": " << m_file->errorString();
+        delete m_file;
+        m_file = 0;
+        return false;
+    }
+
+    // A record is the step, the time and one value per gauge. Everything the step path touches
+    // is allocated here.
+    m_format = format;
+    m_recordSize = 2 + m_gauges.size();
+    m_record.assign(m_recordSize, 0);
+    m_buffer.resize(size_t(std::max(capacity, 1))*m_recordSize);
+    m_samplesDropped = 0;
+    m_rewindStep = std::numeric_limits<int>::max();
+    m_samplePositions.clear();
+    writeHeader();
+
+    m_stopWriter = false;
+    m_writerThread = std::thread(&GaugeRecorder::writeSamples, this);
+    return true;
+}
+
+bool GaugeRecorder::isOpen() const
+{
+    return m_file != 0;
+}
+
+qint64 GaugeRecorder::samplesDropped() const
+{
+    return m_samplesDropped;
+}
+
+void GaugeRecorder::sample(const WaveSolver &solver, int step, double time)
+{
+    if(!m_file) return;
+
+    const CPField &field = solver.solutionField();
+    double *record = &m_record[0];
+    record[0] = step;
+    record[1] = time;
+    for(size_t k=0; k<m_gauges.size(); k++) {
+        const Gauge &gauge = m_gauges[k];
+        record[2+k] = gauge.weights[0]*field.value(gauge.indexI[0], gauge.indexJ[0])
+                    + gauge.weights[1]*field.value(gauge.indexI[0], gauge.indexJ[1])
+                    + gauge.weights[2]*field.value(gauge.indexI[1], gauge.indexJ[0])
+                    + gauge.weights[3]*field.value(gauge.indexI[1], gauge.indexJ[1]);
+    }
+    if(!m_buffer.push(record, m_recordSize)) {
+        m_samplesDropped++;
+    }
+}
+
+void GaugeRecorder::setRewindStep(int step)
+{
+    // No rewind goes back before step, the positions of the samples up to it can be forgotten
+    m_rewindStep = step;
+}
+
+void GaugeRecorder::rewind(int step)
+{
+    // The rewind travels through the buffer as a record with a negative step, so that the
+    // writer removes exactly the samples pushed before it. It must not be dropped like a sample,
+    // so a full buffer is waited for, rewinds are rare.
+    if(!m_file) return;
+    m_record.assign(m_recordSize, 0);
+    m_record[0] = -1 - qint64(step);
+    while(!m_buffer.push(&m_record[0], m_recordSize)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void GaugeRecorder::close()
+{
+    if(!m_file) return;
+
+    m_stopWriter = true;
+    m_writerThread.join();
+    m_file->close();
+    if(m_samplesDropped > 0) {
+        qDebug() << "Warning, " << m_samplesDropped << " gauge samples were dropped because "
+                 << m_file->fileName() << " could not be written fast enough.";
+    }
+    delete m_file;
+    m_file = 0;
+}
+
+void GaugeRecorder::writeSamples()
+{
+    // Polls the buffer, so that sample() never has to signal the writer. Everything pushed
+    // before close() is written, since the stop flag is read before the last pop.
+    std::vector<double> records(m_buffer.capacity());
+    while(true) {
+        bool stop = m_stopWriter;
+        size_t count = m_buffer.pop(&records[0], records.size());
+        if(count > 0) {
+            // Samples before a rewind record are written before it is applied
+            int numRecords = count/m_recordSize;
+            int first = 0;
+            for(int r=0; r<numRecords; r++) {
+                qint64 step = records[size_t(r)*m_recordSize];
+                if(step >= 0) continue;
+                writeRecords(&records[size_t(first)*m_recordSize], r - first);
+                truncate(-1 - step);
+                first = r + 1;
+            }
+            writeRecords(&records[size_t(first)*m_recordSize], numRecords - first);
+        } else if(stop) {
+            break;
+        } else {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    }
+}
+
+void GaugeRecorder::writeHeader()
+{
+    if(m_format == GaugeFormat::CSV) {
+        QString header = "step,time";
+        for(const Gauge &gauge : m_gauges) {
+            header += "," + gauge.name;
+        }
+        header += "\n";
+        m_file->write(header.toUtf8());
+        return;
+    }
+
+    GaugeFileHeader header;
+    memcpy(header.magic, gaugeMagic, sizeof(header.magic));
+    header.version = gaugeVersion;
+    header.headerSize = sizeof(GaugeFileHeader);
+    header.numGauges = m_gauges.size();
+    header.reserved = 0;
+    m_file->write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for(const Gauge &gauge : m_gauges) {
+        QByteArray name = gauge.name.toUtf8();
+        quint32 nameLength = name.size();
+        m_file->write(reinterpret_cast<const char*>(&gauge.x), sizeof(gauge.x));
+        m_file->write(reinterpret_cast<const char*>(&gauge.y), sizeof(gauge.y));
+        m_file->write(reinterpret_cast<const char*>(&nameLength), sizeof(nameLength));
+        m_file->write(name.constData(), nameLength);
+    }
+}
+
+void GaugeRecorder::truncate(qint64 step)
+{
+    // Cuts the file at the first sample after step. The positions are in step order, the
+    // samples after a rewind start again right after its step.
+    if(m_samplePositions.empty() || m_samplePositions.back().first <= step) return;
+    qint64 position = 0;
+    while(!m_samplePositions.empty() && m_samplePositions.back().first > step) {
+        position = m_samplePositions.back().second;
+        m_samplePositions.pop_back();
+    }
+    m_file->flush();
+    if(!m_file->resize(position) || !m_file->seek(position)) {
+        qDebug() << "Warning, could not remove the rolled back gauge samples from " << m_file->fileName()
+                 << ": " << m_file->errorString();
+    }
+}
+
+void GaugeRecorder::writeRecords(const double *records, int numRecords)
+{
+    if(numRecords == 0) return;
+    int numGauges = m_recordSize - 2;
+    std::vector<char> out;
+    qint64 filePosition = m_file->pos();
+    qint64 rewindStep = m_rewindStep;
+    while(!m_samplePositions.empty() && m_samplePositions.front().first <= rewindStep) {
+        m_samplePositions.pop_front();
+    }
+    auto addPosition = [&](qint64 step, size_t offset) {
+        if(step > rewindStep) m_samplePositions.push_back(std::make_pair(step, filePosition + qint64(offset)));
+    };
+
+    if(m_format == GaugeFormat::CSV) {
+        char text[32];
+        for(int r=0; r<numRecords; r++) {
+            const double *record = records + r*m_recordSize;
+            addPosition(record[0], out.size());
+            int length = snprintf(text, sizeof(text), "%lld,%.9g", (long long)record[0], record[1]);
+            out.insert(out.end(), text, text + length);
+            for(int k=0; k<numGauges; k++) {
+                length = snprintf(text, sizeof(text), ",%.7g", record[2+k]);
+                out.insert(out.end(), text, text + length);
+            }
+            out.push_back('\n');
+        }
+    } else {
+        out.resize(size_t(numRecords)*(sizeof(qint64) + sizeof(double) + numGauges*sizeof(float)));
+        char *p = &out[0];
+        for(int r=0; r<numRecords; r++) {
+            const double *record = records + r*m_recordSize;
+            qint64 step = record[0];
+            addPosition(step, p - &out[0]);
+            memcpy(p, &step, sizeof(step));
+            p += sizeof(step);
+            memcpy(p, &record[1], sizeof(double));
+            p += sizeof(double);
+            for(int k=0; k<numGauges; k++) {
+                float value = record[2+k];
+                memcpy(p, &value, sizeof(value));
+                p += sizeof(value);
+            }
+        }
+    }
+    if(!out.empty()) {
+        m_file->write(&out[0], out.size());
+    }
+}
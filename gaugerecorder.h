@@ -0,0 +1,72 @@
+#ifndef GAUGERECORDER_H
+#define GAUGERECORDER_H
+#include <QString>
+#include <QFile>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <atomic>
+#include "cpringbuffer.h"
+#include "wavesolver.h"
+
+enum class GaugeFormat {CSV = 0, Binary = 1};
+
+// Virtual wave gauge at a point in world coordinates. The surface height is interpolated
+// bilinearly from the four grid points around it, which wrap around the periodic boundaries
+// like the stencil. Dry points report the water just below the ground.
+class Gauge
+{
+public:
+    QString name;
+    float x;
+    float y;
+    int indexI[2];
+    int indexJ[2];
+    float weights[4];
+};
+
+// Records the gauges every step into a preallocated ring buffer. sample() neither allocates nor
+// locks, a writer thread drains the buffer to a CSV or binary file. When the writer falls so far
+// behind that the buffer is full, samples are dropped and counted rather than stalling the
+// simulation. rewind() removes the samples after a step from the output, for runs that roll
+// back; the writer remembers where the samples after setRewindStep() start in the file.
+class GaugeRecorder
+{
+private:
+    std::vector<Gauge> m_gauges;
+    QFile *m_file;
+    GaugeFormat m_format;
+    int m_recordSize;
+    CPRingBuffer<double> m_buffer;
+    std::vector<double> m_record;
+    std::atomic<qint64> m_samplesDropped;
+    std::atomic<bool> m_stopWriter;
+    std::atomic<int> m_rewindStep;
+    std::thread m_writerThread;
+
+    // Step and file position of the samples rewind() may still remove, only touched by the
+    // writer thread
+    std::deque<std::pair<qint64, qint64>> m_samplePositions;
+
+    void writeSamples();
+    void writeHeader();
+    void writeRecords(const double *records, int numRecords);
+    void truncate(qint64 step);
+
+public:
+    GaugeRecorder();
+    ~GaugeRecorder();
+    bool addGauge(const WaveSolver &solver, QString name, float x, float y);
+    bool loadGauges(const WaveSolver &solver, QString filename);
+    int numGauges() const;
+    const std::vector<Gauge> &gauges() const;
+    bool open(QString filename, GaugeFormat format, int capacity = 4096);
+    bool isOpen() const;
+    void sample(const WaveSolver &solver, int step, double time);
+    void setRewindStep(int step);
+    void rewind(int step);
+    void close();
+    qint64 samplesDropped() const;
+};
+
+#endif // GAUGERECORDER_H
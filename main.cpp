@@ -2,11 +2,158 @@
 #include <QQmlApplicationEngine>
 #include <QtQml>
 #include <QGuiApplication>
+#include <QCommandLineParser>
 #include <QtQuick/QQuickView>
 #include "waves.h"
+#include "offscreenwaves.h"
+#include "benchmark.h"
+#include "sweeprunner.h"
+#include "cpperfcounters.h"
+#include "cptrace.h"
 #include <vector>
 using namespace std;
 
+// Parses N or NxM
+bool parseGridSize(QString value, int &nx, int &ny) {
+    QStringList size = value.split("x");
+    nx = size[0].toInt();
+    ny = size.size() == 2 ? size[1].toInt() : nx;
+    if(size.size() > 2 || nx < 2 || ny < 2) {
+        qDebug() << "Warning, invalid grid size " << value << ", expected N or NxM.";
+        return false;
+    }
+    return true;
+}
+
+int runOffscreenCapture(QCommandLineParser &parser) {
+    QStringList size = parser.value("size").split("x");
+    if(size.size() != 2) {
+        qDebug() << "Warning, invalid size " << parser.value("size") << ", expected WIDTHxHEIGHT.";
+        return 1;
+    }
+
+    CaptureFormat format = parser.value("format") == "raw" ? CaptureFormat::Raw : CaptureFormat::PNG;
+    CPFrameCapture capture(parser.value("capture"), format);
+
+    FieldStorage storage;
+    FieldLayout layout;
+    ComputePrecision precision;
+    StencilOrder order;
+    TimeIntegrator integrator;
+    if(!Benchmark::parseFieldStorage(parser.value("storage"), storage)
+            || !Benchmark::parseFieldLayout(parser.value("layout"), layout)
+            || !Benchmark::parseComputePrecision(parser.value("compute"), precision)
+            || !Benchmark::parseStencilOrder(parser.value("stencil-order"), order)
+            || !Benchmark::parseTimeIntegrator(parser.value("integrator"), integrator)) {
+        return 1;
+    }
+
+    OffscreenWaves offscreenWaves(QSize(size[0].toInt(), size[1].toInt()));
+    if(!offscreenWaves.initialize()) {
+        return 1;
+    }
+    WaveSolver &solver = offscreenWaves.simulator().solver();
+    if(parser.isSet("domain") || parser.isSet("grid-size")) {
+        QStringList domain = parser.value("domain").split("x");
+        float lengthX = domain.size() == 2 ? domain[0].toFloat() : 0;
+        float lengthY = domain.size() == 2 ? domain[1].toFloat() : 0;
+        if(lengthX <= 0 || lengthY <= 0) {
+            qDebug() << "Warning, invalid domain " << parser.value("domain") << ", expected LXxLY.";
+            return 1;
+        }
+        int nx = solver.nx();
+        int ny = solver.ny();
+        if(parser.isSet("grid-size") && !parseGridSize(parser.value("grid-size"), nx, ny)) {
+            return 1;
+        }
+        solver.setDomain(-lengthX/2, lengthX/2, -lengthY/2, lengthY/2);
+        solver.setGridSize(nx, ny);
+        solver.reset();
+    }
+    solver.setFieldStorage(storage);
+    solver.setFieldLayout(layout);
+    solver.setComputePrecision(precision);
+    solver.setStencilOrder(order);
+    solver.setTimeIntegrator(integrator);
+    Simulator &simulator = offscreenWaves.simulator();
+    if(!simulator.setTimestepScale(parser.value("timestep-scale").toDouble())) {
+        return 1;
+    }
+    if(integrator == TimeIntegrator::ADI || parser.isSet("timestep-scale")) {
+        simulator.reportTimestep();
+    }
+    if(!simulator.isTimestepStable()) {
+        return 1;
+    }
+    solver.setSpongeLayer(parser.value("sponge-width").toInt(), parser.value("sponge-damping").toFloat());
+    if(parser.isSet("heightmap")) {
+        QStringList heightmapSize = parser.value("heightmap-size").split("x");
+        ResampleMethod method = parser.value("resample") == "bilinear" ? ResampleMethod::Bilinear : ResampleMethod::Area;
+        if(!solver.loadHeightmap(parser.value("heightmap"), method,
+                                 parser.value("heightmap-scale").toFloat(), parser.value("heightmap-offset").toFloat(),
+                                 heightmapSize.size() == 2 ? heightmapSize[0].toInt() : 0,
+                                 heightmapSize.size() == 2 ? heightmapSize[1].toInt() : 0)) {
+            return 1;
+        }
+    }
+    if(parser.isSet("restore") && !solver.loadCheckpoint(parser.value("restore"))) {
+        return 1;
+    }
+    if(parser.isSet("checkpoint")) {
+        offscreenWaves.setCheckpoint(parser.value("checkpoint"), parser.value("checkpoint-interval").toInt());
+    }
+    if(parser.isSet("snapshots")) {
+        simulator.setSnapshotOutput(parser.value("snapshots"), parser.value("snapshot-interval").toInt());
+    }
+    if(parser.isSet("gauges") && !simulator.setGaugeOutput(parser.value("gauges"), parser.value("gauge-output"))) {
+        return 1;
+    }
+    if(parser.isSet("rollback") && !simulator.setRollback(parser.value("rollback").toInt(), parser.value("rollback-interval").toInt(),
+                                                          parser.value("max-gradient").toFloat())) {
+        return 1;
+    }
+    offscreenWaves.run(capture, parser.value("frames").toInt(), parser.value("steps-per-frame").toInt());
+    return 0;
+}
+
+// Runs the benchmark, the sweep, the offscreen capture or the interactive view
+int runMode(QCommandLineParser &parser) {
+    if(parser.isSet("benchmark")) {
+        int nx = 512;
+        int ny = 512;
+        if(parser.isSet("grid-size") && !parseGridSize(parser.value("grid-size"), nx, ny)) {
+            return 1;
+        }
+        Benchmark benchmark(nx, ny, parser.value("steps").toInt());
+        return benchmark.run(parser.value("benchmark")) ? 0 : 1;
+    }
+
+    if(parser.isSet("sweep")) {
+        SweepRunner sweep;
+        if(!sweep.load(parser.value("sweep"))) {
+            return 1;
+        }
+        sweep.run();
+        sweep.printResults();
+        if(parser.isSet("sweep-output") && !sweep.saveResults(parser.value("sweep-output"))) {
+            return 1;
+        }
+        return 0;
+    }
+
+    if(parser.isSet("capture")) {
+        return runOffscreenCapture(parser);
+    }
+
+    QQuickView view;
+
+    view.setResizeMode(QQuickView::SizeRootObjectToView);
+    view.setSource(QUrl("qrc:///Waves.qml"));
+    view.show();
+
+    return QApplication::exec();
+}
+
 # if defined (Q_OS_IOS)
 extern "C" int qtmn (int argc, char * argv [])
 #else
@@ -14,13 +161,65 @@ int main (int argc, char * argv [])
 # endif
 {
     qmlRegisterType<Waves>("Waves", 1, 0, "Waves");
+    qmlRegisterUncreatableType<WavesTelemetry>("Waves", 1, 0, "WavesTelemetry", "Read the telemetry property of Waves.");
 
     QApplication app(argc, argv);
-    QQuickView view;
 
-    view.setResizeMode(QQuickView::SizeRootObjectToView);
-    view.setSource(QUrl("qrc:///Waves.qml"));
-    view.show();
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addOption(QCommandLineOption("capture", "Render offscreen and write frames to <directory>.", "directory"));
+    parser.addOption(QCommandLineOption("frames", "Number of frames to capture.", "frames", "100"));
+    parser.addOption(QCommandLineOption("steps-per-frame", "Simulation steps between captured frames.", "steps", "1"));
+    parser.addOption(QCommandLineOption("format", "Frame format, png or raw (RGBA8).", "format", "png"));
+    parser.addOption(QCommandLineOption("size", "Frame size.", "WIDTHxHEIGHT", "1280x720"));
+    parser.addOption(QCommandLineOption("restore", "Start the offscreen run from a checkpoint.", "checkpoint"));
+    parser.addOption(QCommandLineOption("checkpoint", "Periodically save the offscreen run to a checkpoint.", "checkpoint"));
+    parser.addOption(QCommandLineOption("checkpoint-interval", "Frames between checkpoints.", "frames", "100"));
+    parser.addOption(QCommandLineOption("snapshots", "Stream compressed solution snapshots to <file>.", "file"));
+    parser.addOption(QCommandLineOption("snapshot-interval", "Steps between snapshots.", "steps", "10"));
+    parser.addOption(QCommandLineOption("gauges", "Record the wave gauges listed as \"name x y\" lines in <file> every step.", "file"));
+    parser.addOption(QCommandLineOption("gauge-output", "Gauge time series, CSV if the name ends in .csv and binary otherwise.", "file", "gauges.csv"));
+    parser.addOption(QCommandLineOption("rollback", "Keep <states> recent states and roll back with half the time step when the solution blows up.", "states"));
+    parser.addOption(QCommandLineOption("rollback-interval", "Steps between rollback states.", "steps", "50"));
+    parser.addOption(QCommandLineOption("max-gradient", "Largest wave slope before the solution counts as unstable.", "slope", "1000"));
+    parser.addOption(QCommandLineOption("storage", "Solver field storage, float32, float16, int16 or float64.", "storage", "float32"));
+    parser.addOption(QCommandLineOption("layout", "Solver field layout, rowmajor or tiled (64x64 tiles).", "layout", "rowmajor"));
+    parser.addOption(QCommandLineOption("huge-pages", "Back large solver fields with transparent huge pages."));
+    parser.addOption(QCommandLineOption("compute", "Solver arithmetic, float or double.", "precision", "float"));
+    parser.addOption(QCommandLineOption("stencil-order", "Order of the spatial stencil, 2, 4 or 6.", "order", "2"));
+    parser.addOption(QCommandLineOption("integrator", "Time integrator, leapfrog or adi.", "integrator", "leapfrog"));
+    parser.addOption(QCommandLineOption("timestep-scale", "Time step as a multiple of the safe leapfrog step. Above 1.1 needs the ADI integrator.", "scale", "1"));
+    parser.addOption(QCommandLineOption("sponge-width", "Width in cells of the absorbing layer along the domain edges.", "cells", "0"));
+    parser.addOption(QCommandLineOption("sponge-damping", "Damping rate at the outer edge of the absorbing layer.", "rate", "10"));
+    parser.addOption(QCommandLineOption("heightmap", "Load the ground from a raw float32 or PGM heightmap.", "file"));
+    parser.addOption(QCommandLineOption("heightmap-size", "Size of a raw float32 heightmap, required unless it is square.", "WIDTHxHEIGHT"));
+    parser.addOption(QCommandLineOption("heightmap-scale", "Ground height per heightmap unit.", "scale", "1"));
+    parser.addOption(QCommandLineOption("heightmap-offset", "Ground height of heightmap value zero.", "offset", "0"));
+    parser.addOption(QCommandLineOption("resample", "Heightmap resampling, area or bilinear.", "method", "area"));
+    parser.addOption(QCommandLineOption("benchmark", "Run the <name> benchmark (storage, precision, convergence, integrator, ensemble or layout) and exit.", "name"));
+    parser.addOption(QCommandLineOption("grid-size", "Solver grid points along x and y, 512 in the benchmarks and 256 otherwise.", "NxM"));
+    parser.addOption(QCommandLineOption("domain", "Size of the offscreen domain, centered on the origin.", "LXxLY", "10x10"));
+    parser.addOption(QCommandLineOption("steps", "Steps per benchmark run.", "steps", "200"));
+    parser.addOption(QCommandLineOption("sweep", "Run the parameter sweep in the JSON <spec> headless and exit.", "spec"));
+    parser.addOption(QCommandLineOption("sweep-output", "Write the sweep results as CSV to <file>.", "file"));
+    parser.addOption(QCommandLineOption("perf-counters", "Report hardware counters (Linux perf events) next to the timers."));
+    parser.addOption(QCommandLineOption("trace", "Write a timeline of the pipeline and worker threads as Chrome trace JSON to <file>.", "file"));
+    parser.process(app);
+
+    // Before any solver allocates its fields
+    CPField::setHugePages(parser.isSet("huge-pages"));
+
+    if(parser.isSet("perf-counters") && !CPPerfCounters::enable()) {
+        qDebug() << "Warning, running without hardware counters.";
+    }
 
-    return app.exec();
+    if(parser.isSet("trace")) {
+        CPTrace::setThreadName("main");
+        if(!CPTrace::start(parser.value("trace"))) {
+            return 1;
+        }
+    }
+    int result = runMode(parser);
+    CPTrace::stop();
+    return result;
 }
@@ -0,0 +1,96 @@
+#include "offscreenwaves.h"
+#include "cptimer.h"
+#include <QSurfaceFormat>
+#include <QElapsedTimer>
+
+OffscreenWaves::OffscreenWaves(QSize size) :
+    m_size(size),
+    m_fbo(0),
+    m_zoom(-5),
+    m_tilt(30),
+    m_pan(30),
+    m_roll(0),
+    m_checkpointInterval(0)
+{
+    m_renderer.setSimulator(&m_simulator);
+}
+
+OffscreenWaves::~OffscreenWaves()
+{
+    if(m_fbo) {
+        m_context.makeCurrent(&m_surface);
+        delete m_fbo;
+        m_context.doneCurrent();
+    }
+    m_surface.destroy();
+}
+
+Simulator &OffscreenWaves::simulator()
+{
+    return m_simulator;
+}
+
+void OffscreenWaves::setCheckpoint(QString filename, int framesBetweenCheckpoints)
+{
+    m_checkpointFilename = filename;
+    m_checkpointInterval = framesBetweenCheckpoints;
+}
+
+bool OffscreenWaves::initialize()
+{
+    QSurfaceFormat format = QSurfaceFormat::defaultFormat();
+    format.setDepthBufferSize(24);
+
+    m_context.setFormat(format);
+    if(!m_context.create()) {
+        qDebug() << "Warning, could not create OpenGL context for offscreen rendering.";
+        return false;
+    }
+
+    m_surface.setFormat(m_context.format());
+    m_surface.create();
+    if(!m_surface.isValid() || !m_context.makeCurrent(&m_surface)) {
+        qDebug() << "Warning, could not create offscreen surface.";
+        return false;
+    }
+
+    m_fbo = new QOpenGLFramebufferObject(m_size, QOpenGLFramebufferObject::CombinedDepthStencil);
+    m_renderer.setViewportSize(m_size);
+    m_renderer.resetProjection();
+    m_renderer.setModelViewMatrices(m_zoom, m_tilt, m_pan, m_roll);
+    return true;
+}
+
+void OffscreenWaves::run(CPFrameCapture &capture, int frames, int stepsPerFrame)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    for(int frame=0; frame<frames; frame++) {
+        CPTimer::computeTimestep().start();
+        for(int step=0; step<stepsPerFrame; step++) {
+            m_simulator.step(m_simulator.timestep());
+        }
+        CPTimer::computeTimestep().stop();
+        CPTimer::computeTimestep().addCellUpdates(qint64(m_simulator.solver().nx())*m_simulator.solver().ny()*stepsPerFrame);
+
+        m_fbo->bind();
+        m_renderer.paint();
+        capture.capture(m_size);
+        m_fbo->release();
+
+        if(m_checkpointInterval > 0 && (frame + 1) % m_checkpointInterval == 0) {
+            m_simulator.solver().saveCheckpoint(m_checkpointFilename);
+        }
+    }
+
+    capture.finish();
+    double elapsed = timer.elapsed() / 1000.0;
+
+    qDebug() << "Captured " << capture.framesCaptured() << " frames in " << elapsed << " s (" << capture.framesCaptured() / elapsed << " frames/s)";
+    qDebug() << "Computing timesteps: " << CPTimer::computeTimestep().elapsedTime() << " s";
+    qDebug() << "Rendering: " << CPTimer::rendering().elapsedTime() << " s";
+    qDebug() << "Read pixels: " << CPTimer::readPixels().elapsedTime() << " s";
+    CPTimer::reportCounters("Computing timesteps", CPTimer::computeTimestep());
+    CPTimer::reportCounters("Normal vectors", CPTimer::normalVectors());
+}
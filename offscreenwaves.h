@@ -0,0 +1,38 @@
+#ifndef OFFSCREENWAVES_H
+#define OFFSCREENWAVES_H
+#include <QOpenGLContext>
+#include <QOffscreenSurface>
+#include <QOpenGLFramebufferObject>
+#include <QSize>
+
+#include "waves.h"
+#include "cpframecapture.h"
+
+// Headless counterpart of Waves. Renders the simulation into a framebuffer object on an
+// offscreen surface (works with Mesa llvmpipe) and captures every stepsPerFrame'th step.
+class OffscreenWaves
+{
+private:
+    Simulator m_simulator;
+    WavesRenderer m_renderer;
+    QSize m_size;
+    QOpenGLContext m_context;
+    QOffscreenSurface m_surface;
+    QOpenGLFramebufferObject *m_fbo;
+    float m_zoom;
+    float m_tilt;
+    float m_pan;
+    float m_roll;
+    QString m_checkpointFilename;
+    int m_checkpointInterval;
+
+public:
+    OffscreenWaves(QSize size);
+    ~OffscreenWaves();
+    bool initialize();
+    void run(CPFrameCapture &capture, int frames, int stepsPerFrame);
+    Simulator &simulator();
+    void setCheckpoint(QString filename, int framesBetweenCheckpoints);
+};
+
+#endif // OFFSCREENWAVES_H
@@ -93,3 +93,92 @@ double PerlinNoise::grad(int hash, double x, double y, double z) {
            v = h < 4 ? y : h == 12 || h == 14 ? x : z;
     return ((h & 1) == 0 ? u : -u) + ((h & 2) == 0 ? v : -v);
 }
+
+namespace {
+inline float fade2D(float t) {
+    return t * t * t * (t * (t * 6 - 15) + 10);
+}
+
+// Gradients of grad(hash, x, y, 0) in the reference implementation, so the 2D noise is a
+// slice of the 3D noise, without the branches
+const float gradientX[16] = {1, -1, 1, -1, 1, -1, 1, -1, 0, 0, 0, 0, 1, 0, -1, 0};
+const float gradientY[16] = {1, 1, -1, -1, 0, 0, 0, 0, 1, -1, 1, -1, 1, -1, 1, -1};
+
+inline float grad2D(int hash, float x, float y) {
+    int h = hash & 15;
+    return gradientX[h]*x + gradientY[h]*y;
+}
+}
+
+float PerlinNoise::noise(float x, float y) {
+    float value;
+    noiseRow(x, y, 0, 1, &value);
+    return value;
+}
+
+void PerlinNoise::noiseRow(float x, float y0, float dy, int count, float *values) {
+    // The x part is shared by the whole row
+    float xFloor = floor(x);
+    int X = int(xFloor) & 255;
+    float xf = x - xFloor;
+    float u = fade2D(xf);
+    const int *perm = &p[0];
+    int A = perm[X];
+    int B = perm[X + 1];
+
+    const int batchSize = 64;
+    int Y[batchSize];
+    float yf[batchSize];
+    float v[batchSize];
+    float n0[batchSize];
+    float n1[batchSize];
+    for(int start=0; start<count; start+=batchSize) {
+        int n = std::min(batchSize, count - start);
+        // Arithmetic on independent lanes, vectorized by the compiler
+        for(int k=0; k<n; k++) {
+            float y = y0 + (start + k)*dy;
+            float yFloor = floor(y);
+            Y[k] = int(yFloor) & 255;
+            yf[k] = y - yFloor;
+            v[k] = fade2D(yf[k]);
+        }
+        // Permutation lookups and gradients, lerped along x
+        for(int k=0; k<n; k++) {
+            int AA = perm[A + Y[k]];
+            int AB = perm[A + Y[k] + 1];
+            int BA = perm[B + Y[k]];
+            int BB = perm[B + Y[k] + 1];
+            float g00 = grad2D(perm[AA], xf, yf[k]);
+            float g10 = grad2D(perm[BA], xf - 1, yf[k]);
+            float g01 = grad2D(perm[AB], xf, yf[k] - 1);
+            float g11 = grad2D(perm[BB], xf - 1, yf[k] - 1);
+            n0[k] = g00 + u*(g10 - g00);
+            n1[k] = g01 + u*(g11 - g01);
+        }
+        for(int k=0; k<n; k++) {
+            float res = n0[k] + v[k]*(n1[k] - n0[k]);
+            values[start + k] = (res + 1.0f)*0.5f;
+        }
+    }
+}
+
+void PerlinNoise::fbmRow(float x, float y0, float dy, int count, int octaves, float persistence, float lacunarity, float *values) {
+    std::vector<float> octave(count);
+    std::fill(values, values + count, 0.0f);
+    float frequency = 1;
+    float amplitude = 1;
+    float amplitudeSum = 0;
+    for(int k=0; k<octaves; k++) {
+        noiseRow(x*frequency, y0*frequency, dy*frequency, count, &octave[0]);
+        for(int j=0; j<count; j++) {
+            values[j] += amplitude*octave[j];
+        }
+        amplitudeSum += amplitude;
+        frequency *= lacunarity;
+        amplitude *= persistence;
+    }
+    float normalization = 1.0f/amplitudeSum;
+    for(int j=0; j<count; j++) {
+        values[j] *= normalization;
+    }
+}
@@ -19,6 +19,13 @@ public:
     PerlinNoise(unsigned int seed);
     // Get a noise value, for 2D images z can have any value
     double noise(double x, double y, double z);
+    // 2D noise in float, equal to noise(x, y, 0)
+    float noise(float x, float y);
+    // Noise at (x, y0 + k*dy) for k < count. Computed in batches laid out for vectorization.
+    void noiseRow(float x, float y0, float dy, int count, float *values);
+    // Fractal Brownian motion, octaves of noise at frequencies lacunarity^k with amplitudes
+    // persistence^k, normalized to [0, 1]. One octave is the same as noiseRow.
+    void fbmRow(float x, float y0, float dy, int count, int octaves, float persistence, float lacunarity, float *values);
 private:
     double fade(double t);
     double lerp(double t, double a, double b);
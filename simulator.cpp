@@ -1,17 +1,295 @@
 #include "simulator.h"
 #include "cpgrid.h"
+#include <QDebug>
 #include <iostream>
+#include <cmath>
 
 WaveSolver &Simulator::solver()
 {
     return m_solver;
 }
 
-Simulator::Simulator()
+Simulator::Simulator() :
+    m_steps(0),
+    m_snapshotInterval(0),
+    m_timestepScale(1),
+    m_newestRollbackState(0),
+    m_numRollbackStates(0),
+    m_rollbackInterval(0),
+    m_maxGradient(0),
+    m_timestepReduction(1),
+    m_rollbacks(0),
+    m_stableStates(0),
+    m_wasUnstable(false)
 {
 
 }
 
 void Simulator::step(double dt) {
-    m_solver.step(dt);
+    bool rollback = !m_rollbackStates.empty();
+    if(rollback && m_steps % m_rollbackInterval == 0) {
+        if(m_timestepReduction < 1 && m_stableStates >= int(m_rollbackStates.size())) {
+            increaseTimestep(dt);
+        }
+        saveRollbackState(dt*m_timestepReduction);
+    }
+    m_solver.step(dt*m_timestepReduction);
+    m_steps++;
+    // Once rollback has given up, a run that keeps diverging is still reported when it trips and
+    // then once per rollback interval
+    bool unstable = m_maxGradient > 0 && isUnstable();
+    if(unstable && rollback) {
+        rollBack(dt);
+        return;
+    }
+    if(unstable && (!m_wasUnstable || m_steps % m_rollbackInterval == 0)) {
+        reportInstability();
+    }
+    m_wasUnstable = unstable;
+
+    if(m_snapshotWriter && m_steps % m_snapshotInterval == 0) {
+        // Only the copy happens here, quantization, compression and disk I/O run on the writer thread
+        m_solver.copySolution(m_snapshotWriter->beginFrame());
+        m_snapshotWriter->commitFrame(m_steps, m_solver.time());
+    }
+    if(m_gaugeRecorder) {
+        m_gaugeRecorder->sample(m_solver, m_steps, m_solver.time());
+    }
+}
+
+bool Simulator::setSnapshotOutput(QString filename, int stepsBetweenSnapshots)
+{
+    closeSnapshotOutput();
+    if(stepsBetweenSnapshots <= 0) return false;
+
+    m_snapshotWriter = std::make_shared<SnapshotWriter>();
+    if(!m_snapshotWriter->open(filename, m_solver.nx(), m_solver.ny())) {
+        m_snapshotWriter.reset();
+        return false;
+    }
+    m_snapshotInterval = stepsBetweenSnapshots;
+    return true;
+}
+
+void Simulator::closeSnapshotOutput()
+{
+    if(m_snapshotWriter) {
+        m_snapshotWriter->close();
+        m_snapshotWriter.reset();
+    }
+}
+
+bool Simulator::setGaugeOutput(QString gaugeList, QString filename)
+{
+    // Gauges are sampled after every step, files ending in .csv get text and the rest binary
+    closeGaugeOutput();
+    m_gaugeRecorder = std::make_shared<GaugeRecorder>();
+    GaugeFormat format = filename.endsWith(".csv") ? GaugeFormat::CSV : GaugeFormat::Binary;
+    if(!m_gaugeRecorder->loadGauges(m_solver, gaugeList) || !m_gaugeRecorder->open(filename, format)) {
+        m_gaugeRecorder.reset();
+        return false;
+    }
+    return true;
+}
+
+void Simulator::closeGaugeOutput()
+{
+    if(m_gaugeRecorder) {
+        m_gaugeRecorder->close();
+        m_gaugeRecorder.reset();
+    }
+}
+
+bool Simulator::setRollback(int numStates, int stepsBetweenStates, float maxGradient)
+{
+    // The check uses the solver monitors, which the step kernel computes on the fly
+    if(numStates <= 0 || stepsBetweenStates <= 0 || maxGradient <= 0) {
+        qDebug() << "Warning, invalid rollback of " << numStates << " states every " << stepsBetweenStates
+                 << " steps with max gradient " << maxGradient << ".";
+        return false;
+    }
+    m_rollbackStates.assign(numStates, RollbackState());
+    m_newestRollbackState = 0;
+    m_numRollbackStates = 0;
+    m_stableStates = 0;
+    m_rollbackInterval = stepsBetweenStates;
+    m_maxGradient = maxGradient;
+    m_solver.setMonitorsEnabled(true);
+    return true;
+}
+
+bool Simulator::setResolution(int nx, int ny)
+{
+    // Snapshots and gauges were set up for the old grid
+    if(m_snapshotWriter || m_gaugeRecorder) {
+        qDebug() << "Warning, the grid cannot be resized while snapshots or gauges are recorded.";
+        return false;
+    }
+    if(nx < 2 || ny < 2) {
+        qDebug() << "Warning, invalid grid size " << nx << "x" << ny << ".";
+        return false;
+    }
+    if(nx == m_solver.nx() && ny == m_solver.ny()) return true;
+
+    // The CFL step follows the grid spacing, and u_prev is moved to the new step like in a
+    // rollback. The rollback states of the old grid are replaced by the resampled state.
+    double oldTimestep = timestep();
+    m_solver.resample(nx, ny);
+    SolverState state;
+    m_solver.saveState(state);
+    m_solver.restoreState(state, timestep()/oldTimestep);
+    if(!m_rollbackStates.empty()) {
+        m_numRollbackStates = 0;
+        m_stableStates = 0;
+        saveRollbackState(timestep()*m_timestepReduction);
+    }
+    return true;
+}
+
+int Simulator::rollbacks() const
+{
+    return m_rollbacks;
+}
+
+double Simulator::timestepReduction() const
+{
+    return m_timestepReduction;
+}
+
+bool Simulator::isUnstable() const
+{
+    const SolverMonitors &monitors = m_solver.monitors();
+    return !std::isfinite(monitors.totalEnergy) || monitors.maxGradient > m_maxGradient;
+}
+
+void Simulator::saveRollbackState(double dt)
+{
+    // Overwrites the oldest state, the vectors keep their storage
+    int numStates = m_rollbackStates.size();
+    m_newestRollbackState = (m_newestRollbackState + 1) % numStates;
+    m_numRollbackStates = std::min(m_numRollbackStates + 1, numStates);
+    RollbackState &rollbackState = m_rollbackStates[m_newestRollbackState];
+    m_solver.saveState(rollbackState.state);
+    rollbackState.step = m_steps;
+    rollbackState.timestep = dt;
+    m_stableStates++;
+
+    // A rollback goes back to the oldest state at most, the gauge samples before it are final
+    if(m_gaugeRecorder) {
+        int oldest = (m_newestRollbackState - m_numRollbackStates + 1 + numStates) % numStates;
+        m_gaugeRecorder->setRewindStep(m_rollbackStates[oldest].step);
+    }
+}
+
+void Simulator::reportInstability()
+{
+    const SolverMonitors &monitors = m_solver.monitors();
+    qDebug() << "Warning, the solution is unstable at step " << m_steps << ", t = " << monitors.time
+             << ", with max gradient " << monitors.maxGradient << " and energy " << monitors.totalEnergy << ".";
+}
+
+void Simulator::increaseTimestep(double dt)
+{
+    // A full ring of states was saved without a trip, so the reduced step is undone one doubling
+    // at a time. u_prev is moved to the new step like in a rollback, through the slot the next
+    // state is saved in.
+    int numStates = m_rollbackStates.size();
+    SolverState &state = m_rollbackStates[(m_newestRollbackState + 1) % numStates].state;
+    m_solver.saveState(state);
+    m_solver.restoreState(state, 2);
+    m_timestepReduction = std::min(1.0, 2*m_timestepReduction);
+    m_stableStates = 0;
+    qDebug() << "Stable for " << numStates*m_rollbackInterval << " steps, increased the time step at step " << m_steps
+             << " to " << dt*m_timestepReduction << " (" << m_timestepReduction << " of the requested step).";
+}
+
+void Simulator::rollBack(double dt)
+{
+    // Goes back to the oldest state, the newer ones may already hold the growing mode, and
+    // retries with half the time step. The states are taken again with the new step.
+    reportInstability();
+    m_wasUnstable = true;
+    const double minTimestepReduction = 1.0/16;
+    if(m_numRollbackStates == 0 || m_timestepReduction/2 < minTimestepReduction) {
+        qDebug() << "Warning, could not recover with the time step reduced to " << m_timestepReduction
+                 << " of the requested step, rollback is disabled.";
+        m_rollbackStates.clear();
+        return;
+    }
+
+    int numStates = m_rollbackStates.size();
+    int oldest = (m_newestRollbackState - m_numRollbackStates + 1 + numStates) % numStates;
+    const RollbackState &rollbackState = m_rollbackStates[oldest];
+    m_timestepReduction /= 2;
+    m_solver.restoreState(rollbackState.state, dt*m_timestepReduction/rollbackState.timestep);
+    m_steps = rollbackState.step;
+    m_numRollbackStates = 0;
+    m_stableStates = 0;
+    m_rollbacks++;
+
+    // The discarded steps are taken out of the output, the repeated ones are written in their place
+    if(m_snapshotWriter) m_snapshotWriter->rewind(m_steps);
+    if(m_gaugeRecorder) m_gaugeRecorder->rewind(m_steps);
+    qDebug() << "Rolled back to step " << m_steps << ", t = " << m_solver.time() << ", and reduced the time step to "
+             << dt*m_timestepReduction << " (" << m_timestepReduction << " of the requested step).";
+}
+
+int Simulator::steps() const
+{
+    return m_steps;
+}
+
+double Simulator::time() const
+{
+    return m_solver.time();
+}
+
+double Simulator::safeTimestep() {
+    double c_max = 1.0;       			// Used to determine dt and Nt
+    double dx = m_solver.dx();
+    double dy = m_solver.dy();
+    return 0.9*m_solver.stencilStabilityLimit()/sqrt(c_max*(1/(dx*dx) + 1/(dy*dy))); 	// CFL limit, equal to 0.9*dr/sqrt(2*c_max) when dx = dy and second order
+}
+
+double Simulator::timestep()
+{
+    // The ADI integrator is stable for any scale, the leapfrog one up to 1/0.9
+    return m_timestepScale*safeTimestep();
+}
+
+double Simulator::timestepScale() const
+{
+    return m_timestepScale;
+}
+
+bool Simulator::setTimestepScale(double scale)
+{
+    if(scale <= 0) {
+        qDebug() << "Warning, invalid time step scale " << scale << ".";
+        return false;
+    }
+    m_timestepScale = scale;
+    return true;
+}
+
+bool Simulator::isTimestepStable()
+{
+    return m_solver.timeIntegrator() == TimeIntegrator::ADI || 0.9*m_timestepScale <= 1;
+}
+
+void Simulator::reportTimestep()
+{
+    double dt = timestep();
+    QString integrator = m_solver.timeIntegrator() == TimeIntegrator::ADI ? "ADI" : "leapfrog";
+    qDebug() << integrator << " time step " << dt << ", Courant number " << 0.9*m_timestepScale
+             << " (the leapfrog step is stable up to 1)";
+    if(!isTimestepStable()) {
+        qDebug() << "Warning, the leapfrog integrator is unstable beyond its limit, use ADI for longer steps.";
+        return;
+    }
+    // The phase error grows with the time step and is largest for the short waves
+    for(double pointsPerWavelength : {10.0, 20.0, 40.0}) {
+        qDebug() << "Phase speed error at " << pointsPerWavelength << " points per wavelength: "
+                 << 100*m_solver.phaseSpeedError(dt, pointsPerWavelength) << "%";
+    }
 }
@@ -1,14 +1,65 @@
 #ifndef SIMULATOR_H
 #define SIMULATOR_H
 #include "wavesolver.h"
+#include "snapshotstream.h"
+#include "gaugerecorder.h"
+#include <memory>
+
+// Solver state kept for rolling back, with the step it was saved at and the time step it was
+// saved with
+class RollbackState
+{
+public:
+    SolverState state;
+    int step;
+    double timestep;
+};
 
 class Simulator
 {
 private:
     WaveSolver m_solver;
+    int m_steps;
+    int m_snapshotInterval;
+    double m_timestepScale;
+    std::shared_ptr<SnapshotWriter> m_snapshotWriter;
+    std::shared_ptr<GaugeRecorder> m_gaugeRecorder;
+
+    // Ring of recent states for rolling back an unstable run, the newest is at m_newestRollbackState
+    std::vector<RollbackState> m_rollbackStates;
+    int m_newestRollbackState;
+    int m_numRollbackStates;
+    int m_rollbackInterval;
+    float m_maxGradient;
+    double m_timestepReduction;
+    int m_rollbacks;
+    int m_stableStates;
+    bool m_wasUnstable;
+
+    bool isUnstable() const;
+    void reportInstability();
+    void saveRollbackState(double dt);
+    void increaseTimestep(double dt);
+    void rollBack(double dt);
 public:
     Simulator();
     void step(double dt);
+    double safeTimestep();
+    double timestep();
+    double timestepScale() const;
+    bool setTimestepScale(double scale);
+    bool isTimestepStable();
+    void reportTimestep();
+    bool setSnapshotOutput(QString filename, int stepsBetweenSnapshots);
+    void closeSnapshotOutput();
+    bool setGaugeOutput(QString gaugeList, QString filename);
+    void closeGaugeOutput();
+    bool setResolution(int nx, int ny);
+    bool setRollback(int numStates, int stepsBetweenStates, float maxGradient);
+    int rollbacks() const;
+    double timestepReduction() const;
+    int steps() const;
+    double time() const;
     WaveSolver &solver();
 };
 
@@ -0,0 +1,558 @@
+#include "snapshotstream.h"
+#include <QDebug>
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+namespace {
+const char snapshotMagic[8] = {'W','A','V','E','S','N','A','P'};
+const char snapshotIndexMagic[8] = {'W','A','V','E','I','N','D','X'};
+const char snapshotFrameMagic[4] = {'F','R','M','E'};
+const quint32 snapshotVersion = 2;
+
+struct SnapshotFileHeader {
+    char    magic[8];
+    quint32 version;
+    quint32 headerSize;
+    qint32  gridSize; // nx
+    float   quantum;
+    qint32  keyframeInterval;
+    qint32  ny;       // Reserved in version 1, where frames are square
+};
+
+struct SnapshotFrameHeader {
+    char    magic[4];
+    qint32  step;
+    float   time;
+    quint32 compressedSize;
+    quint32 isKeyframe;
+};
+
+struct SnapshotFooter {
+    qint64  indexOffset;
+    quint32 numFrames;
+    quint32 reserved;
+    char    magic[8];
+};
+
+// LZ77 codec in the spirit of LZ4. A sequence is a token byte (literal length in the high
+// nibble, match length - 4 in the low nibble, 15 meaning more length bytes follow), the
+// literals, and a 16-bit little-endian match offset. The last sequence has literals only.
+const int minMatch = 4;
+const int hashBits = 14;
+
+inline quint32 read32(const unsigned char *p) {
+    quint32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+inline int hashSequence(quint32 sequence) {
+    return (sequence * 2654435761u) >> (32 - hashBits);
+}
+
+void writeLength(std::vector<unsigned char> &out, int length) {
+    while(length >= 255) {
+        out.push_back(255);
+        length -= 255;
+    }
+    out.push_back(length);
+}
+
+void writeSequence(std::vector<unsigned char> &out, const unsigned char *literals, int literalLength, int offset, int matchLength) {
+    int matchCode = offset ? matchLength - minMatch : 0;
+    out.push_back((std::min(literalLength, 15) << 4) | std::min(matchCode, 15));
+    if(literalLength >= 15) writeLength(out, literalLength - 15);
+    out.insert(out.end(), literals, literals + literalLength);
+    if(offset) {
+        out.push_back(offset & 0xff);
+        out.push_back(offset >> 8);
+        if(matchCode >= 15) writeLength(out, matchCode - 15);
+    }
+}
+
+void compress(const unsigned char *in, int size, std::vector<unsigned char> &out) {
+    static thread_local std::vector<int> table;
+    table.assign(1 << hashBits, -1);
+    out.clear();
+
+    int anchor = 0;
+    int position = 0;
+    while(position + minMatch <= size) {
+        quint32 sequence = read32(in + position);
+        int hash = hashSequence(sequence);
+        int candidate = table[hash];
+        table[hash] = position;
+
+        if(candidate >= 0 && position - candidate <= 65535 && read32(in + candidate) == sequence) {
+            int matchLength = minMatch;
+            while(position + matchLength < size && in[candidate + matchLength] == in[position + matchLength]) {
+                matchLength++;
+            }
+            writeSequence(out, in + anchor, position - anchor, position - candidate, matchLength);
+            position += matchLength;
+            anchor = position;
+        } else {
+            position++;
+        }
+    }
+    writeSequence(out, in + anchor, size - anchor, 0, 0);
+}
+
+bool readLength(const unsigned char *in, int size, int &position, int &length) {
+    unsigned char byte;
+    do {
+        if(position >= size) return false;
+        byte = in[position++];
+        length += byte;
+    } while(byte == 255);
+    return true;
+}
+
+bool decompress(const unsigned char *in, int size, unsigned char *out, int outSize) {
+    int position = 0;
+    int outPosition = 0;
+    while(position < size) {
+        unsigned char token = in[position++];
+        int literalLength = token >> 4;
+        if(literalLength == 15 && !readLength(in, size, position, literalLength)) return false;
+        if(position + literalLength > size || outPosition + literalLength > outSize) return false;
+        memcpy(out + outPosition, in + position, literalLength);
+        position += literalLength;
+        outPosition += literalLength;
+
+        if(position == size) break; // Last sequence
+
+        if(position + 2 > size) return false;
+        int offset = in[position] | (in[position+1] << 8);
+        position += 2;
+        int matchLength = token & 15;
+        if(matchLength == 15 && !readLength(in, size, position, matchLength)) return false;
+        matchLength += minMatch;
+        if(offset == 0 || offset > outPosition || outPosition + matchLength > outSize) return false;
+
+        // Byte by byte since the match may overlap the bytes being written
+        const unsigned char *match = out + outPosition - offset;
+        for(int k=0; k<matchLength; k++) {
+            out[outPosition + k] = match[k];
+        }
+        outPosition += matchLength;
+    }
+    return outPosition == outSize;
+}
+
+// Low bytes of all values first, then the high bytes. The high bytes of small deltas are
+// mostly 0x00 or 0xff, which gives the codec long runs to work with.
+void shuffle(const qint16 *values, int count, unsigned char *out) {
+    for(int k=0; k<count; k++) {
+        quint16 value = values[k];
+        out[k] = value & 0xff;
+        out[count + k] = value >> 8;
+    }
+}
+}
+
+SnapshotWriter::SnapshotWriter() :
+    m_file(0),
+    m_nx(0),
+    m_ny(0),
+    m_quantum(1e-3),
+    m_keyframeInterval(32),
+    m_maxQueuedFrames(8),
+    m_framesQueued(0),
+    m_stopWriter(false)
+{
+
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    close();
+}
+
+bool SnapshotWriter::open(QString filename, int nx, int ny, float quantum, int keyframeInterval, int maxQueuedFrames)
+{
+    close();
+
+    m_file = new QFile(filename);
+    if(!m_file->open(QFile::WriteOnly | QFile::Truncate)) {
+        qDebug() << "Warning, could not open snapshot file " << filename << ": " << m_file->errorString();
+        delete m_file;
+        m_file = 0;
+        return false;
+    }
+
+    m_nx = nx;
+    m_ny = ny;
+    m_quantum = quantum;
+    m_keyframeInterval = std::max(keyframeInterval, 1);
+    m_maxQueuedFrames = std::max(maxQueuedFrames, 1);
+    m_framesQueued = 0;
+    m_index.clear();
+
+    SnapshotFileHeader header;
+    memcpy(header.magic, snapshotMagic, sizeof(header.magic));
+    header.version = snapshotVersion;
+    header.headerSize = sizeof(SnapshotFileHeader);
+    header.gridSize = nx;
+    header.quantum = quantum;
+    header.keyframeInterval = m_keyframeInterval;
+    header.ny = ny;
+    m_file->write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    int numValues = nx*ny;
+    m_previousQuantized.assign(numValues, 0);
+    m_quantized.resize(numValues);
+    m_delta.resize(numValues);
+    m_shuffled.resize(2*numValues);
+    m_currentFrame.values.resize(numValues);
+
+    m_stopWriter = false;
+    m_writerThread = std::thread(&SnapshotWriter::writeFrames, this);
+    return true;
+}
+
+bool SnapshotWriter::isOpen() const
+{
+    return m_file != 0;
+}
+
+int SnapshotWriter::framesQueued() const
+{
+    return m_framesQueued;
+}
+
+float *SnapshotWriter::beginFrame()
+{
+    return &m_currentFrame.values[0];
+}
+
+void SnapshotWriter::commitFrame(int step, float time)
+{
+    m_currentFrame.step = step;
+    m_currentFrame.time = time;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // Bounded, so a slow disk throttles the simulation instead of exhausting memory
+    m_queueChanged.wait(lock, [&]() { return m_queue.size() < m_maxQueuedFrames; });
+    m_queue.push_back(std::move(m_currentFrame));
+
+    // Reuse the buffer of a frame that has already been written
+    if(!m_freeFrames.empty()) {
+        m_currentFrame = std::move(m_freeFrames.back());
+        m_freeFrames.pop_back();
+    } else {
+        m_currentFrame = Frame();
+        m_currentFrame.values.resize(m_nx*m_ny);
+    }
+    lock.unlock();
+    m_queueChanged.notify_all();
+    m_framesQueued++;
+}
+
+void SnapshotWriter::rewind(int step)
+{
+    // Frames after step that are still queued are dropped here, the ones already written are
+    // cut from the file by the writer thread, in order with the frames committed before
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for(std::deque<Frame>::iterator frame=m_queue.begin(); frame!=m_queue.end(); ) {
+        if(!frame->rewind && frame->step > step) {
+            m_freeFrames.push_back(std::move(*frame));
+            frame = m_queue.erase(frame);
+        } else {
+            ++frame;
+        }
+    }
+    Frame rewindFrame;
+    rewindFrame.step = step;
+    rewindFrame.rewind = true;
+    m_queue.push_back(std::move(rewindFrame));
+    lock.unlock();
+    m_queueChanged.notify_all();
+}
+
+void SnapshotWriter::close()
+{
+    if(!m_file) return;
+
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stopWriter = true;
+    }
+    m_queueChanged.notify_all();
+    m_writerThread.join();
+
+    SnapshotFooter footer;
+    footer.indexOffset = m_file->pos();
+    footer.numFrames = m_index.size();
+    footer.reserved = 0;
+    memcpy(footer.magic, snapshotIndexMagic, sizeof(footer.magic));
+    if(!m_index.empty()) {
+        m_file->write(reinterpret_cast<const char*>(&m_index[0]), m_index.size()*sizeof(SnapshotIndexEntry));
+    }
+    m_file->write(reinterpret_cast<const char*>(&footer), sizeof(footer));
+    m_file->close();
+
+    delete m_file;
+    m_file = 0;
+    m_freeFrames.clear();
+}
+
+void SnapshotWriter::writeFrames()
+{
+    int framesWritten = 0;
+    while(true) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_queueChanged.wait(lock, [&]() { return m_stopWriter || !m_queue.empty(); });
+        if(m_queue.empty()) {
+            break;
+        }
+        Frame frame = std::move(m_queue.front());
+        m_queue.pop_front();
+        lock.unlock();
+        m_queueChanged.notify_all();
+
+        if(frame.rewind) {
+            // The frame after a cut has no previous frame to take a delta against
+            if(truncate(frame.step)) framesWritten = 0;
+            continue;
+        }
+        writeFrame(frame, framesWritten % m_keyframeInterval == 0);
+        framesWritten++;
+
+        lock.lock();
+        m_freeFrames.push_back(std::move(frame));
+    }
+}
+
+void SnapshotWriter::writeFrame(Frame &frame, bool isKeyframe)
+{
+    int numValues = frame.values.size();
+    float inverseQuantum = 1.0/m_quantum;
+
+    // The deltas are taken modulo 2^16 so that they are lossless for any pair of int16 values
+    for(int k=0; k<numValues; k++) {
+        m_quantized[k] = std::max(-32768.0f, std::min(32767.0f, std::round(frame.values[k]*inverseQuantum)));
+    }
+    for(int k=0; k<numValues; k++) {
+        qint16 reference = isKeyframe ? (k > 0 ? m_quantized[k-1] : 0) : m_previousQuantized[k];
+        m_delta[k] = qint16(quint16(m_quantized[k]) - quint16(reference));
+    }
+    m_previousQuantized.swap(m_quantized);
+    shuffle(&m_delta[0], numValues, &m_shuffled[0]);
+    compress(&m_shuffled[0], m_shuffled.size(), m_compressed);
+
+    SnapshotIndexEntry entry;
+    entry.offset = m_file->pos();
+    entry.step = frame.step;
+    entry.time = frame.time;
+    entry.compressedSize = m_compressed.size();
+    entry.isKeyframe = isKeyframe;
+    m_index.push_back(entry);
+
+    SnapshotFrameHeader header;
+    memcpy(header.magic, snapshotFrameMagic, sizeof(header.magic));
+    header.step = frame.step;
+    header.time = frame.time;
+    header.compressedSize = m_compressed.size();
+    header.isKeyframe = isKeyframe;
+    m_file->write(reinterpret_cast<const char*>(&header), sizeof(header));
+    m_file->write(reinterpret_cast<const char*>(&m_compressed[0]), m_compressed.size());
+}
+
+bool SnapshotWriter::truncate(int step)
+{
+    // Cuts the file at the first frame after step
+    size_t first = m_index.size();
+    while(first > 0 && m_index[first-1].step > step) first--;
+    if(first == m_index.size()) return false;
+    qint64 offset = m_index[first].offset;
+    m_index.resize(first);
+    m_file->flush();
+    if(!m_file->resize(offset) || !m_file->seek(offset)) {
+        qDebug() << "Warning, could not remove the rolled back snapshots from " << m_file->fileName()
+                 << ": " << m_file->errorString();
+    }
+    return true;
+}
+
+SnapshotReader::SnapshotReader() :
+    m_file(0),
+    m_data(0),
+    m_nx(0),
+    m_ny(0),
+    m_quantum(0),
+    m_decodedFrame(-1)
+{
+
+}
+
+SnapshotReader::~SnapshotReader()
+{
+    close();
+}
+
+bool SnapshotReader::open(QString filename)
+{
+    close();
+    m_file = new QFile(filename);
+    if(!m_file->open(QFile::ReadOnly) || m_file->size() < qint64(sizeof(SnapshotFileHeader))
+            || !(m_data = m_file->map(0, m_file->size()))) {
+        qDebug() << "Warning, could not open snapshot file " << filename;
+        close();
+        return false;
+    }
+
+    SnapshotFileHeader header;
+    memcpy(&header, m_data, sizeof(header));
+    if(header.version == 1) {
+        header.ny = header.gridSize;
+    }
+    if(memcmp(header.magic, snapshotMagic, sizeof(header.magic)) || header.version < 1 || header.version > snapshotVersion
+            || header.gridSize < 1 || header.ny < 1) {
+        qDebug() << "Warning, " << filename << " is not a version " << snapshotVersion << " snapshot file.";
+        close();
+        return false;
+    }
+    m_nx = header.gridSize;
+    m_ny = header.ny;
+    m_quantum = header.quantum;
+
+    int numValues = m_nx*m_ny;
+    m_quantized.assign(numValues, 0);
+    m_shuffled.resize(2*numValues);
+    m_decodedFrame = -1;
+
+    return buildIndex(header.headerSize);
+}
+
+bool SnapshotReader::buildIndex(qint64 dataOffset)
+{
+    m_index.clear();
+    qint64 fileSize = m_file->size();
+
+    SnapshotFooter footer;
+    if(fileSize >= dataOffset + qint64(sizeof(footer))) {
+        memcpy(&footer, m_data + fileSize - sizeof(footer), sizeof(footer));
+        qint64 indexSize = qint64(footer.numFrames)*sizeof(SnapshotIndexEntry);
+        if(!memcmp(footer.magic, snapshotIndexMagic, sizeof(footer.magic))
+                && footer.indexOffset >= dataOffset && footer.indexOffset + indexSize + qint64(sizeof(footer)) == fileSize) {
+            m_index.resize(footer.numFrames);
+            if(footer.numFrames > 0) memcpy(&m_index[0], m_data + footer.indexOffset, indexSize);
+            // Every frame has to lie between the file header and the index, decodeFrame reads
+            // the mapping without further checks
+            bool isValid = true;
+            for(const SnapshotIndexEntry &entry : m_index) {
+                if(entry.offset < dataOffset
+                        || entry.offset + qint64(sizeof(SnapshotFrameHeader)) + entry.compressedSize > footer.indexOffset) {
+                    isValid = false;
+                    break;
+                }
+            }
+            if(isValid) return true;
+            qDebug() << "Warning, snapshot frame index is corrupt.";
+            m_index.clear();
+        }
+    }
+
+    // No usable index, the writer did not finish. Recover the frames by walking the frame
+    // headers.
+    qDebug() << "Snapshot file has no frame index, scanning frames.";
+    qint64 offset = dataOffset;
+    SnapshotFrameHeader header;
+    while(offset + qint64(sizeof(header)) <= fileSize) {
+        memcpy(&header, m_data + offset, sizeof(header));
+        if(memcmp(header.magic, snapshotFrameMagic, sizeof(header.magic))
+                || offset + qint64(sizeof(header)) + header.compressedSize > fileSize) {
+            break;
+        }
+        SnapshotIndexEntry entry;
+        entry.offset = offset;
+        entry.step = header.step;
+        entry.time = header.time;
+        entry.compressedSize = header.compressedSize;
+        entry.isKeyframe = header.isKeyframe;
+        m_index.push_back(entry);
+        offset += sizeof(header) + header.compressedSize;
+    }
+    return true;
+}
+
+void SnapshotReader::close()
+{
+    if(m_file) {
+        if(m_data) m_file->unmap(m_data);
+        m_file->close();
+        delete m_file;
+    }
+    m_file = 0;
+    m_data = 0;
+    m_index.clear();
+    m_decodedFrame = -1;
+}
+
+int SnapshotReader::numFrames() const
+{
+    return m_index.size();
+}
+
+int SnapshotReader::nx() const
+{
+    return m_nx;
+}
+
+int SnapshotReader::ny() const
+{
+    return m_ny;
+}
+
+int SnapshotReader::frameStep(int frame) const
+{
+    return m_index[frame].step;
+}
+
+float SnapshotReader::frameTime(int frame) const
+{
+    return m_index[frame].time;
+}
+
+bool SnapshotReader::decodeFrame(int frame)
+{
+    const SnapshotIndexEntry &entry = m_index[frame];
+    int numValues = m_quantized.size();
+    const unsigned char *compressed = m_data + entry.offset + sizeof(SnapshotFrameHeader);
+    if(!decompress(compressed, entry.compressedSize, &m_shuffled[0], m_shuffled.size())) {
+        qDebug() << "Warning, snapshot frame " << frame << " is corrupt.";
+        m_decodedFrame = -1;
+        return false;
+    }
+
+    for(int k=0; k<numValues; k++) {
+        quint16 delta = m_shuffled[k] | (m_shuffled[numValues + k] << 8);
+        quint16 reference = entry.isKeyframe ? (k > 0 ? quint16(m_quantized[k-1]) : 0) : quint16(m_quantized[k]);
+        m_quantized[k] = qint16(quint16(reference + delta));
+    }
+    m_decodedFrame = frame;
+    return true;
+}
+
+bool SnapshotReader::readFrame(int frame, std::vector<float> &values)
+{
+    if(frame < 0 || frame >= numFrames()) return false;
+
+    int keyframe = frame;
+    while(keyframe > 0 && !m_index[keyframe].isKeyframe) keyframe--;
+
+    // Continue from the frame decoded last time if it lies between the keyframe and the frame
+    int first = (m_decodedFrame >= keyframe && m_decodedFrame <= frame) ? m_decodedFrame + 1 : keyframe;
+    if(m_decodedFrame == frame) first = frame + 1;
+    for(int k=first; k<=frame; k++) {
+        if(!decodeFrame(k)) return false;
+    }
+
+    values.resize(m_quantized.size());
+    for(unsigned int k=0; k<values.size(); k++) {
+        values[k] = m_quantized[k]*m_quantum;
+    }
+    return true;
+}
@@ -0,0 +1,110 @@
+#ifndef SNAPSHOTSTREAM_H
+#define SNAPSHOTSTREAM_H
+#include <QString>
+#include <QFile>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Time series of solution snapshots. Every frame is quantized to int16 in units of quantum and
+// stored as a delta against the previous frame (keyframes use a delta along the row instead),
+// byte shuffled and compressed with a small LZ77 codec. A frame index at the end of the file
+// gives random access; decoding a frame starts at the closest preceding keyframe.
+
+class SnapshotIndexEntry
+{
+public:
+    qint64 offset;
+    qint32 step;
+    float  time;
+    quint32 compressedSize;
+    quint32 isKeyframe;
+};
+
+class SnapshotWriter
+{
+private:
+    // A frame with rewind set carries no values and removes the frames after its step
+    class Frame {
+    public:
+        Frame() : step(0), time(0), rewind(false) { }
+        int step;
+        float time;
+        bool rewind;
+        std::vector<float> values;
+    };
+
+    QFile *m_file;
+    int m_nx;
+    int m_ny;
+    float m_quantum;
+    int m_keyframeInterval;
+    unsigned int m_maxQueuedFrames;
+    int m_framesQueued;
+    std::vector<SnapshotIndexEntry> m_index;
+
+    // Encoder state, only touched by the writer thread
+    std::vector<qint16> m_previousQuantized;
+    std::vector<qint16> m_quantized;
+    std::vector<qint16> m_delta;
+    std::vector<unsigned char> m_shuffled;
+    std::vector<unsigned char> m_compressed;
+
+    std::thread m_writerThread;
+    std::mutex m_mutex;
+    std::condition_variable m_queueChanged;
+    std::deque<Frame> m_queue;
+    std::vector<Frame> m_freeFrames;
+    Frame m_currentFrame;
+    bool m_stopWriter;
+
+    void writeFrames();
+    void writeFrame(Frame &frame, bool isKeyframe);
+    bool truncate(int step);
+
+public:
+    SnapshotWriter();
+    ~SnapshotWriter();
+    bool open(QString filename, int nx, int ny, float quantum = 1e-3, int keyframeInterval = 32, int maxQueuedFrames = 8);
+    bool isOpen() const;
+    float *beginFrame();
+    void commitFrame(int step, float time);
+    void rewind(int step);
+    void close();
+    int framesQueued() const;
+};
+
+class SnapshotReader
+{
+private:
+    QFile *m_file;
+    uchar *m_data;
+    int m_nx;
+    int m_ny;
+    float m_quantum;
+    std::vector<SnapshotIndexEntry> m_index;
+
+    // The last decoded frame, so reading frames in order only decodes one delta each
+    int m_decodedFrame;
+    std::vector<qint16> m_quantized;
+    std::vector<unsigned char> m_shuffled;
+
+    bool buildIndex(qint64 dataOffset);
+    bool decodeFrame(int frame);
+
+public:
+    SnapshotReader();
+    ~SnapshotReader();
+    bool open(QString filename);
+    void close();
+    int numFrames() const;
+    int nx() const;
+    int ny() const;
+    int frameStep(int frame) const;
+    float frameTime(int frame) const;
+    bool readFrame(int frame, std::vector<float> &values);
+};
+
+#endif // SNAPSHOTSTREAM_H
@@ -0,0 +1,292 @@
+#include "sweeprunner.h"
+#include "simulator.h"
+#include "cpthreadpool.h"
+#include <QElapsedTimer>
+#include <QDebug>
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonArray>
+#include <algorithm>
+#include <numeric>
+
+namespace {
+// A missing key gives the default, a single value is a list of one
+QJsonArray listValue(const QJsonObject &spec, QString key, QJsonValue defaultValue)
+{
+    QJsonValue value = spec.contains(key) ? spec.value(key) : defaultValue;
+    if(value.isArray()) return value.toArray();
+    QJsonArray list;
+    list.append(value);
+    return list;
+}
+
+// N or "NxM"
+bool parseGridSize(QJsonValue value, int &nx, int &ny)
+{
+    if(value.isDouble()) {
+        nx = ny = value.toInt();
+    } else {
+        QStringList size = value.toString().split("x");
+        nx = size.size() == 2 ? size[0].toInt() : 0;
+        ny = size.size() == 2 ? size[1].toInt() : 0;
+    }
+    if(nx < 2 || ny < 2) {
+        qDebug() << "Warning, invalid grid size in sweep spec, expected N or \"NxM\".";
+        return false;
+    }
+    return true;
+}
+
+// "type" or {"type": "perlin", "seed": 3}
+bool parseGround(QJsonValue value, GroundType &type, unsigned int &seed)
+{
+    QJsonObject ground = value.toObject();
+    QString name = value.isString() ? value.toString() : ground.value("type").toString();
+    seed = ground.value("seed").toInt(15);
+    return SweepRunner::parseGroundType(name, type);
+}
+
+// {"shape": "point", "x": 0, "y": 0, "signal": "sinusoid", "amplitude": 1, "frequency": 1},
+// lines and areas take x0, y0, x1, y1 and pulses start and duration
+bool parseSource(QJsonObject object, WaveSource &source)
+{
+    QString shape = object.value("shape").toString("point");
+    float x0 = object.value("x0").toDouble();
+    float y0 = object.value("y0").toDouble();
+    float x1 = object.value("x1").toDouble();
+    float y1 = object.value("y1").toDouble();
+    if(shape == "point") source = WaveSource::point(object.value("x").toDouble(), object.value("y").toDouble());
+    else if(shape == "line") source = WaveSource::line(x0, y0, x1, y1);
+    else if(shape == "area") source = WaveSource::area(x0, y0, x1, y1);
+    else {
+        qDebug() << "Warning, unknown source shape " << shape << ", expected point, line or area.";
+        return false;
+    }
+
+    QString signal = object.value("signal").toString("sinusoid");
+    float amplitude = object.value("amplitude").toDouble(1);
+    if(signal == "sinusoid") {
+        source.setSinusoid(amplitude, object.value("frequency").toDouble(1), object.value("phase").toDouble(0));
+    } else if(signal == "pulse") {
+        source.setPulse(amplitude, object.value("start").toDouble(0), object.value("duration").toDouble(1));
+    } else {
+        qDebug() << "Warning, unknown source signal " << signal << ", expected sinusoid or pulse.";
+        return false;
+    }
+    return true;
+}
+}
+
+SweepRunner::SweepRunner() :
+    m_elapsed(0)
+{
+
+}
+
+bool SweepRunner::parseGroundType(QString name, GroundType &type)
+{
+    if(name == "slope") type = GroundType::Slope;
+    else if(name == "perlin") type = GroundType::PerlinNoise;
+    else if(name == "doubleslit") type = GroundType::DoubleSlit;
+    else if(name == "channel") type = GroundType::Channel;
+    else {
+        qDebug() << "Warning, unknown ground " << name << ", expected slope, perlin, doubleslit or channel.";
+        return false;
+    }
+    return true;
+}
+
+QString SweepRunner::groundTypeName(GroundType type)
+{
+    switch(type) {
+    case GroundType::Slope: return "slope";
+    case GroundType::PerlinNoise: return "perlin";
+    case GroundType::Channel: return "channel";
+    default: return "doubleslit";
+    }
+}
+
+bool SweepRunner::load(QString filename)
+{
+    // The sweep is the product of the lists gridSizes, grounds, dampings, sources and steps.
+    // Every entry of sources is a list of sources, use [] for none.
+    QFile file(filename);
+    if(!file.open(QFile::ReadOnly)) {
+        qDebug() << "Warning, could not open sweep spec " << filename << ": " << file.errorString();
+        return false;
+    }
+    QJsonParseError error;
+    QJsonDocument document = QJsonDocument::fromJson(file.readAll(), &error);
+    if(error.error != QJsonParseError::NoError || !document.isObject()) {
+        qDebug() << "Warning, could not parse sweep spec " << filename << ": " << error.errorString();
+        return false;
+    }
+    QJsonObject spec = document.object();
+    QJsonArray gridSizes = listValue(spec, "gridSizes", 256);
+    QJsonArray grounds = listValue(spec, "grounds", "doubleslit");
+    QJsonArray dampings = listValue(spec, "dampings", 0);
+    QJsonArray sourceSets = spec.contains("sources") ? spec.value("sources").toArray() : QJsonArray();
+    if(sourceSets.isEmpty()) sourceSets.append(QJsonArray());
+    QJsonArray steps = listValue(spec, "steps", 200);
+
+    std::vector<std::vector<WaveSource>> sources;
+    for(const QJsonValue &sourceSet : sourceSets) {
+        sources.push_back(std::vector<WaveSource>());
+        for(const QJsonValue &sourceValue : sourceSet.toArray()) {
+            WaveSource source = WaveSource::point(0, 0);
+            if(!parseSource(sourceValue.toObject(), source)) return false;
+            sources.back().push_back(source);
+        }
+    }
+
+    for(const QJsonValue &gridSize : gridSizes) {
+        for(const QJsonValue &ground : grounds) {
+            for(const QJsonValue &damping : dampings) {
+                for(int sourceSet=0; sourceSet<int(sources.size()); sourceSet++) {
+                    for(const QJsonValue &stepCount : steps) {
+                        SweepScenario scenario;
+                        if(!parseGridSize(gridSize, scenario.nx, scenario.ny)
+                                || !parseGround(ground, scenario.ground, scenario.seed)) {
+                            return false;
+                        }
+                        scenario.damping = damping.toDouble();
+                        scenario.steps = stepCount.toInt();
+                        scenario.sourceSet = sourceSet;
+                        scenario.sources = sources[sourceSet];
+                        if(scenario.steps <= 0) {
+                            qDebug() << "Warning, invalid step count in sweep spec " << filename << ".";
+                            return false;
+                        }
+                        addScenario(scenario);
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void SweepRunner::addScenario(const SweepScenario &scenario)
+{
+    m_scenarios.push_back(scenario);
+}
+
+const std::vector<SweepScenario> &SweepRunner::scenarios() const
+{
+    return m_scenarios;
+}
+
+const std::vector<SweepResult> &SweepRunner::results() const
+{
+    return m_results;
+}
+
+void SweepRunner::runScenario(int index, bool parallelStep)
+{
+    const SweepScenario &scenario = m_scenarios[index];
+    Simulator simulator;
+    WaveSolver &solver = simulator.solver();
+    solver.setGridSize(scenario.nx, scenario.ny);
+    solver.reset();
+    solver.setGroundType(scenario.ground, scenario.seed);
+    solver.setDampingFactor(scenario.damping);
+    for(const WaveSource &source : scenario.sources) {
+        solver.addSource(source);
+    }
+    solver.setMonitorsEnabled(true);
+    double dt = simulator.timestep();
+
+    QElapsedTimer timer;
+    timer.start();
+    for(int step=0; step<scenario.steps; step++) {
+        simulator.step(dt);
+    }
+
+    SweepResult &result = m_results[index];
+    result.parallelStep = parallelStep;
+    result.elapsed = timer.nsecsElapsed()*1e-9;
+    result.simulatedTime = solver.time();
+
+    const SolverMonitors &monitors = solver.monitors();
+    result.maxHeight = monitors.maxAmplitude;
+    result.meanHeight = monitors.meanLevel;
+    result.energy = monitors.totalEnergy;
+}
+
+void SweepRunner::run()
+{
+    CPThreadPool &pool = CPThreadPool::instance();
+    int numScenarios = m_scenarios.size();
+    m_results.assign(numScenarios, SweepResult());
+    auto cost = [&](int index) {
+        const SweepScenario &scenario = m_scenarios[index];
+        return double(scenario.nx)*scenario.ny*scenario.steps;
+    };
+    std::vector<int> order(numScenarios);
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return cost(a) > cost(b); });
+    double totalCost = 0;
+    for(int index=0; index<numScenarios; index++) {
+        totalCost += cost(index);
+    }
+
+    // A scenario that costs more than a thread's share of the sweep would finish last however
+    // the rest is scheduled, so it gets all threads for its steps instead. The others are
+    // submitted most expensive first and balanced by work stealing.
+    QElapsedTimer timer;
+    timer.start();
+    std::vector<std::function<void()>> tasks;
+    for(int index : order) {
+        if(pool.runsInParallel() && cost(index)*pool.numThreads() > totalCost) {
+            runScenario(index, true);
+        } else {
+            tasks.push_back([this, index]() { runScenario(index, false); });
+        }
+    }
+    pool.runTasks(tasks);
+    m_elapsed = timer.nsecsElapsed()*1e-9;
+}
+
+void SweepRunner::printResults() const
+{
+    double scenarioElapsed = 0;
+    for(int index=0; index<int(m_results.size()); index++) {
+        const SweepScenario &scenario = m_scenarios[index];
+        const SweepResult &result = m_results[index];
+        scenarioElapsed += result.elapsed;
+        qDebug() << index << ": " << scenario.nx << "x" << scenario.ny << " " << groundTypeName(scenario.ground)
+                 << ", damping " << scenario.damping << ", sources " << scenario.sourceSet << ", " << scenario.steps
+                 << " steps, " << (result.parallelStep ? "parallel step" : "task") << ": " << result.elapsed << " s, "
+                 << 1e-6*scenario.nx*scenario.ny*scenario.steps/result.elapsed << " Mcells/s, max height "
+                 << result.maxHeight << ", mean height " << result.meanHeight << ", energy " << result.energy;
+    }
+    qDebug() << m_results.size() << " scenarios on " << CPThreadPool::instance().numThreads() << " threads in "
+             << m_elapsed << " s, " << scenarioElapsed/m_elapsed << "x the scenario time";
+}
+
+bool SweepRunner::saveResults(QString filename) const
+{
+    QFile file(filename);
+    if(!file.open(QFile::WriteOnly | QFile::Truncate)) {
+        qDebug() << "Warning, could not open sweep results " << filename << ": " << file.errorString();
+        return false;
+    }
+    QString table = "scenario,nx,ny,ground,seed,damping,sources,steps,mode,seconds,mcells_per_second,"
+                    "simulated_time,max_height,mean_height,energy\n";
+    for(int index=0; index<int(m_results.size()); index++) {
+        const SweepScenario &scenario = m_scenarios[index];
+        const SweepResult &result = m_results[index];
+        table += QString("%1,%2,%3,%4,%5,%6,%7,%8,%9,").arg(index).arg(scenario.nx).arg(scenario.ny)
+                .arg(groundTypeName(scenario.ground)).arg(scenario.seed).arg(scenario.damping)
+                .arg(scenario.sourceSet).arg(scenario.steps).arg(result.parallelStep ? "parallel" : "task");
+        table += QString("%1,%2,%3,%4,%5,%6\n").arg(result.elapsed)
+                .arg(1e-6*scenario.nx*scenario.ny*scenario.steps/result.elapsed)
+                .arg(result.simulatedTime).arg(result.maxHeight).arg(result.meanHeight).arg(result.energy);
+    }
+    if(file.write(table.toUtf8()) < 0) {
+        qDebug() << "Warning, could not write sweep results " << filename << ": " << file.errorString();
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,58 @@
+#ifndef SWEEPRUNNER_H
+#define SWEEPRUNNER_H
+#include <QString>
+#include <vector>
+#include "wavesolver.h"
+
+// One simulation of a parameter sweep
+class SweepScenario
+{
+public:
+    int nx;
+    int ny;
+    GroundType ground;
+    unsigned int seed;
+    float damping;
+    int steps;
+    int sourceSet;
+    std::vector<WaveSource> sources;
+};
+
+class SweepResult
+{
+public:
+    bool parallelStep;
+    double elapsed;
+    double simulatedTime;
+    // Solver monitors of the last step
+    float maxHeight;
+    float meanHeight;
+    double energy;
+};
+
+// Runs the scenarios of a sweep spec concurrently and collects one table of results. Scenarios
+// that would take more than their share of the whole sweep run one at a time with every thread
+// working on each step, the rest run as tasks on the work stealing pool, one thread each.
+class SweepRunner
+{
+private:
+    std::vector<SweepScenario> m_scenarios;
+    std::vector<SweepResult> m_results;
+    double m_elapsed;
+
+    void runScenario(int index, bool parallelStep);
+
+public:
+    SweepRunner();
+    bool load(QString filename);
+    void addScenario(const SweepScenario &scenario);
+    const std::vector<SweepScenario> &scenarios() const;
+    const std::vector<SweepResult> &results() const;
+    void run();
+    void printResults() const;
+    bool saveResults(QString filename) const;
+    static bool parseGroundType(QString name, GroundType &type);
+    static QString groundTypeName(GroundType type);
+};
+
+#endif // SWEEPRUNNER_H
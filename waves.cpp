@@ -91,7 +91,9 @@ Waves::Waves()
       m_roll(0),
       m_running(true),
       m_previousStepCompleted(true),
-      m_steps(0)
+      m_steps(0),
+      m_telemetry(new WavesTelemetry(this)),
+      m_frameBudget(0)
 {
     connect(this, SIGNAL(windowChanged(QQuickWindow*)), this, SLOT(handleWindowChanged(QQuickWindow*)));
     m_timer.start();
@@ -119,14 +121,34 @@ void Waves::sync()
 
     double dt = m_timer.restart() / 1000.0;
 
-    double c_max = 1.0;       			// Used to determine dt and Nt
-    double safeDt = 0.9*m_simulator.solver().dr()/sqrt(2*c_max); 			// This guarantees (I guess) stability if c_max is correct
+    if(!m_checkpointToLoad.isEmpty()) {
+        if(m_simulator.solver().loadCheckpoint(m_checkpointToLoad)) {
+            qDebug() << "Loaded checkpoint " << m_checkpointToLoad;
+        }
+        m_checkpointToLoad = QString();
+    }
+
+    double safeDt = m_simulator.timestep();
 
     if(m_running) {
         // Step if running
         CPTimer::computeTimestep().start();
         m_simulator.step(safeDt);
         CPTimer::computeTimestep().stop();
+        CPTimer::computeTimestep().addCellUpdates(qint64(m_simulator.solver().nx())*m_simulator.solver().ny());
+    }
+    qint64 cellUpdates = m_running ? qint64(m_simulator.solver().nx())*m_simulator.solver().ny() : 0;
+    TelemetryFrame frame = m_telemetry->addFrame(dt, m_running ? 1 : 0, cellUpdates, m_simulator.solver().memoryUsage());
+
+    // The properties are only read here, while the GUI thread is blocked
+    m_governor.setFrameBudget(m_frameBudget);
+    int nx;
+    int ny;
+    double workTime = frame.stepTime + frame.normalsTime + frame.uploadTime + frame.renderTime;
+    if(m_running && m_governor.addFrame(workTime, m_simulator.solver().nx(), m_simulator.solver().ny(), nx, ny)) {
+        qDebug() << "Resizing the grid to " << nx << "x" << ny << " for a frame budget of " << m_frameBudget
+                 << " ms, stepping and rendering took " << m_governor.averageWorkTime() << " ms";
+        m_simulator.setResolution(nx, ny);
     }
 
     if(!(m_steps++ % 60)) {
@@ -140,6 +162,8 @@ void Waves::sync()
         float copyDataFraction = round(10000*CPTimer::copyData().elapsedTime() / CPTimer::totalTime())/100;
         qDebug() << endl <<"Computing timesteps: " << CPTimer::computeTimestep().elapsedTime() << " s (" << computeTimestepFraction << "%)";
         qDebug() << "Normal vectors: " << CPTimer::normalVectors().elapsedTime() << " s (" << normalVectorsFraction << "%)";
+        CPTimer::reportCounters("Computing timesteps", CPTimer::computeTimestep());
+        CPTimer::reportCounters("Normal vectors", CPTimer::normalVectors());
         qDebug() << "Upload VBO: " << CPTimer::uploadVBO().elapsedTime() << " s (" << uploadVBOFraction << "%)";
         qDebug() << "Draw elements: " << CPTimer::drawElements().elapsedTime() << " s (" << drawElementsFraction << "%)";
         qDebug() << "Sync: " << CPTimer::sync().elapsedTime() << " s (" << syncFraction << "%)";
@@ -149,6 +173,13 @@ void Waves::sync()
         qDebug() << "Timestep: " << safeDt;
     }
 
+    if(!m_checkpointToSave.isEmpty()) {
+        if(m_simulator.solver().saveCheckpoint(m_checkpointToSave)) {
+            qDebug() << "Saved checkpoint " << m_checkpointToSave;
+        }
+        m_checkpointToSave = QString();
+    }
+
     m_previousStepCompleted = true;
     CPTimer::sync().stop();
 }
@@ -171,13 +202,8 @@ void Waves::handleWindowChanged(QQuickWindow *win)
         win->setClearBeforeRendering(false);
     }
 }
-Simulator Waves::simulator() const
+Simulator &Waves::simulator()
 {
     return m_simulator;
 }
 
-void Waves::setSimulator(const Simulator &simulator)
-{
-    m_simulator = simulator;
-}
-
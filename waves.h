@@ -6,6 +6,9 @@
 #include <QMatrix4x4>
 
 #include "simulator.h"
+#include "cptrace.h"
+#include "wavestelemetry.h"
+#include "framegovernor.h"
 
 class WavesRenderer : public QObject {
     Q_OBJECT
@@ -39,6 +42,8 @@ class Waves : public QQuickItem
     Q_PROPERTY(double roll READ roll WRITE setRoll NOTIFY rollChanged)
     Q_PROPERTY(bool running READ running WRITE setRunning NOTIFY runningChanged)
     Q_PROPERTY(bool previousStepCompleted READ previousStepCompleted NOTIFY previousStepCompletedChanged)
+    Q_PROPERTY(WavesTelemetry *telemetry READ telemetry CONSTANT)
+    Q_PROPERTY(double frameBudget READ frameBudget WRITE setFrameBudget NOTIFY frameBudgetChanged)
 public:
     Q_INVOKABLE void step();
     Waves();
@@ -69,8 +74,17 @@ public:
         return m_running;
     }
 
-    Simulator simulator() const;
-    void setSimulator(const Simulator &simulator);
+    Simulator &simulator();
+
+    WavesTelemetry *telemetry() const
+    {
+        return m_telemetry;
+    }
+
+    double frameBudget() const
+    {
+        return m_frameBudget;
+    }
 
     bool previousStepCompleted() const
     {
@@ -117,6 +131,17 @@ public slots:
         emit rollChanged(arg);
     }
 
+    // Milliseconds of stepping and rendering per frame the grid is resized to fit, 0 keeps
+    // the grid size fixed
+    void setFrameBudget(double arg)
+    {
+        if (m_frameBudget == arg)
+            return;
+
+        m_frameBudget = arg;
+        emit frameBudgetChanged(arg);
+    }
+
     void setRunning(bool arg)
     {
         if (m_running == arg)
@@ -132,6 +157,34 @@ public slots:
         m_simulator.solver().createRandomGauss();
     }
 
+    // Drop in world coordinates, stamped at the start of the next step
+    void addDrop(float x, float y, float amplitude, float standardDeviation)
+    {
+        m_simulator.solver().addDrop(x, y, amplitude, standardDeviation);
+    }
+
+    // Checkpoints are written and read in sync() where the simulator is not in use by the renderer
+    void saveCheckpoint(QString filename)
+    {
+        m_checkpointToSave = filename;
+    }
+
+    void loadCheckpoint(QString filename)
+    {
+        m_checkpointToLoad = filename;
+    }
+
+    // Timeline of the frames from now until stopTrace(), see CPTrace
+    bool startTrace(QString filename)
+    {
+        return CPTrace::start(filename);
+    }
+
+    void stopTrace()
+    {
+        CPTrace::stop();
+    }
+
 signals:
     void zoomChanged(float arg);
     void tiltChanged(double arg);
@@ -139,6 +192,7 @@ signals:
     void rollChanged(double arg);
     void runningChanged(bool arg);
     void previousStepCompletedChanged(bool arg);
+    void frameBudgetChanged(double arg);
 
 private slots:
     void handleWindowChanged(QQuickWindow *win);
@@ -153,6 +207,11 @@ private:
     bool  m_running;
     QElapsedTimer m_timer;
     int   m_steps;
+    QString m_checkpointToSave;
+    QString m_checkpointToLoad;
+    WavesTelemetry *m_telemetry;
+    FrameGovernor m_governor;
+    double m_frameBudget;
 
     bool m_previousStepCompleted;
 };
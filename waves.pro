@@ -16,7 +16,22 @@ SOURCES += main.cpp \
     wavesolver.cpp \
     perlinnoise.cpp \
     cptimer.cpp \
-    cpbox.cpp
+    cpbox.cpp \
+    cpframecapture.cpp \
+    offscreenwaves.cpp \
+    snapshotstream.cpp \
+    cpfield.cpp \
+    benchmark.cpp \
+    wavesource.cpp \
+    cpthreadpool.cpp \
+    cpheightmap.cpp \
+    ensemblesolver.cpp \
+    sweeprunner.cpp \
+    gaugerecorder.cpp \
+    cpperfcounters.cpp \
+    cptrace.cpp \
+    wavestelemetry.cpp \
+    framegovernor.cpp
 
 RESOURCES += qml.qrc
 
@@ -33,7 +48,23 @@ HEADERS += \
     wavesolver.h \
     perlinnoise.h \
     cptimer.h \
-    cpbox.h
+    cpbox.h \
+    cpframecapture.h \
+    offscreenwaves.h \
+    snapshotstream.h \
+    cpfield.h \
+    benchmark.h \
+    wavesource.h \
+    cpthreadpool.h \
+    cpheightmap.h \
+    ensemblesolver.h \
+    sweeprunner.h \
+    cpringbuffer.h \
+    gaugerecorder.h \
+    cpperfcounters.h \
+    cptrace.h \
+    wavestelemetry.h \
+    framegovernor.h
 
 #QMAKE_CXX = g++-4.9
 #QMAKE_CC = gcc-4.9
@@ -1,69 +1,738 @@
 #include "wavesolver.h"
 #include "perlinnoise.h"
 #include "cptimer.h"
+#include "cpthreadpool.h"
 
-#if defined(__ARM_NEON)
-#include <arm_neon.h>
+#include <QFile>
+#include <QFileInfo>
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <limits>
+#ifdef Q_OS_UNIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
-#include <cmath>
+namespace {
+// Binary checkpoint layout: CheckpointHeader followed by numFields arrays of gridSize*ny
+// values in row-major order (u, u_prev, ground, walls). gridSize is the number of points
+// along x. u and u_prev have solutionValueSize bytes per value, 8 (double) for a Float64 run
+// and 4 (float) otherwise, the other fields are float. Versions before 4 only have float
+// arrays. Version 1 had the dense source field as a fifth array, it is skipped when loading.
+// Versions 1 and 2 are square, with ny = gridSize and y in [rMin, rMax]. The sources are part
+// of the scenario and are not stored.
+const char checkpointMagic[8] = {'W','A','V','E','C','K','P','T'};
+const quint32 checkpointVersion = 4;
+const quint32 checkpointNumFields = 4;
+
+struct CheckpointHeader {
+    char    magic[8];
+    quint32 version;
+    quint32 headerSize;
+    qint32  gridSize;
+    quint32 numFields;
+    float   dr;
+    float   length;
+    float   rMin;
+    float   rMax;
+    float   dampingFactor;
+    double  time; // Version 2
+    qint32  ny;   // Version 3
+    float   yMin;
+    float   yMax;
+    quint32 solutionValueSize; // Version 4
+};
+
+// The values of a field as a checkpoint array, or 0 if its storage or layout differ from the
+// file and the rows have to be converted
+unsigned char *checkpointArray(CPField &field, size_t valueSize) {
+    if(field.layout() != FieldLayout::RowMajor) return 0;
+    if(field.storage() == FieldStorage::Float32 && valueSize == sizeof(float)) {
+        return reinterpret_cast<unsigned char*>(field.data<Float32Storage>());
+    }
+    if(field.storage() == FieldStorage::Float64 && valueSize == sizeof(double)) {
+        return reinterpret_cast<unsigned char*>(field.data<Float64Storage>());
+    }
+    return 0;
+}
+
+const int maxStencilRadius = 3;
+
+// Rows i-Radius to i+Radius of the stencil, with Radius ghost values at each end of u, g and c.
+// Row i is u[Radius].
+template<class Real>
+struct StencilRows {
+    const Real *u[2*maxStencilRadius+1];
+    const Real *g[2*maxStencilRadius+1];
+    const Real *c[2*maxStencilRadius+1];
+    const Real *previous;
+    const Real *walls;
+    Real *next;
+    unsigned char *dry;
+    std::vector<int> *changedDryCells;
+    Real factor;
+    Real factor2;
+    const Real *spongeFactor;
+    const Real *spongeFactor2;
+    Real dtdtOverdxdx;
+    Real dtdtOverdydy;
+    Real *scratch;
+    int scratchStride;
+    // Column of cell 0 of the rows, when a row is stepped in strips
+    int jOffset;
+};
+
+// Cells are dry exactly where the kernel clamped them below the ground. Done as a separate
+// pass because storing the byte flags from the stencil loop keeps it from being vectorized.
+// The shoreline rarely moves, so the flags are only compared at first, and the cells that did
+// change are written and appended to changed.
+template<class Real>
+inline int markDryCells(const Real *ground, const Real *next, unsigned char *dry, int jBegin, int jEnd,
+                        std::vector<int> &changed, int jOffset = 0)
+{
+    int dryCells = 0;
+    int changedCells = 0;
+    for(int j=jBegin; j<jEnd; j++) {
+        int isDry = ground[j] > next[j];
+        dryCells += isDry;
+        changedCells += isDry != dry[j];
+    }
+    if(changedCells) {
+        for(int j=jBegin; j<jEnd; j++) {
+            unsigned char isDry = ground[j] > next[j];
+            if(isDry == dry[j]) continue;
+            dry[j] = isDry;
+            changed.push_back(jOffset + j);
+        }
+    }
+    return dryCells;
+}
+
+// Computes u_next for the cells [jBegin, jEnd) of row i and returns the number of dry cells.
+// Sponge cells take their damping factors per cell, everywhere else they are constant.
+template<class Real, bool Sponge>
+inline int stepCells(const StencilRows<Real> &rows, int jBegin, int jEnd)
+{
+    // Everything is read into locals, loads through rows could alias next and keep the loop
+    // from being vectorized
+    const Real *um = rows.u[0], *uc = rows.u[1], *up = rows.u[2];
+    const Real *gm = rows.g[0], *gc = rows.g[1], *gp = rows.g[2];
+    const Real *cm = rows.c[0], *c = rows.c[1], *cp = rows.c[2];
+    const Real *previous = rows.previous;
+    const Real *walls = rows.walls;
+    const Real *spongeFactor = rows.spongeFactor;
+    const Real *spongeFactor2 = rows.spongeFactor2;
+    Real *next = rows.next;
+    Real dtdtOverdxdx = rows.dtdtOverdxdx;
+    Real dtdtOverdydy = rows.dtdtOverdydy;
+    Real constantFactor = rows.factor;
+    Real constantFactor2 = rows.factor2;
+#pragma clang loop vectorize(enable) interleave(enable)
+    for(int j=jBegin; j<jEnd; j++) {
+        int jj = j+1;
+        Real u0 = uc[jj];
+        Real factor = Sponge ? spongeFactor[j] : constantFactor;
+        Real factor2 = Sponge ? spongeFactor2[j] : constantFactor2;
+
+        // A neighbour behind ground that is higher than the water level is mirrored through the cell
+        Real uxp = gp[jj]   > u0 ? um[jj]   : up[jj];
+        Real uxm = gm[jj]   > u0 ? up[jj]   : um[jj];
+        Real uyp = gc[jj+1] > u0 ? uc[jj-1] : uc[jj+1];
+        Real uym = gc[jj-1] > u0 ? uc[jj+1] : uc[jj-1];
+        Real ddt_rest = factor2*previous[j] + 2*u0;
+#ifdef CONSTANTWAVESPEED
+        Real ddx = uxp + uxm - 2*u0;
+        Real ddy = uyp + uym - 2*u0;
+
+        Real value = factor*(dtdtOverdxdx*ddx + dtdtOverdydy*ddy + ddt_rest);
+#else
+        Real cc = c[jj]; // wave speed
+
+        Real cx_m = Real(0.5)*(cc + cm[jj]); 	// Calculate the 4 c's we need. We need c_{i \pm 1/2,j} and c_{i,j \pm 1/2}
+        Real cx_p = Real(0.5)*(cc + cp[jj]);
+        Real cy_m = Real(0.5)*(cc + c[jj-1]);
+        Real cy_p = Real(0.5)*(cc + c[jj+1]);
+
+        Real ddx = cx_p*(uxp - u0) - cx_m*(u0 - uxm);
+        Real ddy = cy_p*(uyp - u0) - cy_m*(u0 - uym);
+
+        // Set value to zero if we have a wall. The update is computed either way so that the
+        // select does not hide floating point operations from the vectorizer.
+        Real update = factor*(dtdtOverdxdx*ddx + dtdtOverdydy*ddy + ddt_rest);
+        Real value = walls[j] ? 0 : update;
+#endif
+        // Clamp cells that fall dry to just below the ground
+        next[j] = gc[jj] > value ? gc[jj] - Real(0.01) : value;
+    }
+    return markDryCells(gc + 1, next, rows.dry, jBegin, jEnd, *rows.changedDryCells, rows.jOffset);
+}
+
+// Central difference weights for the second and first derivative, index k is the weight of
+// the neighbours at distance k
+template<int Radius>
+inline double secondDerivativeWeight(int k)
+{
+    static const double weights[3][4] = {{-2, 1}, {-5.0/2, 4.0/3, -1.0/12}, {-49.0/18, 3.0/2, -3.0/20, 1.0/90}};
+    return weights[Radius-1][k];
+}
+
+template<int Radius>
+inline double firstDerivativeWeight(int k)
+{
+    static const double weights[3][4] = {{0, 1.0/2}, {0, 2.0/3, -1.0/12}, {0, 3.0/4, -3.0/20, 1.0/60}};
+    return weights[Radius-1][k];
+}
+
+// Fourth (Radius 2) and sixth (Radius 3) order version of stepCells. The mirror rule is applied
+// to each neighbour at distance k on its own. With variable wave speed the operator is written
+// as c*laplace(u) + grad(c).grad(u). The x differences are accumulated one neighbour distance
+// at a time into rows.scratch, so that every pass only reads a fixed set of rows and vectorizes.
+template<class Real, int Radius>
+inline void accumulateWideX(const StencilRows<Real> &rows, int k, int jBegin, int jEnd)
+{
+    Real center = secondDerivativeWeight<Radius>(0);
+    Real d2 = secondDerivativeWeight<Radius>(k);
+    const Real *uc = rows.u[Radius], *um = rows.u[Radius-k], *up = rows.u[Radius+k];
+    const Real *gm = rows.g[Radius-k], *gp = rows.g[Radius+k];
+    Real *ddx = rows.scratch;
+#ifndef CONSTANTWAVESPEED
+    Real d1 = firstDerivativeWeight<Radius>(k);
+    const Real *cm = rows.c[Radius-k], *cp = rows.c[Radius+k];
+    Real *dudx = ddx + rows.scratchStride;
+    Real *dcdx = dudx + rows.scratchStride;
+#endif
+    bool first = k == 1;
+#pragma clang loop vectorize(enable) interleave(enable)
+    for(int j=jBegin; j<jEnd; j++) {
+        int jj = j+Radius;
+        Real u0 = uc[jj];
+        Real uxp = gp[jj] > u0 ? um[jj] : up[jj];
+        Real uxm = gm[jj] > u0 ? up[jj] : um[jj];
+        ddx[j] = (first ? center*u0 : ddx[j]) + d2*(uxp + uxm);
+#ifndef CONSTANTWAVESPEED
+        dudx[j] = (first ? 0 : dudx[j]) + d1*(uxp - uxm);
+        dcdx[j] = (first ? 0 : dcdx[j]) + d1*(cp[jj] - cm[jj]);
+#endif
+    }
+}
+
+template<class Real, bool Sponge, int Radius>
+inline int stepCellsWide(const StencilRows<Real> &rows, int jBegin, int jEnd)
+{
+    for(int k=1; k<=Radius; k++) {
+        accumulateWideX<Real, Radius>(rows, k, jBegin, jEnd);
+    }
+
+    Real d2[Radius+1];
+    Real d1[Radius+1];
+    for(int k=0; k<=Radius; k++) {
+        d2[k] = secondDerivativeWeight<Radius>(k);
+        d1[k] = firstDerivativeWeight<Radius>(k);
+    }
+    const Real *uc = rows.u[Radius];
+    const Real *gc = rows.g[Radius];
+    const Real *c = rows.c[Radius];
+    const Real *previous = rows.previous;
+    const Real *walls = rows.walls;
+    const Real *spongeFactor = rows.spongeFactor;
+    const Real *spongeFactor2 = rows.spongeFactor2;
+    const Real *ddxRow = rows.scratch;
+#ifndef CONSTANTWAVESPEED
+    const Real *dudxRow = ddxRow + rows.scratchStride;
+    const Real *dcdxRow = dudxRow + rows.scratchStride;
+#endif
+    Real *next = rows.next;
+    Real dtdtOverdxdx = rows.dtdtOverdxdx;
+    Real dtdtOverdydy = rows.dtdtOverdydy;
+    Real constantFactor = rows.factor;
+    Real constantFactor2 = rows.factor2;
+#pragma clang loop vectorize(enable) interleave(enable)
+    for(int j=jBegin; j<jEnd; j++) {
+        int jj = j+Radius;
+        Real u0 = uc[jj];
+        Real factor = Sponge ? spongeFactor[j] : constantFactor;
+        Real factor2 = Sponge ? spongeFactor2[j] : constantFactor2;
+
+        Real ddx = ddxRow[j];
+        Real ddy = d2[0]*u0;
+#ifndef CONSTANTWAVESPEED
+        Real dudy = 0, dcdy = 0;
+#endif
+        for(int k=1; k<=Radius; k++) {
+            Real uyp = gc[jj+k] > u0 ? uc[jj-k] : uc[jj+k];
+            Real uym = gc[jj-k] > u0 ? uc[jj+k] : uc[jj-k];
+            ddy += d2[k]*(uyp + uym);
+#ifndef CONSTANTWAVESPEED
+            dudy += d1[k]*(uyp - uym);
+            dcdy += d1[k]*(c[jj+k] - c[jj-k]);
+#endif
+        }
+        Real ddt_rest = factor2*previous[j] + 2*u0;
+#ifdef CONSTANTWAVESPEED
+        Real value = factor*(dtdtOverdxdx*ddx + dtdtOverdydy*ddy + ddt_rest);
+#else
+        Real cc = c[jj];
+        ddx = cc*ddx + dcdxRow[j]*dudxRow[j];
+        ddy = cc*ddy + dcdy*dudy;
+        Real update = factor*(dtdtOverdxdx*ddx + dtdtOverdydy*ddy + ddt_rest);
+        Real value = walls[j] ? 0 : update;
+#endif
+        next[j] = gc[jj] > value ? gc[jj] - Real(0.01) : value;
+    }
+    return markDryCells(gc + Radius, next, rows.dry, jBegin, jEnd, *rows.changedDryCells, rows.jOffset);
+}
+
+// Sums of one row for the monitors: (u_next - u_prev)^2, c (du)^2 over the x and y faces, u, max
+// |u|, the number of wet cells and max |du| over the faces. Faces to cells the kernel mirrors do not count. The cells are
+// spread over monitorLanes partial sums, which vectorizes without reordering any addition, and
+// the lanes are added in order, so a row always gives the same sums. un and gn are the row
+// i+1, cn its wave speed.
+const int numMonitorSums = 7;
+const int monitorLanes = 8;
+
+// Monitor contributions of the cell j, with jp the cell after it
+template<class Real>
+struct MonitorCell
+{
+    Real kinetic, potentialX, potentialY, level, amplitude, wet, gradient;
+};
+
+template<class Real>
+inline MonitorCell<Real> monitorCell(const Real *uc, const Real *un, const Real *gc, const Real *gn,
+                                     const Real *c, const Real *cn, const Real *walls, const Real *previous,
+                                     const Real *next, int j, int jp)
+{
+    Real u0 = uc[j];
+    Real uxn = un[j];
+    Real uyn = uc[jp];
+#ifdef CONSTANTWAVESPEED
+    Real wet = gc[j] > u0 ? Real(0) : Real(1);
+    Real cx = 1, cy = 1;
+    (void)c; (void)cn; (void)walls;
+#else
+    Real wall = walls[j];
+    Real dry = gc[j] > u0 ? Real(1) : wall;
+    Real wet = dry != 0 ? Real(0) : Real(1);
+    Real cx = Real(0.5)*(c[j] + cn[j]);
+    Real cy = Real(0.5)*(c[j] + c[jp]);
+#endif
+    // Selecting the neighbour and not the difference keeps the subtraction out of the branch,
+    // which GCC would not if-convert
+    Real ddx = (gn[j] > u0 ? u0 : uxn) - u0;
+    Real ddy = (gc[jp] > u0 ? u0 : uyn) - u0;
+    Real ddt = next[j] - previous[j];
+    MonitorCell<Real> cell;
+    cell.kinetic = wet*ddt*ddt;
+    cell.potentialX = wet*cx*ddx*ddx;
+    cell.potentialY = wet*cy*ddy*ddy;
+    cell.level = wet*u0;
+    cell.amplitude = wet*std::abs(u0);
+    cell.wet = wet;
+    cell.gradient = wet*std::max(std::abs(ddx), std::abs(ddy));
+    return cell;
+}
+
+// Adds values lane by lane, or takes the maximum, count is a multiple of monitorLanes
+template<class Real, bool Max>
+inline void addLanes(const Real *__restrict values, int count, Real *__restrict lanes)
+{
+    Real sum[monitorLanes];
+    for(int l=0; l<monitorLanes; l++) sum[l] = lanes[l];
+    for(int k=0; k<count; k+=monitorLanes) {
+        for(int l=0; l<monitorLanes; l++) {
+            sum[l] = Max ? std::max(sum[l], values[k+l]) : sum[l] + values[k+l];
+        }
+    }
+    for(int l=0; l<monitorLanes; l++) lanes[l] = sum[l];
+}
+
+template<class Real>
+inline void sumMonitors(const Real *__restrict uc, const Real *__restrict un, const Real *__restrict gc,
+                        const Real *__restrict gn, const Real *__restrict c, const Real *__restrict cn,
+                        const Real *__restrict walls, const Real *__restrict previous,
+                        const Real *__restrict next, int N, int lastNeighbour, double *sums)
+{
+    // The contributions are computed a chunk at a time in one loop and added to the lanes in a
+    // second, both vectorize. The last cell is added on its own, its neighbour is lastNeighbour,
+    // which is j = 0 or the ghost value after the row.
+    const int chunk = 32*monitorLanes;
+    Real cells[numMonitorSums][chunk];
+    Real lanes[numMonitorSums][monitorLanes] = {};
+    int last = N-1;
+    for(int jBegin=0; jBegin<last; jBegin+=chunk) {
+        int count = std::min(chunk, last-jBegin);
+#pragma clang loop vectorize(enable) interleave(enable)
+        for(int k=0; k<count; k++) {
+            int j = jBegin+k;
+            MonitorCell<Real> cell = monitorCell(uc, un, gc, gn, c, cn, walls, previous, next, j, j+1);
+            cells[0][k] = cell.kinetic;
+            cells[1][k] = cell.potentialX;
+            cells[2][k] = cell.potentialY;
+            cells[3][k] = cell.level;
+            cells[4][k] = cell.amplitude;
+            cells[5][k] = cell.wet;
+            cells[6][k] = cell.gradient;
+        }
+        int padded = (count + monitorLanes-1)/monitorLanes*monitorLanes;
+        for(int s=0; s<numMonitorSums; s++) {
+            for(int k=count; k<padded; k++) cells[s][k] = 0;
+        }
+        addLanes<Real, false>(cells[0], padded, lanes[0]);
+        addLanes<Real, false>(cells[1], padded, lanes[1]);
+        addLanes<Real, false>(cells[2], padded, lanes[2]);
+        addLanes<Real, false>(cells[3], padded, lanes[3]);
+        addLanes<Real, true>(cells[4], padded, lanes[4]);
+        addLanes<Real, false>(cells[5], padded, lanes[5]);
+        addLanes<Real, true>(cells[6], padded, lanes[6]);
+    }
+    MonitorCell<Real> cell = monitorCell(uc, un, gc, gn, c, cn, walls, previous, next, last, lastNeighbour);
+
+    for(int s=0; s<numMonitorSums; s++) sums[s] = 0;
+    for(int l=0; l<monitorLanes; l++) {
+        sums[0] += lanes[0][l];
+        sums[1] += lanes[1][l];
+        sums[2] += lanes[2][l];
+        sums[3] += lanes[3][l];
+        sums[4] = std::max(sums[4], double(lanes[4][l]));
+        sums[5] += lanes[5][l];
+        sums[6] = std::max(sums[6], double(lanes[6][l]));
+    }
+    sums[0] += cell.kinetic;
+    sums[1] += cell.potentialX;
+    sums[2] += cell.potentialY;
+    sums[3] += cell.level;
+    sums[4] = std::max(sums[4], double(cell.amplitude));
+    sums[5] += cell.wet;
+    sums[6] = std::max(sums[6], double(cell.gradient));
+}
+
+template<class Real, bool Sponge, int Radius>
+inline int stepSegment(const StencilRows<Real> &rows, int jBegin, int jEnd)
+{
+    return Radius == 1 ? stepCells<Real, Sponge>(rows, jBegin, jEnd)
+                       : stepCellsWide<Real, Sponge, Radius>(rows, jBegin, jEnd);
+}
+
+// Lines for the implicit integrator are solved `lanes` at a time. Value l of line k is at
+// plane k, so the lines are independent within every loop below and it vectorizes across
+// them. Line k couples to planes k-1 and k+1 and wraps around, which makes every line a cyclic
+// tridiagonal system a x_{k-1} + b x_k + c x_{k+1} = d. The corners are removed with
+// Sherman-Morrison: the plain tridiagonal system is solved for d and for a correction z at
+// the same time, and fact*z is subtracted at the end. The planes a loop writes never overlap
+// the ones it reads, __restrict saves the compiler from versioning the loops for every pair.
+
+// D is the second difference of the leapfrog kernel, except at the shore. The mirror rule
+// depends on u, and an operator that switches between steps lets energy grow once the steps are
+// long, so the implicit step keeps a fixed shoreline instead: cells with ground above the still
+// water level 0 are land, and the faces between water and land are closed. Land cells are not
+// updated, flooding needs the leapfrog step.
+template<class Real>
+inline Real openFace(Real g0, Real gn)
+{
+    return g0 < 0 && gn < 0 ? 1 : 0;
+}
+
+// Coefficients of 1 - alpha*D at one plane. Land cells have no open faces and get identity rows,
+// walls keep their value, which is zero.
+template<class Real>
+inline void implicitCoefficients(int lanes, const Real *__restrict g, const Real *__restrict gm,
+                                 const Real *__restrict gp, const Real *__restrict c,
+                                 const Real *__restrict cm, const Real *__restrict cp,
+                                 const Real *__restrict walls, Real alpha, Real *__restrict a,
+                                 Real *__restrict b, Real *__restrict cc)
+{
+#pragma clang loop vectorize(enable) interleave(enable)
+    for(int l=0; l<lanes; l++) {
+        Real g0 = g[l];
+#ifdef CONSTANTWAVESPEED
+        Real faceM = openFace(g0, gm[l]);
+        Real faceP = openFace(g0, gp[l]);
+#else
+        Real faceM = openFace(g0, gm[l])*std::max(Real(0.5)*(c[l] + cm[l]), Real(0));
+        Real faceP = openFace(g0, gp[l])*std::max(Real(0.5)*(c[l] + cp[l]), Real(0));
+#endif
+        Real lower = -alpha*faceM;
+        Real upper = -alpha*faceP;
+        Real diagonal = 1 + alpha*(faceM + faceP);
+#ifdef CONSTANTWAVESPEED
+        a[l] = lower;
+        cc[l] = upper;
+        b[l] = diagonal;
+#else
+        a[l] = walls[l] ? 0 : lower;
+        cc[l] = walls[l] ? 0 : upper;
+        b[l] = walls[l] ? 1 : diagonal;
+#endif
+    }
+}
+
+// Adds scale*D u at one plane to result
+template<class Real>
+inline void addSecondDifference(int lanes, const Real *__restrict u, const Real *__restrict um,
+                                const Real *__restrict up, const Real *__restrict g,
+                                const Real *__restrict gm, const Real *__restrict gp,
+                                const Real *__restrict c, const Real *__restrict cm,
+                                const Real *__restrict cp, Real scale, Real *__restrict result)
+{
+#pragma clang loop vectorize(enable) interleave(enable)
+    for(int l=0; l<lanes; l++) {
+        Real u0 = u[l];
+        Real g0 = g[l];
+        Real uM = um[l];
+        Real uP = up[l];
+#ifdef CONSTANTWAVESPEED
+        Real faceM = openFace(g0, gm[l]);
+        Real faceP = openFace(g0, gp[l]);
+#else
+        Real faceM = openFace(g0, gm[l])*std::max(Real(0.5)*(c[l] + cm[l]), Real(0));
+        Real faceP = openFace(g0, gp[l])*std::max(Real(0.5)*(c[l] + cp[l]), Real(0));
+#endif
+        result[l] += scale*(faceP*(uP - u0) - faceM*(u0 - uM));
+    }
+}
+
+// The correction z decays geometrically away from the ends of the line. It is cut off before
+// it reaches the subnormal range, where float arithmetic gets very slow.
+template<class Real>
+inline Real flushTiny(Real value)
+{
+    return std::fabs(value) < Real(1e-30) ? 0 : value;
+}
+
+template<class Real>
+inline void eliminateFirstPlane(int lanes, const Real *__restrict a, const Real *__restrict b,
+                                const Real *__restrict c, Real *__restrict d, Real *__restrict z,
+                                Real *__restrict cprime, Real *__restrict gamma, Real *__restrict beta)
+{
+    // gamma = -b, so the modified pivot is 2b and can not vanish
+    for(int l=0; l<lanes; l++) {
+        Real inversePivot = Real(0.5)/b[l];
+        gamma[l] = -b[l];
+        beta[l] = a[l];
+        cprime[l] = c[l]*inversePivot;
+        d[l] = d[l]*inversePivot;
+        z[l] = Real(-0.5);
+    }
+}
+
+template<class Real>
+inline void eliminatePlane(int lanes, const Real *__restrict a, const Real *__restrict b,
+                           const Real *__restrict c, Real *__restrict d, Real *__restrict z,
+                           Real *__restrict cprime, const Real *__restrict dPrevious,
+                           const Real *__restrict zPrevious, const Real *__restrict cprimePrevious)
+{
+    for(int l=0; l<lanes; l++) {
+        Real inversePivot = 1/(b[l] - a[l]*cprimePrevious[l]);
+        cprime[l] = c[l]*inversePivot;
+        d[l] = (d[l] - a[l]*dPrevious[l])*inversePivot;
+        z[l] = flushTiny(-a[l]*zPrevious[l]*inversePivot);
+    }
+}
+
+template<class Real>
+inline void eliminateLastPlane(int lanes, const Real *__restrict a, const Real *__restrict b,
+                               const Real *__restrict c, Real *__restrict d, Real *__restrict z,
+                               const Real *__restrict dPrevious, const Real *__restrict zPrevious,
+                               const Real *__restrict cprimePrevious, const Real *__restrict gamma,
+                               const Real *__restrict beta)
+{
+    // c of the last plane is the corner coupling to the first plane
+    for(int l=0; l<lanes; l++) {
+        Real inversePivot = 1/(b[l] - c[l]*beta[l]/gamma[l] - a[l]*cprimePrevious[l]);
+        d[l] = (d[l] - a[l]*dPrevious[l])*inversePivot;
+        z[l] = (c[l] - a[l]*zPrevious[l])*inversePivot;
+    }
+}
+
+template<class Real>
+inline void substitutePlane(int lanes, const Real *__restrict cprime, Real *__restrict d, Real *__restrict z,
+                            const Real *__restrict dNext, const Real *__restrict zNext)
+{
+    for(int l=0; l<lanes; l++) {
+        d[l] -= cprime[l]*dNext[l];
+        z[l] = flushTiny(z[l] - cprime[l]*zNext[l]);
+    }
+}
+
+template<class Real>
+inline void cyclicCorrection(int lanes, const Real *__restrict dFirst, const Real *__restrict zFirst,
+                             const Real *__restrict dLast, const Real *__restrict zLast,
+                             const Real *__restrict gamma, const Real *__restrict beta,
+                             Real *__restrict fact)
+{
+    for(int l=0; l<lanes; l++) {
+        Real ratio = beta[l]/gamma[l];
+        fact[l] = (dFirst[l] + ratio*dLast[l])/(1 + zFirst[l] + ratio*zLast[l]);
+    }
+}
+
+template<class Real>
+inline void correctPlane(int lanes, const Real *__restrict fact, const Real *__restrict z, Real *__restrict d)
+{
+    for(int l=0; l<lanes; l++) {
+        d[l] -= fact[l]*z[l];
+    }
+}
+
+// Solves (1 - alpha*D) x = d along lanes lines of numPlanes planes, planeStride values apart.
+// d is overwritten with x, z and cprime have the same layout and scratch holds 6*lanes values.
+template<class Real>
+void solveImplicitLines(int numPlanes, int lanes, int planeStride, const Real *g, const Real *c, const Real *walls,
+                        Real alpha, Real *d, Real *z, Real *cprime, Real *scratch)
+{
+    Real *a = scratch;
+    Real *b = a + lanes;
+    Real *cc = b + lanes;
+    Real *gamma = cc + lanes;
+    Real *beta = gamma + lanes;
+    Real *fact = beta + lanes;
+    auto plane = [&](int k) { return size_t((k + numPlanes) % numPlanes)*planeStride; };
+
+    for(int k=0; k<numPlanes; k++) {
+        size_t p = plane(k), pm = plane(k-1), pp = plane(k+1);
+        implicitCoefficients(lanes, g+p, g+pm, g+pp, c+p, c+pm, c+pp, walls+p, alpha, a, b, cc);
+        if(k == 0) {
+            eliminateFirstPlane(lanes, a, b, cc, d+p, z+p, cprime+p, gamma, beta);
+        } else if(k == numPlanes-1) {
+            eliminateLastPlane(lanes, a, b, cc, d+p, z+p, d+pm, z+pm, cprime+pm, gamma, beta);
+        } else {
+            eliminatePlane(lanes, a, b, cc, d+p, z+p, cprime+p, d+pm, z+pm, cprime+pm);
+        }
+    }
+    for(int k=numPlanes-2; k>=0; k--) {
+        size_t p = plane(k), pp = plane(k+1);
+        substitutePlane(lanes, cprime+p, d+p, z+p, d+pp, z+pp);
+    }
+    size_t last = plane(numPlanes-1);
+    cyclicCorrection(lanes, d, z, d+last, z+last, gamma, beta, fact);
+    for(int k=0; k<numPlanes; k++) {
+        size_t p = plane(k);
+        correctPlane(lanes, fact, z+p, d+p);
+    }
+}
+}
 
 WaveSolver::WaveSolver() :
+    m_solutionMeshDirty(true),
+    m_computePrecision(ComputePrecision::Float),
+    m_stencilOrder(StencilOrder::Second),
+    m_timeIntegrator(TimeIntegrator::Leapfrog),
     m_dampingFactor(0),
-    m_gridSize(0),
-    m_dr(0),
-    m_rMin(-1),
-    m_rMax(1),
-    m_length(2),
-    m_averageValue(0.0)
+    m_nx(0),
+    m_ny(0),
+    m_dx(0),
+    m_dy(0),
+    m_xMin(-1),
+    m_xMax(1),
+    m_yMin(-1),
+    m_yMax(1),
+    m_time(0),
+    m_dropKernelStandardDeviation(0),
+    m_dropKernelDx(0),
+    m_dropKernelDy(0),
+    m_dropKernelRadiusI(0),
+    m_dropKernelRadiusJ(0),
+    m_spongeWidth(0),
+    m_spongeMaxDamping(0),
+    m_monitorsEnabled(false),
+    m_monitors()
 {
     m_ground.setGridType(GridType::Ground);
     m_solution.setGridType(GridType::Water);
 
-    m_rMin = -5;
-    m_rMax = 5;
-    float length = m_rMax-m_rMin;
-    setLength(length);
-    setGridSize(256);
+    setDomain(-5, 5, -5, 5);
+    setGridSize(256, 256);
+    reset();
+}
 
+void WaveSolver::reset()
+{
     float x0 = 0;
     float y0 = -1.5;
     float amplitude = 10.0;
     float standardDeviation = 0.1;
     double maxValue = 0;
     applyAction([&](int i, int j) {
-        float x = m_rMin+i*m_dr;
-        float y = m_rMin+j*m_dr;
-
-        m_solutionPrevious(i,j) = exp(-(pow(x - x0,2)+pow(y - y0,2))/(2*standardDeviation*standardDeviation));
-        m_solution(i,j) = m_solutionPrevious(i,j);
+        float x = m_xMin+i*m_dx;
+        float y = m_yMin+j*m_dy;
 
-        maxValue = std::max(maxValue,fabs(m_solution(i,j)));
+        maxValue = std::max(maxValue, exp(-(pow(x - x0,2)+pow(y - y0,2))/(2*standardDeviation*standardDeviation)));
     });
 
-    applyAction([&](int i, int j) {
-        m_solutionPrevious(i,j) *= amplitude/std::max(maxValue, 1.0);
-        m_solution(i,j) *= amplitude/std::max(maxValue, 1.0);
-        m_ground(i,j) = -1;
+    std::vector<float> row(m_ny);
+    for(int i=0; i<m_nx; i++) {
+        for(int j=0; j<m_ny; j++) {
+            float x = m_xMin+i*m_dx;
+            float y = m_yMin+j*m_dy;
+            row[j] = amplitude/std::max(maxValue, 1.0)*exp(-(pow(x - x0,2)+pow(y - y0,2))/(2*standardDeviation*standardDeviation));
+        }
+        m_solutionPreviousField.storeRow(i, &row[0]);
+        m_solutionField.storeRow(i, &row[0]);
+    }
+    m_wallsField.fill(0);
+    m_time = 0;
+
+    m_ground.for_each([&](CPPoint &p) {
+        p.position.setZ(-1);
     });
 
     // m_ground.createPerlin(15, 0.8, 10.0, -0.45);
     m_ground.createDoubleSlit();
     // m_ground.createLand();
     // m_ground.createSinus();
+    updateGroundField();
+}
 
-    // calculateWalls();
+void WaveSolver::setGroundType(GroundType type, unsigned int seed)
+{
+    // Replaces the ground with one of the terrain generators, the solution is kept
+    switch(type) {
+    case GroundType::Slope: m_ground.createLand(); break;
+    case GroundType::PerlinNoise: m_ground.createPerlin(seed, 0.8, 10.0, -0.45); break;
+    case GroundType::Channel: m_ground.createSinus(); break;
+    default: m_ground.createDoubleSlit(); break;
+    }
+    updateGroundField();
 }
 
 float WaveSolver::averageValue() const
 {
-    return m_averageValue;
+    return m_monitors.meanLevel;
+}
+
+
+float WaveSolver::dx() const
+{
+    return m_dx;
 }
 
+float WaveSolver::dy() const
+{
+    return m_dy;
+}
 
-float WaveSolver::dr() const
+float WaveSolver::xMin() const
 {
-    return m_dr;
+    return m_xMin;
+}
+
+float WaveSolver::xMax() const
+{
+    return m_xMax;
+}
+
+float WaveSolver::yMin() const
+{
+    return m_yMin;
+}
+
+float WaveSolver::yMax() const
+{
+    return m_yMax;
 }
 
 
@@ -74,277 +743,1261 @@ CPGrid &WaveSolver::ground()
 
 CPGrid &WaveSolver::solution()
 {
+    if(m_solutionMeshDirty) {
+        updateSolutionMesh();
+    }
     return m_solution;
 }
 
+CPField &WaveSolver::solutionField()
+{
+    return m_solutionField;
+}
+
+const CPField &WaveSolver::solutionField() const
+{
+    return m_solutionField;
+}
+
+const CPField &WaveSolver::groundField() const
+{
+    return m_groundField;
+}
+
+const CPField &WaveSolver::wallsField() const
+{
+    return m_wallsField;
+}
+
+const CPField &WaveSolver::waveSpeedField() const
+{
+    return m_waveSpeedField;
+}
+
+float WaveSolver::dampingFactor() const
+{
+    return m_dampingFactor;
+}
+
+void WaveSolver::setDampingFactor(float dampingFactor)
+{
+    m_dampingFactor = dampingFactor;
+}
 
 CPBox &WaveSolver::box()
 {
     return m_box;
 }
 
-void WaveSolver::calculateWalls()
+FieldStorage WaveSolver::fieldStorage() const
 {
-    return;
+    return m_solutionField.storage();
+}
 
-    calculateMean();
-    for(unsigned int i=0;i<gridSize();i++) {
-        for(unsigned int j=0;j<gridSize();j++) {
-            int oldValue = m_walls(i,j);
-            // m_walls(i,j) = m_ground(i,j) > m_solution(i,j);
+void WaveSolver::setFieldStorage(FieldStorage storage)
+{
+    m_solutionField.setStorage(storage);
+    m_solutionPreviousField.setStorage(storage);
+    m_solutionNextField.setStorage(storage);
+}
 
-            // m_walls(i,j) = m_ground(i,j) >= m_solution(i,j);// || i==0 || j==0 || i==gridSize()-1 || j==gridSize()-1;
-            m_walls(i,j) = true;
-            if(!m_walls(i+1,j) && m_ground(i,j) < m_solution(i+1,j)) m_walls(i,j) = false;
-            if(!m_walls(i-1,j) && m_ground(i,j) < m_solution(i-1,j)) m_walls(i,j) = false;
-            if(!m_walls(i,j+1) && m_ground(i,j) < m_solution(i,j+1)) m_walls(i,j) = false;
-            if(!m_walls(i,j-1) && m_ground(i,j) < m_solution(i,j-1)) m_walls(i,j) = false;
+FieldLayout WaveSolver::fieldLayout() const
+{
+    return m_solutionField.layout();
+}
 
-            // m_walls(i,j) = m_ground(i,j) > m_solution(i+1,j) && m_ground(i,j) > m_solution(i-1,j) && m_ground(i,j) > m_solution(i,j-1) && m_ground(i,j) > m_solution(i,j+1);
+void WaveSolver::setFieldLayout(FieldLayout layout)
+{
+    CPField *fields[] = {&m_solutionField, &m_solutionNextField, &m_solutionPreviousField, &m_groundField,
+                         &m_wallsField, &m_waveSpeedField};
+    for(CPField *field : fields) {
+        field->setLayout(layout);
+    }
+}
 
-            if(!m_walls(i,j) && m_walls(i,j) != oldValue) {
-                m_solutionPrevious(i,j) = m_solution(i,j) = m_ground(i,j)+0.01;
-            }
+ComputePrecision WaveSolver::computePrecision() const
+{
+    return m_computePrecision;
+}
 
-            if(m_walls(i,j) && m_walls(i,j) != oldValue) {
-                // m_solutionPrevious(i,j) = m_solution(i,j) = m_averageValue;
-            }
+void WaveSolver::setComputePrecision(ComputePrecision precision)
+{
+    m_computePrecision = precision;
+}
+
+StencilOrder WaveSolver::stencilOrder() const
+{
+    return m_stencilOrder;
+}
+
+void WaveSolver::setStencilOrder(StencilOrder order)
+{
+    m_stencilOrder = order;
+}
+
+int WaveSolver::stencilRadius() const
+{
+    return int(m_stencilOrder)/2;
+}
+
+double WaveSolver::stencilStabilityLimit() const
+{
+    // 2/sqrt(lambda), where lambda is the largest eigenvalue of the 1D second derivative
+    // stencil (4, 16/3 and 272/45). The leapfrog step is stable for
+    // c*dt*sqrt(1/dx^2 + 1/dy^2) below this.
+    switch(m_stencilOrder) {
+    case StencilOrder::Fourth: return 2/sqrt(16.0/3);
+    case StencilOrder::Sixth: return 2/sqrt(272.0/45);
+    default: return 1;
+    }
+}
+
+TimeIntegrator WaveSolver::timeIntegrator() const
+{
+    return m_timeIntegrator;
+}
+
+void WaveSolver::setTimeIntegrator(TimeIntegrator integrator)
+{
+    m_timeIntegrator = integrator;
+    if(integrator == TimeIntegrator::Leapfrog) {
+        std::vector<unsigned char>().swap(m_implicitWorkspace);
+    }
+}
+
+double WaveSolver::phaseSpeedError(double dt, double pointsPerWavelength) const
+{
+    // Relative error in the phase speed of a plane wave along x with c = 1, from the discrete
+    // dispersion relation. mu is dt^2 times the eigenvalue of the stencil for the wave, the
+    // leapfrog step has sin^2(omega dt/2) = mu/4 and ADI has mu/(4 + mu). Infinite where the
+    // leapfrog step is unstable.
+    double theta = 2*M_PI/pointsPerWavelength;
+    int radius = m_timeIntegrator == TimeIntegrator::ADI ? 1 : stencilRadius();
+    double symbol = 0;
+    for(int k=0; k<=radius; k++) {
+        double weight = radius == 3 ? secondDerivativeWeight<3>(k)
+                      : radius == 2 ? secondDerivativeWeight<2>(k) : secondDerivativeWeight<1>(k);
+        symbol -= (k == 0 ? 1 : 2*cos(k*theta))*weight;
+    }
+    double mu = dt*dt/(double(m_dx)*m_dx)*symbol;
+    double sinSquared = m_timeIntegrator == TimeIntegrator::ADI ? mu/(4 + mu) : mu/4;
+    if(sinSquared > 1) return INFINITY;
+    double omega = 2*asin(sqrt(sinSquared))/dt;
+    double k = theta/m_dx;
+    return omega/k - 1;
+}
+
+size_t WaveSolver::memoryUsage() const
+{
+    return m_solutionField.memoryUsage() + m_solutionPreviousField.memoryUsage() + m_solutionNextField.memoryUsage()
+            + m_groundField.memoryUsage() + m_wallsField.memoryUsage()
+            + m_waveSpeedField.memoryUsage() + m_dry.size() + m_dryCellsInRow.size()*sizeof(int)
+            + (m_frontPosition.size() + m_frontCells.capacity())*sizeof(int) + m_implicitWorkspace.size();
+}
+
+void WaveSolver::updateSolutionMesh()
+{
+    // Copy the heights into the render mesh and let it know which tiles contain water
+    std::vector<CPPoint> &vertices = m_solution.vertices();
+    std::vector<float> row(m_ny);
+    m_solution.resetTiles();
+    for(int i=0; i<m_nx; i++) {
+        m_solutionField.loadRow(i, &row[0]);
+        for(int j=0; j<m_ny; j++) {
+            int index = m_solution.index(i,j);
+            vertices[index].position.setZ(row[j]);
+            m_solution.updateTile(i, j, row[j], !m_dry[m_solutionField.index(i,j)]);
         }
     }
+    m_solutionMeshDirty = false;
 }
 
-void WaveSolver::calculateMean()
+void WaveSolver::updateGroundField()
 {
-    m_averageValue = 0;
-    unsigned int count = 0;
-    for(unsigned int i=0;i<gridSize();i++) {
-        for(unsigned int j=0;j<gridSize();j++) {
-            if(!m_walls(i,j)) {
-                m_averageValue += m_solutionNext(i,j);
-                count++;
-            }
+    // The terrain generators work on the ground mesh, copy the result to the solver
+    std::vector<CPPoint> &vertices = m_ground.vertices();
+    for(int i=0; i<m_nx; i++) {
+        for(int j=0; j<m_ny; j++) {
+            m_groundField.setValue(i, j, vertices[m_ground.index(i,j)].position.z());
         }
     }
+    updateWaveSpeed();
+    updateDryCells();
+}
 
-    m_averageValue /= count;
+void WaveSolver::updateGroundMesh()
+{
+    std::vector<CPPoint> &vertices = m_ground.vertices();
+    for(int i=0; i<m_nx; i++) {
+        for(int j=0; j<m_ny; j++) {
+            vertices[m_ground.index(i,j)].position.setZ(m_groundField.value(i,j));
+        }
+    }
+    m_ground.updateTilesFromGrid();
+    m_ground.calculateNormals();
 }
 
-void WaveSolver::setGridSize(int gridSize)
+void WaveSolver::updateWaveSpeed()
 {
-    m_solution.resize(gridSize, m_rMin, m_rMax);
-    m_solutionNext.resize(gridSize, m_rMin, m_rMax);
-    m_solutionPrevious.resize(gridSize, m_rMin, m_rMax);
-    m_walls.resize(gridSize, m_rMin, m_rMax);
-    m_ground.resize(gridSize, m_rMin, m_rMax);
-    m_source.resize(gridSize, m_rMin, m_rMax);
-    m_gridSize = gridSize;
-    m_dr = m_length / (gridSize-1);
+    // The ground and walls are static, so the wave speed is only computed when they change
+    for(int i=0; i<m_nx; i++) {
+        for(int j=0; j<m_ny; j++) {
+            m_waveSpeedField.setValue(i, j, calcC(i,j));
+        }
+    }
 }
 
-void WaveSolver::applySmoothing() {
-    return;
-    float maxDiff = 0;
-    m_solution.for_each([&](CPPoint &p, int i, int j) {
-        if(m_walls(i,j)) return;
+void WaveSolver::updateDryCells()
+{
+    std::vector<float> solutionRow(m_ny);
+    std::vector<float> groundRow(m_ny);
+    for(int i=0; i<m_nx; i++) {
+        m_solutionField.loadRow(i, &solutionRow[0]);
+        m_groundField.loadRow(i, &groundRow[0]);
+        m_dryCellsInRow[i] = 0;
+        for(int j=0; j<m_ny; j++) {
+            bool dry = groundRow[j] > solutionRow[j];
+            m_dry[m_solutionField.index(i,j)] = dry;
+            m_dryCellsInRow[i] += dry;
+        }
+    }
 
-        float diff = 0;
-        if(!m_walls(i+1,j)) diff = std::max(diff, p.position.z() - m_solution(i+1,j));
-        if(!m_walls(i-1,j)) diff = std::max(diff, p.position.z() - m_solution(i-1,j));
-        if(!m_walls(i,j+1)) diff = std::max(diff, p.position.z() - m_solution(i,j+1));
-        if(!m_walls(i,j-1)) diff = std::max(diff, p.position.z() - m_solution(i,j-1));
+    // The front is rebuilt from scratch here, the steps update it from the changed cells
+    m_frontCells.clear();
+    m_frontPosition.assign(m_dry.size(), -1);
+    for(int i=0; i<m_nx; i++) {
+        m_changedDryCells[i].clear();
+        for(int j=0; j<m_ny; j++) {
+            updateFrontCell(i, j);
+        }
+    }
+    m_solutionMeshDirty = true;
+}
 
-        float diffDividedByDr = diff/m_dr;
-        if(diffDividedByDr > 8) {
-            float correctionFactor = 8/diffDividedByDr;
-            p.position[2] *= correctionFactor;
-            qDebug() << "Corrected a value.";
+void WaveSolver::updateFront()
+{
+    // Only a cell that changed state, or one of its neighbours, can join or leave the front
+    for(int i=0; i<m_nx; i++) {
+        for(int j : m_changedDryCells[i]) {
+            updateFrontCell(i, j);
+            updateFrontCell(m_solutionField.idxI(i-1), j);
+            updateFrontCell(m_solutionField.idxI(i+1), j);
+            updateFrontCell(i, m_solutionField.idxJ(j-1));
+            updateFrontCell(i, m_solutionField.idxJ(j+1));
         }
+        m_changedDryCells[i].clear();
+    }
+}
 
-        maxDiff = std::max(maxDiff, diffDividedByDr);
+void WaveSolver::updateFrontCell(int i, int j)
+{
+    // A front cell has a neighbour in the other state. Cells leave the list by swapping in the
+    // last one.
+    int cell = m_solutionField.index(i,j);
+    unsigned char dry = m_dry[cell];
+    bool front = dry != m_dry[m_solutionField.index(m_solutionField.idxI(i-1), j)]
+              || dry != m_dry[m_solutionField.index(m_solutionField.idxI(i+1), j)]
+              || dry != m_dry[m_solutionField.index(i, m_solutionField.idxJ(j-1))]
+              || dry != m_dry[m_solutionField.index(i, m_solutionField.idxJ(j+1))];
+    int &position = m_frontPosition[cell];
+    if(front && position < 0) {
+        position = m_frontCells.size();
+        m_frontCells.push_back(cell);
+    } else if(!front && position >= 0) {
+        int last = m_frontCells.back();
+        m_frontCells[position] = last;
+        m_frontPosition[last] = position;
+        m_frontCells.pop_back();
+        position = -1;
+    }
+}
+
+const std::vector<int> &WaveSolver::frontCells() const
+{
+    return m_frontCells;
+}
+
+void WaveSolver::setGridSize(int nx, int ny)
+{
+    CPField *fields[] = {&m_solutionField, &m_solutionNextField, &m_solutionPreviousField, &m_groundField,
+                         &m_wallsField, &m_waveSpeedField};
+    for(CPField *field : fields) {
+        field->resize(nx, ny);
+    }
+    m_dry.assign(nx*ny, false);
+    m_dryCellsInRow.assign(nx, 0);
+    m_changedDryCells.assign(nx, std::vector<int>());
+    m_frontPosition.assign(nx*ny, -1);
+    m_frontCells.clear();
+    m_monitorRows.assign(size_t(nx)*numMonitorSums, 0);
+    m_solution.resize(nx, ny, m_xMin, m_xMax, m_yMin, m_yMax);
+    m_ground.resize(nx, ny, m_xMin, m_xMax, m_yMin, m_yMax);
+    m_nx = nx;
+    m_ny = ny;
+    m_dx = (m_xMax - m_xMin) / (nx-1);
+    m_dy = (m_yMax - m_yMin) / (ny-1);
+    m_solutionMeshDirty = true;
+    for(WaveSource &source : m_sources) {
+        source.rasterize(m_nx, m_ny, m_xMin, m_yMin, m_dx, m_dy);
+    }
+}
+
+void WaveSolver::resample(int nx, int ny)
+{
+    // The grid points keep their world positions at any resolution, so u, u_prev and the ground
+    // are interpolated bilinearly between the old points and the walls taken from the nearest
+    // one. The time, the sources and the physical width of the sponge layer are kept.
+    if(nx == m_nx && ny == m_ny) return;
+    int oldNx = m_nx;
+    int oldNy = m_ny;
+    // The old fields are copied in their own storage and interpolated in double, so a Float64
+    // run keeps its precision
+    CPField *fields[] = {&m_solutionField, &m_solutionPreviousField, &m_groundField, &m_wallsField};
+    const int numFields = 4;
+    CPField oldFields[numFields] = {*fields[0], *fields[1], *fields[2], *fields[3]};
+    setGridSize(nx, ny);
+
+    std::vector<int> oldJ(ny);
+    std::vector<double> weightJ(ny);
+    for(int j=0; j<ny; j++) {
+        double fj = j*double(oldNy - 1)/(ny - 1);
+        oldJ[j] = std::min(int(fj), oldNy - 2);
+        weightJ[j] = fj - oldJ[j];
+    }
+    CPThreadPool::instance().parallelFor(0, nx, [&](int iBegin, int iEnd) {
+        std::vector<double> row0(oldNy);
+        std::vector<double> row1(oldNy);
+        std::vector<double> row(ny);
+        for(int i=iBegin; i<iEnd; i++) {
+            double fi = i*double(oldNx - 1)/(nx - 1);
+            int i0 = std::min(int(fi), oldNx - 2);
+            double ti = fi - i0;
+            for(int field=0; field<numFields; field++) {
+                oldFields[field].loadRow(i0, &row0[0]);
+                oldFields[field].loadRow(i0 + 1, &row1[0]);
+                for(int j=0; j<ny; j++) {
+                    int j0 = oldJ[j];
+                    double tj = weightJ[j];
+                    if(fields[field] == &m_wallsField) {
+                        row[j] = (ti < 0.5 ? row0 : row1)[tj < 0.5 ? j0 : j0 + 1];
+                    } else {
+                        row[j] = (1 - ti)*((1 - tj)*row0[j0] + tj*row0[j0+1]) + ti*((1 - tj)*row1[j0] + tj*row1[j0+1]);
+                    }
+                }
+                fields[field]->storeRow(i, &row[0]);
+            }
+        }
     });
+
+    if(m_spongeWidth > 0) {
+        setSpongeLayer(std::max(1, int(round(m_spongeWidth*double(nx - 1)/(oldNx - 1)))), m_spongeMaxDamping);
+    }
+    updateGroundMesh();
+    updateWaveSpeed();
+    updateDryCells();
+}
+
+void WaveSolver::setDomain(float xMin, float xMax, float yMin, float yMax)
+{
+    // The meshes keep their vertex positions until the next setGridSize
+    m_xMin = xMin;
+    m_xMax = xMax;
+    m_yMin = yMin;
+    m_yMax = yMax;
+    m_dx = (m_xMax - m_xMin) / (m_nx-1);
+    m_dy = (m_yMax - m_yMin) / (m_ny-1);
+    for(WaveSource &source : m_sources) {
+        source.rasterize(m_nx, m_ny, m_xMin, m_yMin, m_dx, m_dy);
+    }
+    float lengthX = m_xMax - m_xMin;
+    float lengthY = m_yMax - m_yMin;
+    m_box.update(QVector3D(-lengthX/2, -lengthY/2, -0.2), QVector3D(lengthX, lengthY, 0.4));
+}
+
+void WaveSolver::setSpongeLayer(int width, float maxDamping)
+{
+    // Quadratic damping profile, maxDamping in the edge cells and falling to zero at the
+    // inner edge of the layer so that the layer itself reflects as little as possible
+    m_spongeWidth = std::max(width, 0);
+    m_spongeMaxDamping = maxDamping;
+    m_spongeDamping.resize(m_spongeWidth);
+    m_spongeFactor.resize(m_spongeWidth);
+    m_spongeFactor2.resize(m_spongeWidth);
+    for(int distance=0; distance<m_spongeWidth; distance++) {
+        float depth = float(m_spongeWidth - distance)/m_spongeWidth;
+        m_spongeDamping[distance] = maxDamping*depth*depth;
+    }
+}
+
+int WaveSolver::spongeWidth() const
+{
+    return m_spongeWidth;
 }
 
-void WaveSolver::setLength(float length)
+float WaveSolver::spongeMaxDamping() const
 {
-    m_length = length;
-    m_dr = m_length / (gridSize()-1);
-    m_box.update(QVector3D(-m_length/2, -m_length/2, -0.2), QVector3D(m_length, m_length, 0.4));
+    return m_spongeMaxDamping;
 }
 
 void WaveSolver::applyAction(std::function<void(int i, int j)> action) {
-    for(unsigned int i=0; i<gridSize(); i++) {
-        for(unsigned int j=0; j<gridSize(); j++) {
+    for(int i=0; i<m_nx; i++) {
+        for(int j=0; j<m_ny; j++) {
             action(i,j);
         }
     }
 }
 
-void WaveSolver::applyAction(std::function<void(int i, int j, int gridSize)> action) {
-    for(unsigned int i=0; i<gridSize(); i++) {
-        for(unsigned int j=0; j<gridSize(); j++) {
-            action(i,j, gridSize());
+void WaveSolver::applyAction(std::function<void(int i, int j, int nx, int ny)> action) {
+    for(int i=0; i<m_nx; i++) {
+        for(int j=0; j<m_ny; j++) {
+            action(i,j, m_nx, m_ny);
         }
     }
 }
 
-void WaveSolver::createRandomGauss() {
-    qDebug() << "Actually creating random gauss";
-    double x0 = m_rMin + (m_rMax-m_rMin)*rand()/(double)RAND_MAX;
-    double y0 = m_rMin + (m_rMax-m_rMin)*rand()/(double)RAND_MAX;
-    double stddev = 0.2;
-    float amplitude = 0.5;
-    applyAction([&](int i, int j) {
-        float x = m_rMin + i*m_dr; 					// The x- and y-center can have an offset
-        float y = m_rMin + j*m_dr;
+double WaveSolver::time() const
+{
+    return m_time;
+}
 
-        m_solutionPrevious (i,j) += amplitude*exp(-(pow(x-x0,2)+pow(y-y0,2))/(2*stddev*stddev));
-        m_solution(i,j)          += amplitude*exp(-(pow(x-x0,2)+pow(y-y0,2))/(2*stddev*stddev));
-    });
+void WaveSolver::addSource(const WaveSource &source)
+{
+    m_sources.push_back(source);
+    m_sources.back().rasterize(m_nx, m_ny, m_xMin, m_yMin, m_dx, m_dy);
 }
 
-void WaveSolver::step(float dt)
+void WaveSolver::clearSources()
 {
-    float factor = 1.0/(1+0.5*m_dampingFactor*dt);
-    float factor2 = -(1.0-0.5*m_dampingFactor*dt);
-    float dtdtOverdrdr = dt*dt/(m_dr*m_dr);
+    m_sources.clear();
+}
 
-    CPTimer::temp().start();
-    for(unsigned int i=0;i<gridSize();i++) {
-#pragma clang loop vectorize(enable) interleave(enable)
-        for(unsigned int j=0;j<gridSize();j++) {
-#ifdef CONSTANTWAVESPEED
-            float ddx = solution(i,j,1,0) + solution(i,j,-1,0) - 2*m_solution(i,j);
-            float ddy = solution(i,j,0,1) + solution(i,j,0,-1) - 2*m_solution(i,j);
+const std::vector<WaveSource> &WaveSolver::sources() const
+{
+    return m_sources;
+}
 
-            float ddt_rest = factor2*m_solutionPrevious(i,j) + 2*m_solution(i,j);
+void WaveSolver::createRandomGauss() {
+    float x0 = m_xMin + (m_xMax-m_xMin)*rand()/(double)RAND_MAX;
+    float y0 = m_yMin + (m_yMax-m_yMin)*rand()/(double)RAND_MAX;
+    addDrop(x0, y0);
+}
 
-            // Set value to zero if we have a wall.
-            m_solutionNext(i,j) = factor*(dtdtOverdrdr*(ddx + ddy) + ddt_rest + m_source(i,j));
-#else
-            float c = calcC(i,j); // wave speed
+void WaveSolver::addDrop(float x, float y, float amplitude, float standardDeviation)
+{
+    std::lock_guard<std::mutex> lock(m_dropsMutex);
+    m_queuedDrops.push_back({x, y, amplitude, standardDeviation});
+}
 
-            float cx_m = 0.5*(c+calcC(i-1,j)); 	// Calculate the 4 c's we need. We need c_{i \pm 1/2,j} and c_{i,j \pm 1/2}
-            float cx_p = 0.5*(c+calcC(i+1,j));
-            float cy_m = 0.5*(c+calcC(i,j-1));
-            float cy_p = 0.5*(c+calcC(i,j+1));
+void WaveSolver::addDrops(const std::vector<Drop> &drops)
+{
+    std::lock_guard<std::mutex> lock(m_dropsMutex);
+    m_queuedDrops.insert(m_queuedDrops.end(), drops.begin(), drops.end());
+}
 
-            float ddx = cx_p*( solution(i,j,1,0)   - m_solution(i,j)) - cx_m*( m_solution(i,j) - solution(i,j,-1,0) );
-            float ddy = cy_p*( solution(i,j,0,1)   - m_solution(i,j)) - cy_m*( m_solution(i,j) - solution(i,j,0,-1) );
-            float ddt_rest = factor2*m_solutionPrevious(i,j) + 2*m_solution(i,j);
+void WaveSolver::updateDropKernel(float standardDeviation)
+{
+    if(standardDeviation == m_dropKernelStandardDeviation && m_dx == m_dropKernelDx && m_dy == m_dropKernelDy) return;
+
+    // Unit Gaussian sampled on the grid and truncated at 4 standard deviations, where it
+    // has fallen below 4e-4
+    int radiusI = ceil(4*standardDeviation/m_dx);
+    int radiusJ = ceil(4*standardDeviation/m_dy);
+    int width = 2*radiusJ + 1;
+    m_dropKernel.resize((2*radiusI + 1)*width);
+    for(int di=-radiusI; di<=radiusI; di++) {
+        for(int dj=-radiusJ; dj<=radiusJ; dj++) {
+            float rr = di*di*m_dx*m_dx + dj*dj*m_dy*m_dy;
+            m_dropKernel[(di+radiusI)*width + dj+radiusJ] = exp(-rr/(2*standardDeviation*standardDeviation));
+        }
+    }
+    m_dropKernelRadiusI = radiusI;
+    m_dropKernelRadiusJ = radiusJ;
+    m_dropKernelStandardDeviation = standardDeviation;
+    m_dropKernelDx = m_dx;
+    m_dropKernelDy = m_dy;
+}
 
-            m_solutionNext(i,j) = m_walls(i,j) ? 0 : factor*(dtdtOverdrdr*(ddx + ddy) + ddt_rest + m_source(i,j));
-#endif
+void WaveSolver::applyDrops()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_dropsMutex);
+        if(m_queuedDrops.empty()) return;
+        m_drops.swap(m_queuedDrops);
+    }
+
+    // Each drop is centered on the closest grid point and only touches the cells under its
+    // kernel, wrapped around the periodic boundaries. A kernel row is added to u and u_prev as
+    // segments of double values, split where the row wraps past the edge, so every storage
+    // type keeps its precision.
+    CPField *fields[] = {&m_solutionField, &m_solutionPreviousField};
+    std::vector<double> segment;
+    for(const Drop &drop : m_drops) {
+        updateDropKernel(drop.standardDeviation);
+        int radiusI = m_dropKernelRadiusI;
+        int radiusJ = m_dropKernelRadiusJ;
+        int width = 2*radiusJ + 1;
+        int i0 = round((drop.x - m_xMin)/m_dx);
+        int j0 = round((drop.y - m_yMin)/m_dy);
+        segment.resize(width);
+        for(int di=-radiusI; di<=radiusI; di++) {
+            int i = m_solutionField.idxI(i0 + di);
+            const float *kernelRow = &m_dropKernel[(di+radiusI)*width];
+            for(int k=0; k<width; ) {
+                int j = m_solutionField.idxJ(j0 - radiusJ + k);
+                int count = std::min(width - k, m_ny - j);
+                for(CPField *field : fields) {
+                    field->loadRowSegment(i, j, count, &segment[0]);
+                    for(int n=0; n<count; n++) {
+                        segment[n] += double(drop.amplitude)*kernelRow[k + n];
+                    }
+                    field->storeRowSegment(i, j, count, &segment[0]);
+                }
+                k += count;
+            }
         }
     }
+    m_drops.clear();
+    m_solutionMeshDirty = true;
+}
 
-    CPTimer::temp().stop();
+void WaveSolver::copySolution(float *values)
+{
+    for(int i=0; i<m_nx; i++) {
+        m_solutionField.loadRow(i, values + i*m_ny);
+    }
+}
 
-    CPTimer::copyData().start();
-    m_solutionPrevious.swapWithGrid(m_solution);
-    m_solution.swapWithGrid(m_solutionNext);
-    CPTimer::copyData().stop();
+void WaveSolver::setSolution(const float *values, const float *previousValues)
+{
+    for(int i=0; i<m_nx; i++) {
+        m_solutionField.storeRow(i, values + i*m_ny);
+        m_solutionPreviousField.storeRow(i, previousValues + i*m_ny);
+    }
+    updateDryCells();
+}
 
-    applyAction([&](int i, int j) {
-        if(m_ground(i,j) > m_solution(i,j)) {
-            m_solution(i,j) = m_ground(i,j)-0.01;
-            m_solutionPrevious(i,j) = m_ground(i,j)-0.001;
-        }
-    });
+void WaveSolver::saveState(SolverState &state) const
+{
+    // A copy of the packed fields, so the state keeps their storage and precision. The copies
+    // reuse the memory of the previous state.
+    state.solution = m_solutionField;
+    state.previousSolution = m_solutionPreviousField;
+    state.time = m_time;
+}
 
-    // calculateWalls();
+void WaveSolver::restoreState(const SolverState &state, double timestepRatio)
+{
+    // u_prev belongs to the time step the state was saved with. For another step it is moved
+    // along the line through u_prev and u, which keeps the first time derivative. The rows go
+    // through double, which holds every storage type exactly.
+    std::vector<double> solutionRow(m_ny);
+    std::vector<double> previousRow(m_ny);
+    for(int i=0; i<m_nx; i++) {
+        state.solution.loadRow(i, &solutionRow[0]);
+        state.previousSolution.loadRow(i, &previousRow[0]);
+        if(timestepRatio != 1) {
+            for(int j=0; j<m_ny; j++) {
+                previousRow[j] = solutionRow[j] - timestepRatio*(solutionRow[j] - previousRow[j]);
+            }
+        }
+        m_solutionField.storeRow(i, &solutionRow[0]);
+        m_solutionPreviousField.storeRow(i, &previousRow[0]);
+    }
+    updateDryCells();
+    m_time = state.time;
+    m_solutionMeshDirty = true;
+}
 
-    // applySmoothing();
+void WaveSolver::setGround(const float *values)
+{
+    for(int i=0; i<m_nx; i++) {
+        m_groundField.storeRow(i, values + i*m_ny);
+    }
+    updateGroundMesh();
+    updateWaveSpeed();
+    updateDryCells();
 }
 
-#if defined(__ARM_NEON)
-void WaveSolver::stepSIMD(float dt)
+bool WaveSolver::saveCheckpoint(QString filename)
 {
-    m_solution.updateZFromGrid();
-    m_solutionPrevious.updateZFromGrid();
-    const float factor_ = 1.0/(1+0.5*m_dampingFactor*dt);
-    const float factor2_ = -(1.0-0.5*m_dampingFactor*dt);
-    float32_t factor = factor_;
-    float32_t factor2 = factor2_;
-    float32_t dtdtOverdrdr = dt*dt/(m_dr*m_dr);
+    // Written to a temporary file that replaces the old checkpoint once complete, so a run
+    // that is killed while writing still leaves the previous checkpoint intact.
+    QString temporaryFilename = filename + ".tmp";
+    QFile file(temporaryFilename);
+    if(!file.open(QFile::ReadWrite | QFile::Truncate)) {
+        qDebug() << "Warning, could not open checkpoint " << temporaryFilename << ": " << file.errorString();
+        return false;
+    }
 
-    // ONE SIMD LOOP ------------------------------------------------------------------------
-    float32_t *nextSol = &m_solutionNext[m_solutionNext.index(1,1)];
-    float *pSol = &m_solution[m_solution.index(1,1)];
-    float *pPrevSol = &m_solutionPrevious[m_solutionPrevious.index(1,1)];
-    float *pSolDxp = &m_solution[m_solution.index(2,1)];
-    float *pSolDxn = &m_solution[m_solution.index(0,1)];
-    float *pSolDyp = &m_solution[m_solution.index(1,2)];
-    float *pSolDyn = &m_solution[m_solution.index(1,0)];
+    // A Float64 run keeps its full precision across a restart
+    quint32 solutionValueSize = m_solutionField.storage() == FieldStorage::Float64 ? sizeof(double) : sizeof(float);
+    qint64 numValues = qint64(m_nx)*m_ny;
+    qint64 fileSize = sizeof(CheckpointHeader) + 2*numValues*solutionValueSize
+            + (checkpointNumFields - 2)*numValues*sizeof(float);
+    uchar *data = file.resize(fileSize) ? file.map(0, fileSize) : 0;
+    if(!data) {
+        qDebug() << "Warning, could not map checkpoint " << temporaryFilename << ": " << file.errorString();
+        return false;
+    }
 
-    // This for loop skips the first row (i=0) and the last (i=gridSize()-1) because of boundary conditions.
-    // TODO: Fix this by adding ghost rows in m_z in cpgrid.
+    CheckpointHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, checkpointMagic, sizeof(header.magic));
+    header.version = checkpointVersion;
+    header.headerSize = sizeof(CheckpointHeader);
+    header.gridSize = m_nx;
+    header.numFields = checkpointNumFields;
+    header.dr = m_dx;
+    header.length = m_xMax - m_xMin;
+    header.rMin = m_xMin;
+    header.rMax = m_xMax;
+    header.dampingFactor = m_dampingFactor;
+    header.time = m_time;
+    header.ny = m_ny;
+    header.yMin = m_yMin;
+    header.yMax = m_yMax;
+    header.solutionValueSize = solutionValueSize;
+    memcpy(data, &header, sizeof(header));
+
+    uchar *values = data + sizeof(CheckpointHeader);
+    CPField *fields[] = {&m_solutionField, &m_solutionPreviousField, &m_groundField, &m_wallsField};
+    for(int k=0; k<int(checkpointNumFields); k++) {
+        size_t valueSize = k < 2 ? solutionValueSize : sizeof(float);
+        if(const unsigned char *array = checkpointArray(*fields[k], valueSize)) {
+            memcpy(values, array, numValues*valueSize);
+            values += numValues*valueSize;
+            continue;
+        }
+        for(int i=0; i<m_nx; i++) {
+            if(valueSize == sizeof(double)) {
+                fields[k]->loadRow(i, reinterpret_cast<double*>(values));
+            } else {
+                fields[k]->loadRow(i, reinterpret_cast<float*>(values));
+            }
+            values += m_ny*valueSize;
+        }
+    }
 
-    for(unsigned int n=gridSize(); n<gridSize()*(gridSize()-1); n += 4) {
-        float32x4_t sol = vld1q_f32(pSol);       // u(i,j)
-        float32x4_t prevSol = vld1q_f32(pPrevSol);       // u_prev(i,j)
-        float32x4_t solDxp = vld1q_f32(pSolDxp);    // u(i+1,j)
-        float32x4_t solDxn = vld1q_f32(pSolDxn);   // u(i-1,j)
-        float32x4_t solDyp = vld1q_f32(pSolDyp);  // u(i,j+1)
-        float32x4_t solDyn = vld1q_f32(pSolDyn);  // u(i,j-1)
+    // The data has to be on disk before the rename replaces the old checkpoint, otherwise a
+    // crash or power loss can leave an empty or partial file under the checkpoint name
+    bool isSynced = true;
+#ifdef Q_OS_UNIX
+    isSynced = msync(data, fileSize, MS_SYNC) == 0;
+#endif
+    file.unmap(data);
+    isSynced = file.flush() && isSynced;
+#ifdef Q_OS_UNIX
+    isSynced = fsync(file.handle()) == 0 && isSynced;
+#endif
+    file.close();
+    if(!isSynced || file.error() != QFile::NoError) {
+        qDebug() << "Warning, could not write checkpoint " << temporaryFilename << ": " << file.errorString();
+        QFile::remove(temporaryFilename);
+        return false;
+    }
+    if(std::rename(temporaryFilename.toLocal8Bit().constData(), filename.toLocal8Bit().constData()) != 0) {
+        qDebug() << "Warning, could not move checkpoint to " << filename;
+        return false;
+    }
+#ifdef Q_OS_UNIX
+    // The rename itself is only durable once the directory entry is written
+    int directory = ::open(QFileInfo(filename).absolutePath().toLocal8Bit().constData(), O_RDONLY);
+    if(directory < 0 || fsync(directory) != 0) {
+        qDebug() << "Warning, could not sync the directory of checkpoint " << filename;
+    }
+    if(directory >= 0) ::close(directory);
+#endif
+    return true;
+}
 
-        float32x4_t ddx = vaddq_f32(solDxp, solDxn); // solution(i,j,1,0) + solution(i,j,-1,0);
-        float32x4_t ddy = vaddq_f32(solDyp, solDyn); // solution(i,j,0,1) + solution(i,j,0,-1) ;
-        float32x4_t ddt_rest = vmulq_n_f32(sol, 2);  // 2*m_solution(i,j);
-        ddt_rest = vmlaq_n_f32(ddt_rest, prevSol, factor2); // ddt_rest = factor2*m_solutionPrevious(i,j) + 2*m_solution(i,j);
+bool WaveSolver::loadCheckpoint(QString filename)
+{
+    QFile file(filename);
+    if(!file.open(QFile::ReadOnly)) {
+        qDebug() << "Warning, could not open checkpoint " << filename << ": " << file.errorString();
+        return false;
+    }
 
-        float32x4_t next = vaddq_f32(ddx, ddy); // ddx + ddy
-        next = vmlaq_n_f32(next, sol, -4);      // ddx + ddy - 4*m_solution(i,j)
-        next = vmulq_n_f32(next, dtdtOverdrdr); // dtdtOverdrdr*(ddx + ddy - 4*m_solution(i,j))
-        next = vaddq_f32(next, ddt_rest);       // (dtdtOverdrdr*(ddx + ddy - 4*m_solution(i,j)) + ddt_rest)
-        next = vmulq_n_f32(next, factor);       // factor*(dtdtOverdrdr*(ddx + ddy - 4*m_solution(i,j)) + ddt_rest)
+    uchar *data = file.size() >= qint64(sizeof(CheckpointHeader)) ? file.map(0, file.size()) : 0;
+    if(!data) {
+        qDebug() << "Warning, could not map checkpoint " << filename;
+        return false;
+    }
 
-        vst1q_f32(nextSol, next);
+    // Version 1 headers end before the time, version 2 headers before ny and version 3
+    // headers before the solution value size
+    CheckpointHeader header;
+    memcpy(&header, data, offsetof(CheckpointHeader, time));
+    bool isVersion1 = header.version == 1 && header.numFields == 5;
+    bool isVersion2 = header.version == 2 && header.numFields == checkpointNumFields;
+    bool isVersion3 = header.version == 3 && header.numFields == checkpointNumFields;
+    header.time = 0;
+    header.solutionValueSize = sizeof(float);
+    if(isVersion2 && file.size() >= qint64(offsetof(CheckpointHeader, ny))) {
+        memcpy(&header, data, offsetof(CheckpointHeader, ny));
+    } else if(isVersion3 && file.size() >= qint64(offsetof(CheckpointHeader, solutionValueSize))) {
+        memcpy(&header, data, offsetof(CheckpointHeader, solutionValueSize));
+    } else if(header.version == checkpointVersion) {
+        memcpy(&header, data, sizeof(header));
+    }
+    if(isVersion1 || isVersion2) {
+        header.ny = header.gridSize;
+        header.yMin = header.rMin;
+        header.yMax = header.rMax;
+    }
+    qint64 numValues = qint64(header.gridSize)*header.ny;
+    bool isCurrentVersion = header.version == checkpointVersion && header.numFields == checkpointNumFields
+            && (header.solutionValueSize == sizeof(float) || header.solutionValueSize == sizeof(double));
+    if(memcmp(header.magic, checkpointMagic, sizeof(header.magic)) || header.gridSize < 2 || header.ny < 2
+            || !(isVersion1 || isVersion2 || isVersion3 || isCurrentVersion)
+            || file.size() < header.headerSize + 2*numValues*qint64(header.solutionValueSize)
+                             + (header.numFields - 2)*numValues*qint64(sizeof(float))) {
+        qDebug() << "Warning, " << filename << " is not a valid version " << checkpointVersion << " checkpoint.";
+        file.unmap(data);
+        return false;
+    }
 
-        nextSol += 4; pSol +=4; pPrevSol+=4; pSolDxp += 4; pSolDxn += 4; pSolDyp += 4; pSolDyn += 4;
+    m_dampingFactor = header.dampingFactor;
+    m_time = header.time;
+    setDomain(header.rMin, header.rMax, header.yMin, header.yMax);
+    setGridSize(header.gridSize, header.ny);
+
+    // The file is never buffered in memory. A field with the storage and layout of the file is
+    // copied from the mapped pages as it is, the others are converted row by row.
+    const uchar *values = data + header.headerSize;
+    CPField *fields[] = {&m_solutionField, &m_solutionPreviousField, &m_groundField, &m_wallsField};
+    for(int k=0; k<int(checkpointNumFields); k++) {
+        size_t valueSize = k < 2 ? header.solutionValueSize : sizeof(float);
+        if(unsigned char *array = checkpointArray(*fields[k], valueSize)) {
+            memcpy(array, values, numValues*valueSize);
+            values += numValues*valueSize;
+            continue;
+        }
+        for(int i=0; i<m_nx; i++) {
+            if(valueSize == sizeof(double)) {
+                fields[k]->storeRow(i, reinterpret_cast<const double*>(values));
+            } else {
+                fields[k]->storeRow(i, reinterpret_cast<const float*>(values));
+            }
+            values += m_ny*valueSize;
+        }
     }
+    file.unmap(data);
 
-    int i=0;
-    for(unsigned int  j=0; j<gridSize(); j++) {
-        float ddx = solution(i,j,1,0) + solution(i,j,-1,0);
-        float ddy = solution(i,j,0,1) + solution(i,j,0,-1) ;
-        float ddt_rest = factor2*m_solutionPrevious(i,j) + 2*m_solution(i,j);
+    updateGroundMesh();
+    updateWaveSpeed();
+    updateDryCells();
+    return true;
+}
 
-        // Set value to zero if we have a wall.
-        m_solutionNext[m_solution.index(i,j)] = m_walls(i,j) ? 0 : factor*(dtdtOverdrdr*(ddx + ddy - 4*m_solution(i,j)) + ddt_rest + m_source(i,j));
+bool WaveSolver::loadHeightmap(QString filename, ResampleMethod method, float scale, float offset, int width, int height)
+{
+    CPHeightmap heightmap;
+    if(!heightmap.open(filename, width, height)) {
+        return false;
     }
 
-    i=gridSize()-1;
-    for(unsigned int j=0; j<gridSize(); j++) {
-        float ddx = solution(i,j,1,0) + solution(i,j,-1,0);
-        float ddy = solution(i,j,0,1) + solution(i,j,0,-1) ;
-        float ddt_rest = factor2*m_solutionPrevious(i,j) + 2*m_solution(i,j);
+    m_ground.createFromHeightmap(heightmap, method, scale, offset);
+    updateGroundField();
+    return true;
+}
 
-        // Set value to zero if we have a wall.
-        m_solutionNext[m_solution.index(i,j)] = m_walls(i,j) ? 0 : factor*(dtdtOverdrdr*(ddx + ddy - 4*m_solution(i,j)) + ddt_rest + m_source(i,j));
+void WaveSolver::step(double dt)
+{
+    double factor = 1.0/(1+0.5*m_dampingFactor*dt);
+    double factor2 = -(1.0-0.5*m_dampingFactor*dt);
+    for(int distance=0; distance<m_spongeWidth; distance++) {
+        double damping = m_dampingFactor + m_spongeDamping[distance];
+        m_spongeFactor[distance] = 1.0/(1+0.5*damping*dt);
+        m_spongeFactor2[distance] = -(1.0-0.5*damping*dt);
     }
+    double dtdtOverdxdx = dt*dt/(double(m_dx)*m_dx);
+    double dtdtOverdydy = dt*dt/(double(m_dy)*m_dy);
 
-    // ONE SIMD LOOP END------------------------------------------------------------------------
+    applyDrops();
+
+    CPTimer::temp().start();
+    if(m_timeIntegrator == TimeIntegrator::ADI) {
+        if(m_computePrecision == ComputePrecision::Double) {
+            stepImplicit<double>(factor, factor2, dtdtOverdxdx, dtdtOverdydy);
+        } else {
+            stepImplicit<float>(factor, factor2, dtdtOverdxdx, dtdtOverdydy);
+        }
+    } else if(m_computePrecision == ComputePrecision::Double) {
+        stepLeapfrog<double>(factor, factor2, dtdtOverdxdx, dtdtOverdydy);
+    } else {
+        stepLeapfrog<float>(factor, factor2, dtdtOverdxdx, dtdtOverdydy);
+    }
+    updateFront();
+    if(m_monitorsEnabled) {
+        combineMonitors(dt);
+    }
+    applySources(dt, factor);
+    CPTimer::temp().stop();
 
     CPTimer::copyData().start();
-    m_solutionNext.updateGridFromZ();
-    m_solutionPrevious.swapWithGrid(m_solution);
-    m_solution.swapWithGrid(m_solutionNext);
+    m_solutionPreviousField.swap(m_solutionField);
+    m_solutionField.swap(m_solutionNextField);
     CPTimer::copyData().stop();
+    m_solutionMeshDirty = true;
+    m_time += dt;
+}
+
+void WaveSolver::combineMonitors(double dt)
+{
+    // Pairwise over the rows, the tree only depends on the number of rows. Row i takes the
+    // sums of rows i to i+2*width-1 in each pass.
+    double *rows = &m_monitorRows[0];
+    for(int width=1; width<m_nx; width*=2) {
+        for(int i=0; i+width<m_nx; i+=2*width) {
+            double *sums = rows + size_t(i)*numMonitorSums;
+            const double *other = rows + size_t(i+width)*numMonitorSums;
+            for(int k=0; k<numMonitorSums; k++) {
+                sums[k] = k == 4 || k == 6 ? std::max(sums[k], other[k]) : sums[k] + other[k];
+            }
+        }
+    }
+
+    double area = double(m_dx)*m_dy;
+    m_monitors.time = m_time;
+    m_monitors.kineticEnergy = rows[0]*area/(8*dt*dt);
+    m_monitors.potentialEnergy = 0.5*area*(rows[1]/(double(m_dx)*m_dx) + rows[2]/(double(m_dy)*m_dy));
+    m_monitors.totalEnergy = m_monitors.kineticEnergy + m_monitors.potentialEnergy;
+    m_monitors.maxAmplitude = rows[4];
+    m_monitors.wetCells = rows[5];
+    m_monitors.meanLevel = rows[5] > 0 ? rows[3]/rows[5] : 0;
+    m_monitors.maxGradient = rows[6]/std::min(m_dx, m_dy);
+
+    // The run-up is the highest ground still under water, which is on the front
+    m_monitors.frontCells = m_frontCells.size();
+    m_monitors.runUp = -std::numeric_limits<float>::infinity();
+    for(int cell : m_frontCells) {
+        if(!m_dry[cell]) {
+            m_monitors.runUp = std::max(m_monitors.runUp, m_groundField.value(cell / m_ny, cell % m_ny));
+        }
+    }
 }
-#endif
 
+bool WaveSolver::monitorsEnabled() const
+{
+    return m_monitorsEnabled;
+}
 
+void WaveSolver::setMonitorsEnabled(bool enabled)
+{
+    m_monitorsEnabled = enabled;
+}
+
+const SolverMonitors &WaveSolver::monitors() const
+{
+    return m_monitors;
+}
+
+void WaveSolver::applySources(double dt, double factor)
+{
+    // The forcing is evaluated at the time of the current solution and added to the cells of
+    // u_next the emitters cover, except where they are dry. The cells are sorted, so each run of
+    // neighbouring cells in a row is updated as one segment of double values, which keeps the
+    // precision of every storage type.
+    std::vector<double> segment;
+    for(const WaveSource &source : m_sources) {
+        double value = factor*dt*dt*source.value(m_time);
+        if(value == 0) continue;
+        const std::vector<int> &cells = source.cells();
+        size_t end = 0;
+        for(size_t begin=0; begin<cells.size(); begin=end) {
+            int i = cells[begin] / m_ny;
+            int j = cells[begin] % m_ny;
+            end = begin + 1;
+            while(end < cells.size() && cells[end] == cells[begin] + int(end - begin) && cells[end] / m_ny == i) end++;
+            int count = end - begin;
+            segment.resize(count);
+            m_solutionNextField.loadRowSegment(i, j, count, &segment[0]);
+            for(int k=0; k<count; k++) {
+                if(!m_dry[cells[begin] + k]) segment[k] += value;
+            }
+            m_solutionNextField.storeRowSegment(i, j, count, &segment[0]);
+        }
+    }
+}
 
+template<class Real>
+void WaveSolver::stepLeapfrog(Real factor, Real factor2, Real dtdtOverdxdx, Real dtdtOverdydy)
+{
+    // Blocks of rows are stepped in parallel. A block only reads the rows of u around it, and
+    // its first and last rows, which the neighbouring blocks read, are clamped once every block
+    // is done. Inside a pool task, or with one thread, the grid is a single block.
+    CPThreadPool &pool = CPThreadPool::instance();
+    const int minimumBlockRows = 16;
+    int numBlocks = 1;
+    if(pool.runsInParallel()) {
+        numBlocks = std::max(1, std::min(4*pool.numThreads(), m_nx/minimumBlockRows));
+    }
+    auto firstRow = [&](int block) {
+        return int(size_t(block)*m_nx/numBlocks);
+    };
+    pool.parallelFor(0, numBlocks, [&](int begin, int end) {
+        for(int block=begin; block<end; block++) {
+            stepBlock<Real>(firstRow(block), firstRow(block+1), factor, factor2, dtdtOverdxdx, dtdtOverdydy);
+        }
+    }, 1);
+    pool.parallelFor(0, numBlocks, [&](int begin, int end) {
+        for(int block=begin; block<end; block++) {
+            clampBoundaryRows<Real>(firstRow(block), firstRow(block+1));
+        }
+    }, 1);
+}
 
+template<class Real>
+void WaveSolver::stepBlock(int iBegin, int iEnd, Real factor, Real factor2, Real dtdtOverdxdx, Real dtdtOverdydy)
+{
+    switch(m_stencilOrder) {
+    case StencilOrder::Fourth: stepRows<Real, 2>(iBegin, iEnd, factor, factor2, dtdtOverdxdx, dtdtOverdydy); break;
+    case StencilOrder::Sixth: stepRows<Real, 3>(iBegin, iEnd, factor, factor2, dtdtOverdxdx, dtdtOverdydy); break;
+    default: stepRows<Real, 1>(iBegin, iEnd, factor, factor2, dtdtOverdxdx, dtdtOverdydy); break;
+    }
+}
 
+template<class Real>
+void WaveSolver::clampBoundaryRows(int iBegin, int iEnd)
+{
+    // The first and last stencil radius rows of a block of u are read by the neighbouring rows,
+    // give them their u_prev values once the whole block is done
+    std::vector<Real> solutionRow(m_ny);
+    std::vector<Real> groundRow(m_ny);
+    int radius = stencilRadius();
+    for(int i=iBegin; i<iEnd; i++) {
+        if(i == iBegin + radius && iEnd - radius > i) i = iEnd - radius;
+        m_solutionField.loadRow(i, &solutionRow[0]);
+        m_groundField.loadRow(i, &groundRow[0]);
+        clampPreviousRow(i, &solutionRow[0], &groundRow[0]);
+    }
+}
 
+template<class Real>
+void WaveSolver::clampPreviousRow(int i, Real *solutionRow, const Real *groundRow)
+{
+    // Cells that fell dry in this step also get their u_prev just below the ground. u_prev is
+    // the current u after the swap, so this writes into the current solution.
+    if(!m_dryCellsInRow[i]) return;
+    clampPreviousSegment(i, 0, m_ny, solutionRow, groundRow);
+}
 
+template<class Real>
+void WaveSolver::clampPreviousSegment(int i, int jBegin, int count, Real *solution, const Real *ground)
+{
+    const unsigned char *dry = &m_dry[m_solutionField.index(i,jBegin)];
+    for(int j=0; j<count; j++) {
+        if(dry[j]) solution[j] = ground[j] - Real(0.001);
+    }
+    m_solutionField.storeRowSegment(i, jBegin, count, solution);
+}
 
+template<class Real, int Radius>
+void WaveSolver::stepRows(int iBegin, int iEnd, Real factor, Real factor2, Real dtdtOverdxdx, Real dtdtOverdydy)
+{
+    // Rolling window of the rows i-Radius to i+Radius, converted to Real, with Radius ghost
+    // values at each end for the periodic wrap in j. Tiled fields are stepped in strips of a
+    // few tiles, each one running down all the rows of the block before the next, so that the
+    // window stays in the L1 cache and the strip's tiles in the TLB. Row-major fields are one
+    // strip.
+    const int numRows = 2*Radius + 1;
+    int N = m_ny;
+    int stripWidth = m_solutionField.layout() == FieldLayout::Tiled ? 8*CPField::tileSize : N;
+    int maxWidth = std::min(stripWidth, N);
+    int stride = maxWidth + 2*Radius;
+    std::vector<Real> buffer(3*numRows*stride + 8*maxWidth);
+    Real *u[numRows];
+    Real *g[numRows];
+    Real *c[numRows];
+    Real *previous = &buffer[3*numRows*stride];
+    Real *walls = previous + maxWidth;
+    Real *next = walls + maxWidth;
+    Real *spongeFactor = next + maxWidth;
+    Real *spongeFactor2 = spongeFactor + maxWidth;
+    Real *scratch = spongeFactor2 + maxWidth;
+    int width = std::min(m_spongeWidth, std::min(m_nx/2, N/2));
+    bool singleStrip = maxWidth == N;
+
+    int jBegin = 0;
+    int W = N;
+    // Loads columns jBegin-Radius to jBegin+W+Radius of row i, wrapping around in j
+    auto loadRow = [&](const CPField &field, int i, Real *row) {
+        i = field.idxI(i);
+        int j = jBegin - Radius;
+        int count = W + 2*Radius;
+        for(int k=0; k<count; ) {
+            int jj = field.idxJ(j + k);
+            int piece = std::min(count - k, N - jj);
+            field.loadRowSegment(i, jj, piece, row + k);
+            k += piece;
+        }
+    };
+
+    StencilRows<Real> rows;
+    rows.previous = previous;
+    rows.walls = walls;
+    rows.next = next;
+    rows.factor = factor;
+    rows.factor2 = factor2;
+    rows.spongeFactor = spongeFactor;
+    rows.spongeFactor2 = spongeFactor2;
+    rows.dtdtOverdxdx = dtdtOverdxdx;
+    rows.dtdtOverdydy = dtdtOverdydy;
+    rows.scratch = scratch;
+
+    for(jBegin=0; jBegin<N; jBegin+=stripWidth) {
+        W = std::min(stripWidth, N - jBegin);
+        bool firstStrip = jBegin == 0;
+        for(int k=0; k<numRows; k++) {
+            u[k] = &buffer[k*stride];
+            g[k] = &buffer[(numRows+k)*stride];
+            c[k] = &buffer[(2*numRows+k)*stride];
+        }
+        for(int k=0; k<numRows-1; k++) {
+            loadRow(m_solutionField, iBegin-Radius+k, u[k]);
+            loadRow(m_groundField, iBegin-Radius+k, g[k]);
+#ifndef CONSTANTWAVESPEED
+            loadRow(m_waveSpeedField, iBegin-Radius+k, c[k]);
+#endif
+        }
+        rows.scratchStride = W;
+        rows.jOffset = jBegin;
+
+        // The sponge cells of interior rows, [0, width) and [N-width, N), in strip columns
+        int leftEnd = std::max(0, std::min(width - jBegin, W));
+        int rightBegin = std::min(W, std::max(N - width - jBegin, leftEnd));
+
+        for(int i=iBegin; i<iEnd; i++) {
+            loadRow(m_solutionField, i+Radius, u[numRows-1]);
+            loadRow(m_groundField, i+Radius, g[numRows-1]);
+#ifndef CONSTANTWAVESPEED
+            loadRow(m_waveSpeedField, i+Radius, c[numRows-1]);
+            m_wallsField.loadRowSegment(i, jBegin, W, walls);
+#endif
+            m_solutionPreviousField.loadRowSegment(i, jBegin, W, previous);
 
+            for(int k=0; k<numRows; k++) {
+                rows.u[k] = u[k];
+                rows.g[k] = g[k];
+                rows.c[k] = c[k];
+            }
+            rows.dry = &m_dry[m_solutionField.index(i,jBegin)];
+            rows.changedDryCells = &m_changedDryCells[i];
+            if(firstStrip) m_changedDryCells[i].clear();
+
+            // Interior rows only have sponge cells at their ends, the rest of the row runs the
+            // damping-free kernel
+            int dryCells = 0;
+            int distanceI = std::min(i, m_nx-1-i);
+            if(distanceI < width) {
+                for(int j=0; j<W; j++) {
+                    int jGlobal = jBegin + j;
+                    int distance = std::min(distanceI, std::min(jGlobal, N-1-jGlobal));
+                    spongeFactor[j] = distance < width ? m_spongeFactor[distance] : factor;
+                    spongeFactor2[j] = distance < width ? m_spongeFactor2[distance] : factor2;
+                }
+                dryCells += stepSegment<Real, true, Radius>(rows, 0, W);
+            } else if(width > 0) {
+                for(int j=0; j<leftEnd; j++) {
+                    spongeFactor[j] = m_spongeFactor[jBegin + j];
+                    spongeFactor2[j] = m_spongeFactor2[jBegin + j];
+                }
+                for(int j=rightBegin; j<W; j++) {
+                    spongeFactor[j] = m_spongeFactor[N-1-jBegin-j];
+                    spongeFactor2[j] = m_spongeFactor2[N-1-jBegin-j];
+                }
+                if(leftEnd > 0) dryCells += stepSegment<Real, true, Radius>(rows, 0, leftEnd);
+                if(rightBegin > leftEnd) dryCells += stepSegment<Real, false, Radius>(rows, leftEnd, rightBegin);
+                if(W > rightBegin) dryCells += stepSegment<Real, true, Radius>(rows, rightBegin, W);
+            } else {
+                dryCells += stepSegment<Real, false, Radius>(rows, 0, W);
+            }
+            m_solutionNextField.storeRowSegment(i, jBegin, W, next);
+            m_dryCellsInRow[i] = firstStrip ? dryCells : m_dryCellsInRow[i] + dryCells;
+            if(m_monitorsEnabled) {
+                double *sums = &m_monitorRows[size_t(i)*numMonitorSums];
+                double stripSums[numMonitorSums];
+                sumMonitors(u[Radius]+Radius, u[Radius+1]+Radius, g[Radius]+Radius, g[Radius+1]+Radius,
+                            c[Radius]+Radius, c[Radius+1]+Radius, walls, previous, next, W, W,
+                            firstStrip ? sums : stripSums);
+                for(int k=0; k<numMonitorSums && !firstStrip; k++) {
+                    // The amplitude and the gradient are maxima
+                    sums[k] = k == 4 || k == 6 ? std::max(sums[k], stripSums[k]) : sums[k] + stripSums[k];
+                }
+            }
 
+            // No row in this block reads row i-Radius of u any more, so it can take its u_prev
+            // values now. The first Radius rows are left to clampBoundaryRows. The next strip
+            // still reads the last Radius columns of this one, they are clamped with it, and
+            // the last strip clamps the first Radius columns, which it reads across the wrap.
+            int iClamp = i-Radius;
+            if(iClamp >= iBegin+Radius && singleStrip) {
+                clampPreviousRow(iClamp, u[0]+Radius, g[0]+Radius);
+            } else if(iClamp >= iBegin+Radius && m_dryCellsInRow[iClamp]) {
+                bool lastStrip = jBegin + W == N;
+                int from = firstStrip ? Radius : jBegin - Radius;
+                int to = lastStrip ? N : jBegin + W - Radius;
+                clampPreviousSegment(iClamp, from, to - from, u[0] + Radius + from - jBegin, g[0] + Radius + from - jBegin);
+                if(lastStrip) clampPreviousSegment(iClamp, 0, Radius, u[0] + Radius + W, g[0] + Radius + W);
+            }
 
+            std::rotate(u, u+1, u+numRows);
+            std::rotate(g, g+1, g+numRows);
+            std::rotate(c, c+1, c+numRows);
+        }
+    }
 
+}
 
+template<class Real>
+void WaveSolver::stepImplicit(Real factor, Real factor2, Real dtdtOverdxdx, Real dtdtOverdydy)
+{
+    // Approximately factored theta scheme with theta = 1/4,
+    //   (1 - dt^2/4 Dx)(1 - dt^2/4 Dy)(u_next - 2u + u_prev) = dt^2 (Dx + Dy) u,
+    // which is unconditionally stable and second order in time. It is solved as one set of
+    // cyclic tridiagonal solves along x followed by one along y. The damping enters as in the
+    // leapfrog step, land cells keep their value. The fields are unpacked into the workspace as
+    // Real first.
+    int nx = m_nx;
+    int ny = m_ny;
+    size_t numCells = size_t(nx)*ny;
+    m_implicitWorkspace.resize(7*numCells*sizeof(Real));
+    Real *u = reinterpret_cast<Real*>(&m_implicitWorkspace[0]);
+    Real *g = u + numCells;
+    Real *c = g + numCells;
+    Real *walls = c + numCells;
+    Real *d = walls + numCells;
+    Real *z = d + numCells;
+    Real *cprime = z + numCells;
+    CPThreadPool &pool = CPThreadPool::instance();
+
+    pool.parallelFor(0, nx, [&](int iBegin, int iEnd) {
+        for(int i=iBegin; i<iEnd; i++) {
+            size_t p = size_t(i)*ny;
+            m_solutionField.loadRow(i, u + p);
+            m_groundField.loadRow(i, g + p);
+#ifndef CONSTANTWAVESPEED
+            m_waveSpeedField.loadRow(i, c + p);
+            m_wallsField.loadRow(i, walls + p);
+#endif
+        }
+    });
 
+    // Right hand side dt^2 (Dx + Dy) u. The y differences are done for the interior of the row
+    // in one pass and for the two cells that wrap around on their own.
+    pool.parallelFor(0, nx, [&](int iBegin, int iEnd) {
+        for(int i=iBegin; i<iEnd; i++) {
+            size_t p = size_t(i)*ny;
+            size_t pm = size_t(m_solutionField.idxI(i-1))*ny;
+            size_t pp = size_t(m_solutionField.idxI(i+1))*ny;
+            const Real *ur = u + p, *gr = g + p, *cr = c + p;
+            Real *r = d + p;
+            std::fill(r, r + ny, Real(0));
+            addSecondDifference(ny, ur, u + pm, u + pp, gr, g + pm, g + pp, cr, c + pm, c + pp, dtdtOverdxdx, r);
+            addSecondDifference(ny-2, ur+1, ur, ur+2, gr+1, gr, gr+2, cr+1, cr, cr+2, dtdtOverdydy, r+1);
+            addSecondDifference(1, ur, ur+ny-1, ur+1, gr, gr+ny-1, gr+1, cr, cr+ny-1, cr+1, dtdtOverdydy, r);
+            addSecondDifference(1, ur+ny-1, ur+ny-2, ur, gr+ny-1, gr+ny-2, gr, cr+ny-1, cr+ny-2, cr,
+                                dtdtOverdydy, r+ny-1);
+#ifndef CONSTANTWAVESPEED
+            for(int j=0; j<ny; j++) {
+                if(walls[p+j]) r[j] = 0;
+            }
+#endif
+        }
+    });
 
+    // Lines along x run across the rows, so blocks of neighbouring columns are solved together
+    // with the columns as lanes
+    Real alphaX = dtdtOverdxdx/4;
+    Real alphaY = dtdtOverdydy/4;
+    pool.parallelFor(0, ny, [&](int jBegin, int jEnd) {
+        std::vector<Real> scratch(6*(jEnd - jBegin));
+        solveImplicitLines(nx, jEnd - jBegin, ny, g + jBegin, c + jBegin, walls + jBegin, alphaX,
+                           d + jBegin, z + jBegin, cprime + jBegin, &scratch[0]);
+    }, 64);
+
+    // Lines along y are contiguous rows. Blocks of rows are transposed so that the rows become
+    // the lanes.
+    const int lanes = 16;
+    pool.parallelFor(0, nx, [&](int iBegin, int iEnd) {
+        std::vector<Real> block(6*lanes*ny + 6*lanes);
+        Real *gT = &block[0];
+        Real *cT = gT + lanes*ny;
+        Real *wallsT = cT + lanes*ny;
+        Real *dT = wallsT + lanes*ny;
+        Real *zT = dT + lanes*ny;
+        Real *cprimeT = zT + lanes*ny;
+        Real *scratch = cprimeT + lanes*ny;
+        for(int i0=iBegin; i0<iEnd; i0+=lanes) {
+            int count = std::min(lanes, iEnd - i0);
+            size_t p0 = size_t(i0)*ny;
+            for(int j=0; j<ny; j++) {
+                for(int l=0; l<count; l++) {
+                    size_t p = p0 + size_t(l)*ny + j;
+                    gT[j*lanes + l] = g[p];
+#ifndef CONSTANTWAVESPEED
+                    cT[j*lanes + l] = c[p];
+                    wallsT[j*lanes + l] = walls[p];
+#endif
+                    dT[j*lanes + l] = d[p];
+                }
+            }
+            solveImplicitLines(ny, count, lanes, gT, cT, wallsT, alphaY, dT, zT, cprimeT, scratch);
+            for(int j=0; j<ny; j++) {
+                for(int l=0; l<count; l++) {
+                    d[p0 + size_t(l)*ny + j] = dT[j*lanes + l];
+                }
+            }
+        }
+    }, 2*lanes);
+
+    // d now holds u_next - 2u + u_prev
+    int width = std::min(m_spongeWidth, std::min(nx/2, ny/2));
+    pool.parallelFor(0, nx, [&](int iBegin, int iEnd) {
+        std::vector<Real> buffer(4*ny);
+        Real *previous = &buffer[0];
+        Real *next = previous + ny;
+        Real *spongeFactor = next + ny;
+        Real *spongeFactor2 = spongeFactor + ny;
+        std::fill(spongeFactor, spongeFactor + ny, factor);
+        std::fill(spongeFactor2, spongeFactor2 + ny, factor2);
+        for(int i=iBegin; i<iEnd; i++) {
+            size_t p = size_t(i)*ny;
+            int distanceI = std::min(i, nx-1-i);
+            for(int j=0; j<ny && width > 0; j++) {
+                int distance = std::min(distanceI, std::min(j, ny-1-j));
+                spongeFactor[j] = distance < width ? m_spongeFactor[distance] : factor;
+                spongeFactor2[j] = distance < width ? m_spongeFactor2[distance] : factor2;
+            }
+            m_solutionPreviousField.loadRow(i, previous);
+            const Real *ur = u + p, *gr = g + p, *wr = d + p, *wallsR = walls + p;
+#pragma clang loop vectorize(enable) interleave(enable)
+            for(int j=0; j<ny; j++) {
+                Real update = spongeFactor[j]*(wr[j] + 2*ur[j] + spongeFactor2[j]*previous[j]);
+                Real water = gr[j] < 0 ? update : ur[j];
+#ifdef CONSTANTWAVESPEED
+                Real value = water;
+#else
+                Real value = wallsR[j] ? 0 : water;
+#endif
+                next[j] = gr[j] > value ? gr[j] - Real(0.01) : value;
+            }
+            m_changedDryCells[i].clear();
+            m_dryCellsInRow[i] = markDryCells(gr, next, &m_dry[p], 0, ny, m_changedDryCells[i]);
+            m_solutionNextField.storeRow(i, next);
+            if(m_monitorsEnabled) {
+                size_t pn = size_t(m_solutionField.idxI(i+1))*ny;
+                sumMonitors(ur, u + pn, gr, g + pn, c + p, c + pn, wallsR, previous, next, ny, 0,
+                            &m_monitorRows[size_t(i)*numMonitorSums]);
+            }
+        }
+    });
 
+    pool.parallelFor(0, nx, [&](int iBegin, int iEnd) {
+        for(int i=iBegin; i<iEnd; i++) {
+            size_t p = size_t(i)*ny;
+            clampPreviousRow(i, u + p, g + p);
+        }
+    });
+}
@@ -2,87 +2,229 @@
 #define WAVESOLVER_H
 #include "cpgrid.h"
 #include "cpbox.h"
+#include "cpfield.h"
+#include "wavesource.h"
 
 #include <functional>
+#include <mutex>
 
-enum class GroundType {Slope = 0, PerlinNoise = 1};
+enum class GroundType {Slope = 0, PerlinNoise = 1, DoubleSlit = 2, Channel = 3};
+// Scalar type the stencil is computed in. The fields keep their own storage, so double
+// computation on float32 fields accumulates in double but stores in float.
+enum class ComputePrecision {Float = 0, Double = 1};
+// Order of the central differences in the Laplacian. The stencil reaches order/2 cells in
+// each direction.
+enum class StencilOrder {Second = 2, Fourth = 4, Sixth = 6};
+// Explicit leapfrog, or alternating direction implicit steps that stay stable beyond the CFL
+// limit. ADI always uses the second order stencil.
+enum class TimeIntegrator {Leapfrog = 0, ADI = 1};
+
+// Gaussian drop in world coordinates, queued with WaveSolver::addDrop
+class Drop
+{
+public:
+    float x;
+    float y;
+    float amplitude;
+    float standardDeviation;
+};
+
+// Monitors of the current solution, computed by the step kernel over the wet cells. The energy
+// is the discrete wave energy, 1/2 (u_t^2 + c |grad u|^2) integrated over the domain, with u_t
+// the central difference of u_next and u_prev before the sources are added and the gradient
+// taken over the faces to wet neighbours. maxGradient is the largest |du| over those faces
+// divided by the smaller grid spacing. Row sums are combined in a fixed tree over the rows, so
+// the values do not depend on the number of threads. Any NaN or Inf in the solution makes the
+// energies non-finite. runUp is the highest ground under water on the wet/dry front, or -inf
+// when there is no front.
+class SolverMonitors
+{
+public:
+    double time;
+    double kineticEnergy;
+    double potentialEnergy;
+    double totalEnergy;
+    float  maxAmplitude;
+    qint64 wetCells;
+    double meanLevel;
+    float  maxGradient;
+    qint64 frontCells;
+    float  runUp;
+};
+
+// Copy of the evolving part of the solver, u, u_prev and the time, in the storage of the fields
+class SolverState
+{
+public:
+    CPField solution;
+    CPField previousSolution;
+    double time;
+};
 
 class WaveSolver
 {
 private:
+    // Solver state. The fields are packed and u, u_prev and u_next use the selected storage
+    // policy, the CPGrids are only meshes for rendering.
+    CPField m_solutionField;
+    CPField m_solutionNextField;
+    CPField m_solutionPreviousField;
+    CPField m_groundField;
+    CPField m_wallsField;
+    CPField m_waveSpeedField;
+    std::vector<unsigned char> m_dry;
+    std::vector<int> m_dryCellsInRow;
+
+    // Wet/dry front, the cells with a neighbour in the other state. The kernel lists the cells
+    // that changed state per row, and only those and their neighbours are checked after a step.
+    // m_frontPosition is the position of a cell in m_frontCells, or -1.
+    std::vector<std::vector<int>> m_changedDryCells;
+    std::vector<int> m_frontCells;
+    std::vector<int> m_frontPosition;
+
     CPGrid m_solution;
-    CPGrid m_solutionNext;
-    CPGrid m_solutionPrevious;
     CPGrid m_ground;
-    CPGrid m_walls;
-    CPGrid m_source;
+    bool   m_solutionMeshDirty;
+    ComputePrecision m_computePrecision;
+    StencilOrder m_stencilOrder;
+    TimeIntegrator m_timeIntegrator;
     CPBox  m_box;
     float  m_dampingFactor;
-    int    m_gridSize;
-    float  m_dr;
-    float  m_rMin;
-    float  m_rMax;
-    float  m_length;
-    float  m_averageValue;
-    void calculateWalls();
-    void calculateMean();
-    void applySmoothing();
-public:
-    WaveSolver();
-    void setGridSize(int gridSize);
-    unsigned int gridSize() { return m_solution.gridSize(); }
-    void setLength(float length);
-    void step(float dt);
-    void stepSIMD(float dt);
+    int    m_nx;
+    int    m_ny;
+    float  m_dx;
+    float  m_dy;
+    float  m_xMin;
+    float  m_xMax;
+    float  m_yMin;
+    float  m_yMax;
+    double m_time;
+    std::vector<WaveSource> m_sources;
 
-    inline float calcC(int i, int j) {
-        if(m_walls(i,j)) return 1.0;
-        else return std::min(-m_ground(i,j,true),1.0f);
-    }
+    // Drops are queued from the UI thread and stamped at the start of the next step
+    std::mutex m_dropsMutex;
+    std::vector<Drop> m_queuedDrops;
+    std::vector<Drop> m_drops;
+    std::vector<float> m_dropKernel;
+    float m_dropKernelStandardDeviation;
+    float m_dropKernelDx;
+    float m_dropKernelDy;
+    int   m_dropKernelRadiusI;
+    int   m_dropKernelRadiusJ;
 
-    inline float solution(int i,int j, int di, int dj) {
-        if(m_ground(i+di, j+dj, true) > m_solution(i,j)) {
-            return m_solution(i-di, j-dj, true);
-        }
-        else return m_solution(i+di, j+dj, true);
-
-//        if(m_walls(i+di,j+dj,true)) {
-//            if(m_walls(i-di,j-dj,true)) {
-//                // qDebug() << "Small channel on solution";
-//                return 0;
-//                // return m_solution(i,j);
-//            }
-//            return m_solution(i-di,j-dj,true);
-//        }
-//        return m_solution(i+di,j+dj, true);
-    }
+    // Absorbing sponge layer along the domain edges. The damping only depends on the distance
+    // to the closest edge, so it is stored as a profile over the m_spongeWidth border cells.
+    int   m_spongeWidth;
+    float m_spongeMaxDamping;
+    std::vector<float> m_spongeDamping;
+    std::vector<double> m_spongeFactor;
+    std::vector<double> m_spongeFactor2;
 
-    inline float solutionPrevious(int i,int j, int di, int dj) {
-        if(m_ground(i+di, j+dj, true) > m_solutionPrevious(i,j)) {
-            return m_solutionPrevious(i-di, j-dj, true);
-        }
-        else return m_solutionPrevious(i+di, j+dj, true);
+    // Unpacked fields and line solver storage of the ADI step
+    std::vector<unsigned char> m_implicitWorkspace;
 
-//        if(m_walls(i+di,j+dj,true)) {
-//            if(m_walls(i-di,j-dj,true)) {
-//                // qDebug() << "Small channel on prev";
-//                return 0;
-//                //return m_solutionPrevious(i,j);
-//            }
+    // Partial monitor sums, numMonitorSums values per row
+    bool m_monitorsEnabled;
+    std::vector<double> m_monitorRows;
+    SolverMonitors m_monitors;
 
-//            return m_solutionPrevious(i-di,j-dj,true);
-//        }
+    template<class Real>
+    void stepLeapfrog(Real factor, Real factor2, Real dtdtOverdxdx, Real dtdtOverdydy);
+    template<class Real>
+    void stepBlock(int iBegin, int iEnd, Real factor, Real factor2, Real dtdtOverdxdx, Real dtdtOverdydy);
+    template<class Real, int Radius>
+    void stepRows(int iBegin, int iEnd, Real factor, Real factor2, Real dtdtOverdxdx, Real dtdtOverdydy);
+    template<class Real>
+    void stepImplicit(Real factor, Real factor2, Real dtdtOverdxdx, Real dtdtOverdydy);
+    template<class Real>
+    void clampBoundaryRows(int iBegin, int iEnd);
+    template<class Real>
+    void clampPreviousRow(int i, Real *solutionRow, const Real *groundRow);
+    template<class Real>
+    void clampPreviousSegment(int i, int jBegin, int count, Real *solution, const Real *ground);
+    void updateSolutionMesh();
+    void updateGroundField();
+    void updateWaveSpeed();
+    void updateGroundMesh();
+    void updateDryCells();
+    void updateFront();
+    void updateFrontCell(int i, int j);
+    void applyDrops();
+    void applySources(double dt, double factor);
+    void combineMonitors(double dt);
+    void updateDropKernel(float standardDeviation);
+public:
+    WaveSolver();
+    void setGridSize(int nx, int ny);
+    void resample(int nx, int ny);
+    int nx() const { return m_nx; }
+    int ny() const { return m_ny; }
+    void setDomain(float xMin, float xMax, float yMin, float yMax);
+    void reset();
+    void setGroundType(GroundType type, unsigned int seed = 15);
+    void step(double dt);
+    FieldStorage fieldStorage() const;
+    void setFieldStorage(FieldStorage storage);
+    FieldLayout fieldLayout() const;
+    void setFieldLayout(FieldLayout layout);
+    ComputePrecision computePrecision() const;
+    void setComputePrecision(ComputePrecision precision);
+    StencilOrder stencilOrder() const;
+    void setStencilOrder(StencilOrder order);
+    int stencilRadius() const;
+    double stencilStabilityLimit() const;
+    TimeIntegrator timeIntegrator() const;
+    void setTimeIntegrator(TimeIntegrator integrator);
+    double phaseSpeedError(double dt, double pointsPerWavelength) const;
+    bool monitorsEnabled() const;
+    void setMonitorsEnabled(bool enabled);
+    const SolverMonitors &monitors() const;
+    const std::vector<int> &frontCells() const;
+    void setSpongeLayer(int width, float maxDamping);
+    int spongeWidth() const;
+    float spongeMaxDamping() const;
 
-//        return m_solutionPrevious(i+di,j+dj, true);
+    inline float calcC(int i, int j) {
+        if(m_wallsField.value(i,j)) return 1.0;
+        else return std::min(-m_groundField.value(m_groundField.idxI(i),m_groundField.idxJ(j)),1.0f);
     }
+
     float averageValue() const;
-    float dr() const;
+    float dx() const;
+    float dy() const;
+    float xMin() const;
+    float xMax() const;
+    float yMin() const;
+    float yMax() const;
     void applyAction(std::function<void(int i, int j)> action);
-    void applyAction(std::function<void (int, int, int)> action);
+    void applyAction(std::function<void (int, int, int, int)> action);
     CPGrid &ground();
     CPGrid &solution();
+    CPField &solutionField();
+    const CPField &solutionField() const;
+    const CPField &groundField() const;
+    const CPField &wallsField() const;
+    const CPField &waveSpeedField() const;
+    float dampingFactor() const;
+    void setDampingFactor(float dampingFactor);
+    double time() const;
     void createRandomGauss();
+    void addSource(const WaveSource &source);
+    void clearSources();
+    const std::vector<WaveSource> &sources() const;
+    void addDrop(float x, float y, float amplitude = 0.5, float standardDeviation = 0.2);
+    void addDrops(const std::vector<Drop> &drops);
     CPBox &box();
+    void copySolution(float *values);
+    void setSolution(const float *values, const float *previousValues);
+    void saveState(SolverState &state) const;
+    void restoreState(const SolverState &state, double timestepRatio = 1);
+    void setGround(const float *values);
+    size_t memoryUsage() const;
+    bool saveCheckpoint(QString filename);
+    bool loadCheckpoint(QString filename);
+    bool loadHeightmap(QString filename, ResampleMethod method = ResampleMethod::Area, float scale = 1, float offset = 0,
+                       int width = 0, int height = 0);
 };
 
 #endif // WAVESOLVER_H
@@ -0,0 +1,117 @@
+#include "wavesource.h"
+#include <cmath>
+#include <algorithm>
+
+WaveSource::WaveSource(SourceShape shape, float x0, float y0, float x1, float y1) :
+    m_shape(shape),
+    m_x0(x0),
+    m_y0(y0),
+    m_x1(x1),
+    m_y1(y1),
+    m_signal(SourceSignal::Sinusoid),
+    m_amplitude(0),
+    m_frequency(0),
+    m_phase(0),
+    m_startTime(0),
+    m_duration(0),
+    m_sampleRate(1),
+    m_loop(false)
+{
+
+}
+
+WaveSource WaveSource::point(float x, float y)
+{
+    return WaveSource(SourceShape::Point, x, y, x, y);
+}
+
+WaveSource WaveSource::line(float x0, float y0, float x1, float y1)
+{
+    return WaveSource(SourceShape::Line, x0, y0, x1, y1);
+}
+
+WaveSource WaveSource::area(float x0, float y0, float x1, float y1)
+{
+    return WaveSource(SourceShape::Area, std::min(x0, x1), std::min(y0, y1), std::max(x0, x1), std::max(y0, y1));
+}
+
+void WaveSource::setSinusoid(float amplitude, float frequency, float phase)
+{
+    m_signal = SourceSignal::Sinusoid;
+    m_amplitude = amplitude;
+    m_frequency = frequency;
+    m_phase = phase;
+}
+
+void WaveSource::setPulse(float amplitude, float startTime, float duration)
+{
+    m_signal = SourceSignal::Pulse;
+    m_amplitude = amplitude;
+    m_startTime = startTime;
+    m_duration = duration;
+}
+
+void WaveSource::setRecorded(const std::vector<float> &samples, float sampleRate, bool loop)
+{
+    m_signal = SourceSignal::Recorded;
+    m_amplitude = 1;
+    m_samples = samples;
+    m_sampleRate = sampleRate;
+    m_loop = loop;
+}
+
+float WaveSource::value(double time) const
+{
+    switch(m_signal) {
+    case SourceSignal::Sinusoid:
+        return m_amplitude*sin(2*M_PI*m_frequency*time + m_phase);
+    case SourceSignal::Pulse: {
+        // Raised cosine, smooth at both ends so the pulse does not excite grid scale noise
+        double t = (time - m_startTime)/m_duration;
+        if(t < 0 || t > 1) return 0;
+        return m_amplitude*0.5*(1 - cos(2*M_PI*t));
+    }
+    case SourceSignal::Recorded: {
+        // Linear interpolation between the samples
+        if(m_samples.empty()) return 0;
+        double position = time*m_sampleRate;
+        int numSamples = m_samples.size();
+        if(m_loop) position = fmod(position, double(numSamples));
+        else if(position >= numSamples - 1) return position < numSamples ? m_samples.back() : 0;
+        int k = position;
+        double fraction = position - k;
+        float next = m_samples[(k + 1) % numSamples];
+        return (1 - fraction)*m_samples[k] + fraction*next;
+    }
+    }
+    return 0;
+}
+
+void WaveSource::rasterize(int nx, int ny, float xMin, float yMin, float dx, float dy)
+{
+    m_cells.clear();
+    auto cellI = [&](float x) {
+        return std::max(0, std::min(nx - 1, int(round((x - xMin)/dx))));
+    };
+    auto cellJ = [&](float y) {
+        return std::max(0, std::min(ny - 1, int(round((y - yMin)/dy))));
+    };
+
+    if(m_shape == SourceShape::Area) {
+        for(int i=cellI(m_x0); i<=cellI(m_x1); i++) {
+            for(int j=cellJ(m_y0); j<=cellJ(m_y1); j++) {
+                m_cells.push_back(i*ny + j);
+            }
+        }
+    } else {
+        // Walk along the line in steps of half a cell, a point is a line of length zero
+        float steps = std::max(fabs(m_x1-m_x0)/dx, fabs(m_y1-m_y0)/dy);
+        int numSteps = ceil(2*steps);
+        for(int k=0; k<=numSteps; k++) {
+            float t = numSteps ? float(k)/numSteps : 0;
+            m_cells.push_back(cellI(m_x0 + t*(m_x1-m_x0))*ny + cellJ(m_y0 + t*(m_y1-m_y0)));
+        }
+        std::sort(m_cells.begin(), m_cells.end());
+        m_cells.erase(std::unique(m_cells.begin(), m_cells.end()), m_cells.end());
+    }
+}
@@ -0,0 +1,48 @@
+#ifndef WAVESOURCE_H
+#define WAVESOURCE_H
+#include <vector>
+
+enum class SourceShape {Point = 0, Line = 1, Area = 2};
+enum class SourceSignal {Sinusoid = 0, Pulse = 1, Recorded = 2};
+
+// Emitter in world coordinates. The signal is a forcing term, an acceleration of the water
+// surface, so the effect of a source does not depend on the time step. The solver adds it
+// only at the cells the shape covers.
+class WaveSource
+{
+private:
+    SourceShape m_shape;
+    float m_x0;
+    float m_y0;
+    float m_x1;
+    float m_y1;
+
+    SourceSignal m_signal;
+    float m_amplitude;
+    float m_frequency;
+    float m_phase;
+    float m_startTime;
+    float m_duration;
+    std::vector<float> m_samples;
+    float m_sampleRate;
+    bool  m_loop;
+
+    std::vector<int> m_cells;
+
+    WaveSource(SourceShape shape, float x0, float y0, float x1, float y1);
+
+public:
+    static WaveSource point(float x, float y);
+    static WaveSource line(float x0, float y0, float x1, float y1);
+    static WaveSource area(float x0, float y0, float x1, float y1);
+
+    void setSinusoid(float amplitude, float frequency, float phase = 0);
+    void setPulse(float amplitude, float startTime, float duration);
+    void setRecorded(const std::vector<float> &samples, float sampleRate, bool loop = false);
+
+    float value(double time) const;
+    void rasterize(int nx, int ny, float xMin, float yMin, float dx, float dy);
+    const std::vector<int> &cells() const { return m_cells; }
+};
+
+#endif // WAVESOURCE_H
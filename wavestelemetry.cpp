@@ -0,0 +1,172 @@
+#include "wavestelemetry.h"
+#include "cptimer.h"
+#include <QFile>
+#include <QStringList>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+WavesTelemetry::WavesTelemetry(QObject *parent) :
+    QObject(parent),
+    m_frames(1024),
+    m_timer(this),
+    m_updateInterval(500),
+    m_windowLength(5),
+    m_targetFrameTime(1000.0/60),
+    m_lastStepTime(0),
+    m_lastNormalsTime(0),
+    m_lastUploadTime(0),
+    m_lastRenderTime(0),
+    m_lastSyncTime(0),
+    m_stepsPerSecond(0),
+    m_cellUpdatesPerSecond(0),
+    m_framesPerSecond(0),
+    m_stepTime(0),
+    m_normalsTime(0),
+    m_uploadTime(0),
+    m_renderTime(0),
+    m_syncTime(0),
+    m_frameTimeP50(0),
+    m_frameTimeP99(0),
+    m_residentMemory(0),
+    m_solverMemory(0),
+    m_behind(false)
+{
+    connect(&m_timer, SIGNAL(timeout()), this, SLOT(update()));
+    m_timer.start(m_updateInterval);
+}
+
+qint64 WavesTelemetry::now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+qint64 WavesTelemetry::residentSetSize()
+{
+#ifdef Q_OS_LINUX
+    // The second field of statm is the resident set in pages
+    QFile statm("/proc/self/statm");
+    if(!statm.open(QFile::ReadOnly)) return 0;
+    QStringList fields = QString::fromUtf8(statm.readAll()).split(" ");
+    return fields.size() > 1 ? fields[1].toLongLong()*sysconf(_SC_PAGESIZE) : 0;
+#else
+    return 0;
+#endif
+}
+
+TelemetryFrame WavesTelemetry::addFrame(double frameTime, int steps, qint64 cellUpdates, qint64 solverMemory)
+{
+    // The stage times are the growth of the render thread's timers since the previous frame.
+    // Rendering runs after sync, so it is attributed to the frame that follows it.
+    double stepTotal = CPTimer::computeTimestep().elapsedTime();
+    double normalsTotal = CPTimer::normalVectors().elapsedTime();
+    double uploadTotal = CPTimer::uploadVBO().elapsedTime();
+    double renderTotal = CPTimer::rendering().elapsedTime();
+    double syncTotal = CPTimer::sync().elapsedTime();
+
+    TelemetryFrame frame;
+    frame.time = now();
+    frame.frameTime = 1e3*frameTime;
+    frame.steps = steps;
+    frame.cellUpdates = cellUpdates;
+    frame.stepTime = 1e3*(stepTotal - m_lastStepTime);
+    frame.normalsTime = 1e3*(normalsTotal - m_lastNormalsTime);
+    frame.uploadTime = 1e3*(uploadTotal - m_lastUploadTime);
+    frame.renderTime = 1e3*(renderTotal - m_lastRenderTime);
+    frame.syncTime = 1e3*(syncTotal - m_lastSyncTime);
+    frame.solverMemory = solverMemory;
+    m_lastStepTime = stepTotal;
+    m_lastNormalsTime = normalsTotal;
+    m_lastUploadTime = uploadTotal;
+    m_lastRenderTime = renderTotal;
+    m_lastSyncTime = syncTotal;
+
+    // A full buffer means nobody is reading, the frame is dropped
+    m_frames.push(&frame, 1);
+    return frame;
+}
+
+void WavesTelemetry::update()
+{
+    TelemetryFrame frame;
+    while(m_frames.pop(&frame, 1) > 0) {
+        m_window.push_back(frame);
+    }
+    qint64 windowBegin = now() - qint64(1e9*m_windowLength);
+    while(!m_window.empty() && m_window.front().time < windowBegin) {
+        m_window.pop_front();
+    }
+
+    double elapsed = 0;
+    qint64 steps = 0;
+    qint64 cellUpdates = 0;
+    double stepTime = 0;
+    double normalsTime = 0;
+    double uploadTime = 0;
+    double renderTime = 0;
+    double syncTime = 0;
+    std::vector<float> frameTimes;
+    frameTimes.reserve(m_window.size());
+    for(const TelemetryFrame &windowFrame : m_window) {
+        elapsed += 1e-3*windowFrame.frameTime;
+        steps += windowFrame.steps;
+        cellUpdates += windowFrame.cellUpdates;
+        stepTime += windowFrame.stepTime;
+        normalsTime += windowFrame.normalsTime;
+        uploadTime += windowFrame.uploadTime;
+        renderTime += windowFrame.renderTime;
+        syncTime += windowFrame.syncTime;
+        frameTimes.push_back(windowFrame.frameTime);
+    }
+
+    int numFrames = m_window.size();
+    m_stepsPerSecond = elapsed > 0 ? steps/elapsed : 0;
+    m_cellUpdatesPerSecond = elapsed > 0 ? cellUpdates/elapsed : 0;
+    m_framesPerSecond = elapsed > 0 ? numFrames/elapsed : 0;
+    m_stepTime = numFrames ? stepTime/numFrames : 0;
+    m_normalsTime = numFrames ? normalsTime/numFrames : 0;
+    m_uploadTime = numFrames ? uploadTime/numFrames : 0;
+    m_renderTime = numFrames ? renderTime/numFrames : 0;
+    m_syncTime = numFrames ? syncTime/numFrames : 0;
+    if(numFrames) {
+        // Nearest rank percentiles
+        std::vector<float>::iterator p50 = frameTimes.begin() + (numFrames - 1)/2;
+        std::nth_element(frameTimes.begin(), p50, frameTimes.end());
+        m_frameTimeP50 = *p50;
+        std::vector<float>::iterator p99 = frameTimes.begin() + (99*(numFrames - 1))/100;
+        std::nth_element(frameTimes.begin(), p99, frameTimes.end());
+        m_frameTimeP99 = *p99;
+        m_solverMemory = m_window.back().solverMemory/double(1 << 20);
+    } else {
+        m_frameTimeP50 = 0;
+        m_frameTimeP99 = 0;
+    }
+    m_residentMemory = residentSetSize()/double(1 << 20);
+    m_behind = numFrames && m_frameTimeP50 > 1.25*m_targetFrameTime;
+    emit updated();
+}
+
+void WavesTelemetry::setUpdateInterval(int interval)
+{
+    if(m_updateInterval == interval || interval <= 0) return;
+    m_updateInterval = interval;
+    m_timer.start(m_updateInterval);
+    emit updateIntervalChanged(interval);
+}
+
+void WavesTelemetry::setWindow(double window)
+{
+    if(m_windowLength == window || window <= 0) return;
+    m_windowLength = window;
+    emit windowChanged(window);
+}
+
+void WavesTelemetry::setTargetFrameTime(double targetFrameTime)
+{
+    if(m_targetFrameTime == targetFrameTime || targetFrameTime <= 0) return;
+    m_targetFrameTime = targetFrameTime;
+    emit targetFrameTimeChanged(targetFrameTime);
+}
@@ -0,0 +1,116 @@
+#ifndef WAVESTELEMETRY_H
+#define WAVESTELEMETRY_H
+#include <QObject>
+#include <QTimer>
+#include <deque>
+#include "cpringbuffer.h"
+
+// Timings of one frame of the Waves item, in milliseconds
+class TelemetryFrame
+{
+public:
+    qint64 time;
+    float  frameTime;
+    int    steps;
+    qint64 cellUpdates;
+    float  stepTime;
+    float  normalsTime;
+    float  uploadTime;
+    float  renderTime;
+    float  syncTime;
+    qint64 solverMemory;
+};
+
+// Rolling window statistics of the simulation and rendering for QML overlays and for apps that
+// embed Waves and log them. The render thread pushes one TelemetryFrame per frame into a ring
+// buffer, which neither locks nor allocates, and a timer on the thread that owns the object
+// drains it every updateInterval milliseconds, recomputes the statistics over the last window
+// seconds and emits updated(). Stage and frame times are in milliseconds per frame, memory in
+// megabytes. behind is set when the median frame takes more than a quarter longer than
+// targetFrameTime, that is when the panel no longer keeps up with the display.
+class WavesTelemetry : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(double stepsPerSecond READ stepsPerSecond NOTIFY updated)
+    Q_PROPERTY(double cellUpdatesPerSecond READ cellUpdatesPerSecond NOTIFY updated)
+    Q_PROPERTY(double framesPerSecond READ framesPerSecond NOTIFY updated)
+    Q_PROPERTY(double stepTime READ stepTime NOTIFY updated)
+    Q_PROPERTY(double normalsTime READ normalsTime NOTIFY updated)
+    Q_PROPERTY(double uploadTime READ uploadTime NOTIFY updated)
+    Q_PROPERTY(double renderTime READ renderTime NOTIFY updated)
+    Q_PROPERTY(double syncTime READ syncTime NOTIFY updated)
+    Q_PROPERTY(double frameTimeP50 READ frameTimeP50 NOTIFY updated)
+    Q_PROPERTY(double frameTimeP99 READ frameTimeP99 NOTIFY updated)
+    Q_PROPERTY(double residentMemory READ residentMemory NOTIFY updated)
+    Q_PROPERTY(double solverMemory READ solverMemory NOTIFY updated)
+    Q_PROPERTY(bool behind READ behind NOTIFY updated)
+    Q_PROPERTY(int updateInterval READ updateInterval WRITE setUpdateInterval NOTIFY updateIntervalChanged)
+    Q_PROPERTY(double window READ window WRITE setWindow NOTIFY windowChanged)
+    Q_PROPERTY(double targetFrameTime READ targetFrameTime WRITE setTargetFrameTime NOTIFY targetFrameTimeChanged)
+
+private:
+    CPRingBuffer<TelemetryFrame> m_frames;
+    std::deque<TelemetryFrame> m_window;
+    QTimer m_timer;
+    int    m_updateInterval;
+    double m_windowLength;
+    double m_targetFrameTime;
+
+    // Timer totals at the previous frame, only touched by the render thread
+    double m_lastStepTime;
+    double m_lastNormalsTime;
+    double m_lastUploadTime;
+    double m_lastRenderTime;
+    double m_lastSyncTime;
+
+    double m_stepsPerSecond;
+    double m_cellUpdatesPerSecond;
+    double m_framesPerSecond;
+    double m_stepTime;
+    double m_normalsTime;
+    double m_uploadTime;
+    double m_renderTime;
+    double m_syncTime;
+    double m_frameTimeP50;
+    double m_frameTimeP99;
+    double m_residentMemory;
+    double m_solverMemory;
+    bool   m_behind;
+
+public:
+    explicit WavesTelemetry(QObject *parent = 0);
+    TelemetryFrame addFrame(double frameTime, int steps, qint64 cellUpdates, qint64 solverMemory);
+    static qint64 now();
+    static qint64 residentSetSize();
+
+    double stepsPerSecond() const { return m_stepsPerSecond; }
+    double cellUpdatesPerSecond() const { return m_cellUpdatesPerSecond; }
+    double framesPerSecond() const { return m_framesPerSecond; }
+    double stepTime() const { return m_stepTime; }
+    double normalsTime() const { return m_normalsTime; }
+    double uploadTime() const { return m_uploadTime; }
+    double renderTime() const { return m_renderTime; }
+    double syncTime() const { return m_syncTime; }
+    double frameTimeP50() const { return m_frameTimeP50; }
+    double frameTimeP99() const { return m_frameTimeP99; }
+    double residentMemory() const { return m_residentMemory; }
+    double solverMemory() const { return m_solverMemory; }
+    bool behind() const { return m_behind; }
+    int updateInterval() const { return m_updateInterval; }
+    double window() const { return m_windowLength; }
+    double targetFrameTime() const { return m_targetFrameTime; }
+
+public slots:
+    void update();
+    void setUpdateInterval(int interval);
+    void setWindow(double window);
+    void setTargetFrameTime(double targetFrameTime);
+
+signals:
+    void updated();
+    void updateIntervalChanged(int interval);
+    void windowChanged(double window);
+    void targetFrameTimeChanged(double targetFrameTime);
+};
+
+#endif // WAVESTELEMETRY_H